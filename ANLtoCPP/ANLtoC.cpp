@@ -7,10 +7,19 @@
 #include "ANLtoC.h"
 #include <string>
 #include <unordered_map>
+#include <map>
 #include <array>
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <initializer_list>
+#include <limits>
 #include <accidental-noise-library/VM/kernel.h>
 #include <sstream>
 #include <tuple>
+#include <unordered_set>
 #include <vector>
 
 using namespace anl;
@@ -27,6 +36,10 @@ namespace ANLtoC {
 namespace ANLtoC {
 
 	std::string InstructionToElement(ANLtoC_EmitData& Data, unsigned int index, std::vector<FunctionData> &FunctionList);
+	std::string ColorToElement(ANLtoC_EmitData& Data, unsigned int index, std::vector<FunctionData> &FunctionList);
+	bool IsColorNode(ANLtoC_EmitData& Data, unsigned int index);
+	const char* DomainOpFormat(unsigned int opcode);
+	std::uint64_t InputDependency(ANLtoC_EmitData& Data, unsigned int index);
 
 	std::string ToString(double d)
 	{
@@ -36,6 +49,59 @@ namespace ANLtoC {
 		return ss.str();
 	}
 
+	// whether Name appears in generated Code as a whole identifier
+	bool UsesIdentifier(const std::string& Code, const std::string& Name)
+	{
+		auto IsIdentifierChar = [](char c) { return std::isalnum((unsigned char)c) || c == '_'; };
+		for (std::size_t At = Code.find(Name); At != std::string::npos; At = Code.find(Name, At + 1))
+		{
+			const std::size_t End = At + Name.size();
+			if ((At == 0 || !IsIdentifierChar(Code[At - 1])) && (End == Code.size() || !IsIdentifierChar(Code[End])))
+				return true;
+		}
+		return false;
+	}
+
+	// a parameter of a generated function, left unnamed when Body never reads it so -Wunused-parameter stays quiet
+	std::string Parameter(const std::string& Body, const std::string& Type, const std::string& Name, const std::string& Suffix = "")
+	{
+		return (UsesIdentifier(Body, Name) ? Type + " " + Name : Type) + Suffix;
+	}
+
+	// the parameter list of a function returning Expression for one node, called with (EvalPoint, NamedInput, CacheIsValid, Cache)
+	std::string NodeParameters(const std::string& Expression)
+	{
+		return Parameter(Expression, "const Point", "EvalPoint") + ", " + Parameter(Expression, "const ANL_CPP_NamedInput&", "NamedInput") + ", " +
+			Parameter(Expression, "bool", "CacheIsValid", "[]") + ", " + Parameter(Expression, "double", "Cache", "[]");
+	}
+
+	// The cache locals of a generated function running Code, leaving out the ones Code never refers to.
+	// ResetCache is cleared along with CacheIsValid.
+	std::string CacheLocals(const std::string& Code, int CacheSize, std::string& ResetCache)
+	{
+		const std::string Size = std::to_string(std::max(CacheSize, 1));
+		std::string Locals;
+		if (UsesIdentifier(Code, "CacheIsValid"))
+			Locals += "\tbool CacheIsValid[" + Size + "];\n";
+		else
+			ResetCache.clear();
+		if (UsesIdentifier(Code, "Cache"))
+			Locals += "\tdouble Cache[" + Size + "];\n";
+		return Locals;
+	}
+
+	// entry points keep one signature whatever the kernel reads, so the Parameters Code never reads are marked as used
+	std::string UnusedEntryParameters(const std::string& Code, std::initializer_list<const char*> Parameters)
+	{
+		std::string Statements;
+		for (const char* Name : Parameters)
+		{
+			if (!UsesIdentifier(Code, Name))
+				Statements += std::string("\t(void)") + Name + ";\n";
+		}
+		return Statements;
+	}
+
 	bool IsOpCacheCandidate(InstructionListType& k, unsigned int index)
 	{
 		SInstruction& i = k[index];
@@ -127,114 +193,1645 @@ namespace ANLtoC {
 		return IsInput;
 	}
 
+	// for each of the six Point components, a bit mask of the grid loops it varies with
+	typedef std::array<unsigned int, 6> DomainDependency;
+
+	struct GridLoop
+	{
+		std::string Variable;
+		std::string Count;
+		// statements placing EvalPoint at the loop's current sample and at its first sample
+		std::string SetCoordinate;
+		std::string SetStart;
+	};
+
+	struct GridHoist
+	{
+		std::string Name;
+		std::string Expression;
+		unsigned int Mask;
+		// number of outer loops entered before evaluation, any remaining loops in the mask index an array
+		unsigned int Scope;
+		unsigned int ArrayLoops;
+	};
+
+	struct GridEmitData
+	{
+		// ordered innermost first, bit n of a dependency mask refers to Loops[n]
+		std::vector<GridLoop> Loops;
+		int Dimensions;
+		// parallel to ANLtoC_EmitData::DomainInputStack
+		std::vector<DomainDependency> DomainMaskStack;
+		// mask of the hoisted values referenced by the matching DomainInputStack entry
+		std::vector<unsigned int> DomainReferenceStack;
+		// mask of the hoist currently being emitted, nested hoists must depend on strictly fewer loops
+		unsigned int EnclosingMask;
+		std::vector<GridHoist> Hoists;
+		// keyed by kernel index and domain expression
+		std::unordered_map<std::string, std::size_t> HoistLookup;
+		std::map<std::pair<unsigned int, DomainDependency>, unsigned int> DependencyMemo;
+	};
+
+	// a region buffer of the retained evaluator, recomputed when a named input in Mask changes
+	struct RetainedBuffer
+	{
+		std::string Expression;
+		std::uint64_t Mask;
+	};
+
+	struct RetainEmitData
+	{
+		// bit of each named input, inputs past the last bit share it
+		std::unordered_map<std::string, std::uint64_t> InputBits;
+		// named inputs the current domain depends on, parallel to ANLtoC_EmitData::DomainInputStack
+		std::vector<std::uint64_t> DomainMaskStack;
+		// mask of the buffer currently being emitted, nested buffers must depend on strictly fewer inputs
+		std::uint64_t EnclosingMask;
+		std::vector<RetainedBuffer> Buffers;
+		// keyed by kernel index and domain expression
+		std::unordered_map<std::string, std::size_t> BufferLookup;
+		std::unordered_map<unsigned int, std::uint64_t> DependencyMemo;
+	};
+
+	// a coefficient of an affine domain transform, either known at transpile time or an expression
+	// that does not vary per sample and is stored to the cache by the per call prologue
+	struct AffineCoefficient
+	{
+		bool IsConstant;
+		double Value;
+		std::string Expression;
+		// a zero the VM never computes, such as an entry of the identity, unlike a zero amount it
+		// absorbs any factor including NaN and infinity
+		bool IsAbsent;
+	};
+
+	// Result[r] = sum over c of Matrix[r][c] * Point[c], plus Offset[r]
+	struct AffineDomain
+	{
+		std::array<std::array<AffineCoefficient, 6>, 6> Matrix;
+		std::array<AffineCoefficient, 6> Offset;
+	};
+
+	// the domain is Transform applied to the Point expression Base
+	struct DomainInput
+	{
+		std::string Base;
+		AffineDomain Transform;
+		// how far Base moves per unit of the sample coordinates, unknown below a per-sample scale
+		bool IsScaleKnown;
+		AffineCoefficient BaseScale;
+	};
+
 	struct ANLtoC_EmitData
 	{
 		InstructionListType& k;
-		std::vector<std::string> DomainInputStack;
-		// maps our kernal index to our cache index
-		std::unordered_map<unsigned int, unsigned int> KernalToCacheMap;
+		std::vector<DomainInput> DomainInputStack;
+		// maps our kernal index and domain expression to our cache index
+		std::unordered_map<std::string, unsigned int> KernalToCacheMap;
 		int CacheSize = 0;
-
-		ANLtoC_EmitData(InstructionListType& k) : k(k) {}
+		// Point::dimensions of the function being emitted, 0 when it is only known at runtime
+		int Dimensions = 0;
+		// statements run once per call before any sample is evaluated, with the cache slot each expression was stored to
+		std::vector<std::string> Prologue;
+		std::unordered_map<std::string, int> PrologueSlots;
+		// body of each emitted domain transform function and its name
+		std::unordered_map<std::string, std::string> DomainTransforms;
+		std::vector<FunctionData> DomainTransformList;
+		std::unordered_map<unsigned int, bool> CoordinateFreeMemo;
+		std::unordered_map<unsigned int, bool> ColorMemo;
+		// only set while emitting a grid mapping function
+		GridEmitData* Grid = nullptr;
+		// only set while emitting the retained evaluator
+		RetainEmitData* Retain = nullptr;
+		TranspileOptions Options;
+		// Options.Profile when it was gathered for this kernel
+		const KernelProfile* Profile = nullptr;
+		// functions subgraphs were outlined to, keyed by index and domain expression
+		std::unordered_map<std::string, std::string> Outlined;
+		// the FunctionForIndex functions, keyed by index and domain expression
+		std::unordered_map<std::string, std::string> IndexFunctions;
+		// instructions without a native translation, evaluated by the embedded noise VM
+		std::map<unsigned int, std::string> VMFallbacks;
+		// number of basis calls given a window of their own during map calls
+		unsigned int CoherentSites = 0;
+		// the lookup function and varying input of each tabulated subgraph, no name when it isn't tabulated
+		std::unordered_map<unsigned int, std::pair<std::string, unsigned int>> Tabulated;
+		// only set while emitting the exact function of a tabulated subgraph, which reads its input from a parameter
+		std::unordered_map<unsigned int, std::string> Substitutions;
+
+		ANLtoC_EmitData(InstructionListType& k, const TranspileOptions& Options) : k(k), Options(Options) {}
 	};
 
-
-	// returns function name, stores function implementation in function list
-	std::string SetupFunctionCall(ANLtoC_EmitData& Data, unsigned int index, std::vector<FunctionData> &FunctionList)
+	// number of leading sources_ an opcode evaluates in the current domain, domain operators excluded
+	unsigned int GetSourceCount(unsigned int opcode)
 	{
-		std::string FunctionName = "FunctionForIndex_" + std::to_string(index);
+		switch (opcode)
+		{
+		case OP_NOP:
+		case OP_Seed:
+		case OP_Constant:
+		case OP_NamedInput:
+		case OP_Color:
+		case OP_X:
+		case OP_Y:
+		case OP_Z:
+		case OP_W:
+		case OP_U:
+		case OP_V:
+		case OP_Radial:
+		case OP_HexBump:
+			return 0;
+
+		case OP_SimplexBasis:
+		case OP_HexTile:
+		case OP_Abs:
+		case OP_Cos:
+		case OP_Sin:
+		case OP_Tan:
+		case OP_ACos:
+		case OP_ASin:
+		case OP_ATan:
+		case OP_Grayscale:
+		case OP_ExtractRed:
+		case OP_ExtractGreen:
+		case OP_ExtractBlue:
+		case OP_ExtractAlpha:
+			return 1;
+
+		case OP_ValueBasis:
+		case OP_GradientBasis:
+		case OP_Add:
+		case OP_Subtract:
+		case OP_Multiply:
+		case OP_Divide:
+		case OP_Bias:
+		case OP_Gain:
+		case OP_Max:
+		case OP_Min:
+		case OP_Pow:
+		case OP_Tiers:
+		case OP_SmoothTiers:
+			return 2;
+
+		case OP_Blend:
+		case OP_Sigmoid:
+		case OP_Clamp:
+			return 3;
+
+		case OP_CombineRGBA:
+			return 4;
 
-		// see if we already have a function setup
-		for (FunctionData& d : FunctionList)
+		case OP_Select:
+			return 5;
+
+		case OP_CellularBasis:
+			return 10;
+
+		default:
+			return 0;
+		}
+	}
+
+	// number of leading sources_ an opcode reads at all, every slot for opcodes without a translation
+	unsigned int GetOperandCount(unsigned int opcode)
+	{
+		switch (opcode)
 		{
-			if (d.RelatedIndex == index)
-				return FunctionName;
+		case OP_NOP:
+		case OP_Seed:
+		case OP_Constant:
+		case OP_NamedInput:
+		case OP_Color:
+		case OP_X:
+		case OP_Y:
+		case OP_Z:
+		case OP_W:
+		case OP_U:
+		case OP_V:
+		case OP_Radial:
+		case OP_HexBump:
+			return 0;
+
+		case OP_RotateDomain:
+			return 5;
+
+		default:
+			if (DomainOpFormat(opcode) != nullptr)
+				return 2;
+			switch (opcode)
+			{
+			case OP_DX: case OP_DY: case OP_DZ: case OP_DW: case OP_DU: case OP_DV:
+				return 2;
+			}
+			if (GetSourceCount(opcode) == 0)
+				return sizeof(SInstruction::sources_) / sizeof(SInstruction::sources_[0]);
+			return GetSourceCount(opcode);
 		}
+	}
 
-		std::string function = 
-			"double " + FunctionName + "(const Point EvalPoint, const ANL_CPP_NamedInput& NamedInput, bool CacheIsValid[], double Cache[])\n"
-			"{\n"
-			"\treturn ";
+	// times a node was evaluated in the profiled run
+	std::uint64_t ProfileReached(const ANLtoC_EmitData& Data, unsigned int index)
+	{
+		auto ReachedItr = Data.Profile->Reached.find(index);
+		return ReachedItr == Data.Profile->Reached.end() ? 0 : ReachedItr->second;
+	}
 
-		function += InstructionToElement(Data, index, FunctionList);
+	// With a profile, any scalar node evaluated more than once per sample on average is cached and nothing
+	// else is. Leaves are cheaper to read again than to cache.
+	bool IsCacheCandidate(ANLtoC_EmitData& Data, unsigned int index)
+	{
+		if (Data.Profile == nullptr)
+			return IsOpCacheCandidate(Data.k, index);
+		return GetOperandCount(Data.k[index].opcode_) > 0 && !IsColorNode(Data, index) &&
+			ProfileReached(Data, index) > Data.Profile->Samples;
+	}
 
-		function +=
-			";\n}\n";
+	// inputs evaluated for fewer than one in this many samples are cold
+	const std::uint64_t ProfileColdRatio = 4;
 
-		// Functions are pushed on the list in the order that is requred for proper dependency managment
-		FunctionList.push_back({ function, index });
+	// With a profile, only the select inputs that are cold move to their own function, hot ones stay inline.
+	bool IsFunctionCandidate(ANLtoC_EmitData& Data, unsigned int index)
+	{
+		if (!IsOpFunctionCandidate(Data.k, index))
+			return false;
+		return Data.Profile == nullptr || ProfileReached(Data, index) * ProfileColdRatio < Data.Profile->Samples;
+	}
+
+	unsigned int CoordinateDependency(ANLtoC_EmitData& Data, unsigned int index, const DomainDependency& Domain);
 
-		return FunctionName;
+	// the domain seen by sources_[0] of a domain operator
+	DomainDependency ApplyDomainDependency(ANLtoC_EmitData& Data, const SInstruction& i, const DomainDependency& Domain)
+	{
+		DomainDependency Result = Domain;
+		switch (i.opcode_)
+		{
+		case OP_ScaleDomain:
+		case OP_TranslateDomain:
+		{
+			unsigned int Amount = CoordinateDependency(Data, i.sources_[1], Domain);
+			for (unsigned int& Axis : Result)
+				Axis |= Amount;
+			break;
+		}
+		case OP_ScaleX: case OP_TranslateX: case OP_DX: Result[0] |= CoordinateDependency(Data, i.sources_[1], Domain); break;
+		case OP_ScaleY: case OP_TranslateY: case OP_DY: Result[1] |= CoordinateDependency(Data, i.sources_[1], Domain); break;
+		case OP_ScaleZ: case OP_TranslateZ: case OP_DZ: Result[2] |= CoordinateDependency(Data, i.sources_[1], Domain); break;
+		case OP_ScaleW: case OP_TranslateW: case OP_DW: Result[3] |= CoordinateDependency(Data, i.sources_[1], Domain); break;
+		case OP_ScaleU: case OP_TranslateU: case OP_DU: Result[4] |= CoordinateDependency(Data, i.sources_[1], Domain); break;
+		case OP_ScaleV: case OP_TranslateV: case OP_DV: Result[5] |= CoordinateDependency(Data, i.sources_[1], Domain); break;
+		case OP_RotateDomain:
+		{
+			unsigned int Rotated = Domain[0] | Domain[1] | Domain[2];
+			for (int s = 1; s <= 4; ++s)
+				Rotated |= CoordinateDependency(Data, i.sources_[s], Domain);
+			Result[0] = Result[1] = Result[2] = Rotated;
+			break;
+		}
+		default:
+			break;
+		}
+		return Result;
 	}
-	
-	// replaces ^ with the Point structure representing the current coordinates
-	// replaces ~ with an evaluated statment
-	template<std::size_t size>
-	std::string RecursiveFormat(ANLtoC_EmitData& Data, std::string Format, std::array<unsigned int, size> args, std::vector<FunctionData> &FunctionList)
+
+	// returns the mask of grid loops the value at index varies with when evaluated in Domain
+	unsigned int CoordinateDependency(ANLtoC_EmitData& Data, unsigned int index, const DomainDependency& Domain)
 	{
-		int ArgIndex = 0;
-		for (int i = 0; i < Format.size(); ++i)
+		GridEmitData& Grid = *Data.Grid;
+		auto Key = std::make_pair(index, Domain);
+		auto MemoItr = Grid.DependencyMemo.find(Key);
+		if (MemoItr != Grid.DependencyMemo.end())
+			return MemoItr->second;
+
+		SInstruction& i = Data.k[index];
+		unsigned int BasisMask = 0;
+		for (int d = 0; d < Grid.Dimensions; ++d)
+			BasisMask |= Domain[d];
+
+		unsigned int Mask = 0;
+		switch (i.opcode_)
 		{
-			if (Format[i] == '~')
-			{
-				if (ArgIndex >= args.size())
-					return "ArgIndex ERROR!";
-				Format.erase(i, 1);
-				std::string StringToInsert;
+		case OP_X: Mask = Domain[0]; break;
+		case OP_Y: Mask = Domain[1]; break;
+		case OP_Z: Mask = Domain[2]; break;
+		case OP_W: Mask = Domain[3]; break;
+		case OP_U: Mask = Domain[4]; break;
+		case OP_V: Mask = Domain[5]; break;
 
-				unsigned int CacheIndex = 0;
-				const bool IsCachable = IsOpCacheCandidate(Data.k, args[ArgIndex]);
-				const bool IsFunctionCandidate = IsOpFunctionCandidate(Data.k, args[ArgIndex]);
-				if(IsCachable)
-				{
-					auto CacheIndexItr = Data.KernalToCacheMap.find(args[ArgIndex]);
-					if (CacheIndexItr == Data.KernalToCacheMap.end()) {
-						Data.KernalToCacheMap[args[ArgIndex]] = Data.CacheSize;
-						CacheIndex = Data.CacheSize;
-						Data.CacheSize++;
-					}
-					else {
-						CacheIndex = CacheIndexItr->second;
-					}
-					StringToInsert += "(CacheIsValid[" + std::to_string(CacheIndex) + "] ? (Cache[" + std::to_string(CacheIndex) + "]) : (CacheIsValid[" + std::to_string(CacheIndex) + "]=true,Cache[" + std::to_string(CacheIndex) + "]=(";
-					//StringToInsert += "(CacheIsValid[" + std::to_string(args[ArgIndex]) + "] ? (Cache[" + std::to_string(args[ArgIndex]) + "]) : (CacheIsValid[" + std::to_string(args[ArgIndex]) + "]=true,Cache[" + std::to_string(args[ArgIndex]) + "]=(";
-				}
-				if (IsFunctionCandidate)
-				{
-					std::string FunctionName = SetupFunctionCall(Data, args[ArgIndex], FunctionList);
-					StringToInsert += FunctionName + "(EvalPoint, NamedInput, CacheIsValid, Cache)";
-				}
-				else
-				{
-					StringToInsert += InstructionToElement(Data, args[ArgIndex], FunctionList);
-				}
+		case OP_ValueBasis:
+		case OP_GradientBasis:
+		case OP_SimplexBasis:
+		case OP_CellularBasis:
+			Mask = BasisMask;
+			break;
 
-				if (IsCachable)
-				{
-					StringToInsert += ")))";
-				}
+		case OP_HexTile:
+		case OP_HexBump:
+			Mask = Domain[0] | Domain[1];
+			break;
 
-				Format.insert(i, StringToInsert);
-				i += (int)StringToInsert.size() - 1;
-				ArgIndex++;
+		case OP_Radial:
+			for (unsigned int Axis : Domain)
+				Mask |= Axis;
+			break;
+
+		case OP_ScaleDomain:
+		case OP_ScaleX:
+		case OP_ScaleY:
+		case OP_ScaleZ:
+		case OP_ScaleW:
+		case OP_ScaleU:
+		case OP_ScaleV:
+		case OP_TranslateDomain:
+		case OP_TranslateX:
+		case OP_TranslateY:
+		case OP_TranslateZ:
+		case OP_TranslateW:
+		case OP_TranslateU:
+		case OP_TranslateV:
+		case OP_RotateDomain:
+			Mask = CoordinateDependency(Data, i.sources_[0], ApplyDomainDependency(Data, i, Domain));
+			break;
+
+		case OP_DX:
+		case OP_DY:
+		case OP_DZ:
+		case OP_DW:
+		case OP_DU:
+		case OP_DV:
+			Mask = CoordinateDependency(Data, i.sources_[0], Domain)
+				| CoordinateDependency(Data, i.sources_[0], ApplyDomainDependency(Data, i, Domain))
+				| CoordinateDependency(Data, i.sources_[1], Domain);
+			break;
+
+		case OP_NOP:
+		case OP_Seed:
+		case OP_Constant:
+		case OP_NamedInput:
+			break;
+
+		default:
+			if (GetSourceCount(i.opcode_) == 0) {
+				// unknown to the analysis, never treat it as invariant
+				Mask = ~0u;
 			}
-			else if (Format[i] == '^')
+			break;
+		}
+
+		for (unsigned int s = 0; s < GetSourceCount(i.opcode_); ++s)
+			Mask |= CoordinateDependency(Data, i.sources_[s], Domain);
+
+		Grid.DependencyMemo[Key] = Mask;
+		return Mask;
+	}
+
+	// true if the value at index is the same for every sample of a call
+	bool IsCoordinateFree(ANLtoC_EmitData& Data, unsigned int index)
+	{
+		auto MemoItr = Data.CoordinateFreeMemo.find(index);
+		if (MemoItr != Data.CoordinateFreeMemo.end())
+			return MemoItr->second;
+
+		SInstruction& i = Data.k[index];
+		unsigned int SourceCount = GetSourceCount(i.opcode_);
+		bool IsFree = true;
+		switch (i.opcode_)
+		{
+		case OP_NOP:
+		case OP_Seed:
+		case OP_Constant:
+		case OP_NamedInput:
+			break;
+
+		case OP_ScaleDomain:
+		case OP_ScaleX:
+		case OP_ScaleY:
+		case OP_ScaleZ:
+		case OP_ScaleW:
+		case OP_ScaleU:
+		case OP_ScaleV:
+		case OP_TranslateDomain:
+		case OP_TranslateX:
+		case OP_TranslateY:
+		case OP_TranslateZ:
+		case OP_TranslateW:
+		case OP_TranslateU:
+		case OP_TranslateV:
+		case OP_DX:
+		case OP_DY:
+		case OP_DZ:
+		case OP_DW:
+		case OP_DU:
+		case OP_DV:
+			SourceCount = 2;
+			break;
+		case OP_RotateDomain:
+			SourceCount = 5;
+			break;
+
+		default:
+			// coordinates, basis functions and anything unknown
+			if (SourceCount == 0)
+				IsFree = false;
+			break;
+		}
+
+		for (unsigned int s = 0; s < SourceCount && IsFree; ++s)
+			IsFree = IsCoordinateFree(Data, i.sources_[s]);
+
+		Data.CoordinateFreeMemo[index] = IsFree;
+		return IsFree;
+	}
+
+	// unlike ToString the result is exact for every magnitude
+	std::string ToLiteral(double d)
+	{
+		if (std::isnan(d))
+			return "std::numeric_limits<double>::quiet_NaN()";
+		if (std::isinf(d))
+			return d > 0.0 ? "std::numeric_limits<double>::infinity()" : "-std::numeric_limits<double>::infinity()";
+		std::stringstream ss;
+		ss.precision(std::numeric_limits<double>::max_digits10 - 1);
+		ss << std::scientific << d;
+		return ss.str();
+	}
+
+	AffineCoefficient Literal(double d)
+	{
+		return { true, d, ToLiteral(d), false };
+	}
+
+	AffineCoefficient Absent()
+	{
+		return { true, 0.0, ToLiteral(0.0), true };
+	}
+
+	AffineCoefficient Runtime(const std::string& Expression)
+	{
+		return { false, 0.0, Expression, false };
+	}
+
+	// moves a runtime coefficient into the prologue so that samples only read a cache slot
+	AffineCoefficient Materialize(ANLtoC_EmitData& Data, const AffineCoefficient& a)
+	{
+		if (a.IsConstant)
+			return a;
+
+		auto SlotItr = Data.PrologueSlots.find(a.Expression);
+		if (SlotItr != Data.PrologueSlots.end())
+			return Runtime("Cache[" + std::to_string(SlotItr->second) + "]");
+
+		// already a cache slot
+		if (a.Expression.compare(0, 6, "Cache[") == 0 && a.Expression.find_first_not_of("0123456789", 6) == a.Expression.size() - 1)
+			return a;
+
+		int Slot = Data.CacheSize++;
+		Data.PrologueSlots[a.Expression] = Slot;
+		Data.Prologue.push_back("Cache[" + std::to_string(Slot) + "] = " + a.Expression + ";");
+		return Runtime("Cache[" + std::to_string(Slot) + "]");
+	}
+
+	AffineCoefficient Sum(const AffineCoefficient& a, const AffineCoefficient& b)
+	{
+		if (a.IsAbsent)
+			return b;
+		if (b.IsAbsent)
+			return a;
+		if (a.IsConstant && b.IsConstant)
+			return Literal(a.Value + b.Value);
+		if (a.IsConstant && a.Value == 0.0)
+			return b;
+		if (b.IsConstant && b.Value == 0.0)
+			return a;
+		return Runtime("(" + a.Expression + " + " + b.Expression + ")");
+	}
+
+	AffineCoefficient Difference(const AffineCoefficient& a, const AffineCoefficient& b)
+	{
+		if (b.IsAbsent)
+			return a;
+		if (a.IsConstant && b.IsConstant)
+			return Literal(a.Value - b.Value);
+		if (b.IsConstant && b.Value == 0.0)
+			return a;
+		if (a.IsConstant && a.Value == 0.0)
+			return Runtime("(-" + b.Expression + ")");
+		return Runtime("(" + a.Expression + " - " + b.Expression + ")");
+	}
+
+	AffineCoefficient Product(const AffineCoefficient& a, const AffineCoefficient& b)
+	{
+		// a zero amount times a NaN or infinite runtime value isn't zero, only absent terms are dropped
+		if (a.IsAbsent || b.IsAbsent)
+			return Absent();
+		if (a.IsConstant && b.IsConstant)
+			return Literal(a.Value * b.Value);
+		if (a.IsConstant && a.Value == 1.0)
+			return b;
+		if (b.IsConstant && b.Value == 1.0)
+			return a;
+		return Runtime("(" + a.Expression + " * " + b.Expression + ")");
+	}
+
+	AffineCoefficient Quotient(const AffineCoefficient& a, const AffineCoefficient& b)
+	{
+		if (a.IsConstant && b.IsConstant)
+			return Literal(a.Value / b.Value);
+		return Runtime("(" + a.Expression + " / " + b.Expression + ")");
+	}
+
+	AffineCoefficient Function(const std::string& Name, double (*Evaluate)(double), const AffineCoefficient& a)
+	{
+		if (a.IsConstant)
+			return Literal(Evaluate(a.Value));
+		return Runtime(Name + "(" + a.Expression + ")");
+	}
+
+	// ScaleDomain and TranslateDomain only affect the components in use by Point::dimensions
+	AffineCoefficient ActiveComponent(ANLtoC_EmitData& Data, int Component, const AffineCoefficient& Active, const AffineCoefficient& Inactive)
+	{
+		const int InactiveDimensions[] = { 2, 3, 4 };
+		std::string Condition;
+		bool IsActive = true;
+		for (int d = 0; d < Component - 1 && d < 3; ++d)
+		{
+			if (Data.Dimensions == InactiveDimensions[d])
+				IsActive = false;
+			Condition += std::string(Condition.empty() ? "" : " && ") + "EvalPoint.dimensions != " + std::to_string(InactiveDimensions[d]);
+		}
+
+		if (Condition.empty() || Data.Dimensions != 0)
+			return IsActive ? Active : Inactive;
+		if (Active.IsConstant && Inactive.IsConstant && Active.Value == Inactive.Value)
+			return Active;
+		return Materialize(Data, Runtime("((" + Condition + ") ? " + Active.Expression + " : " + Inactive.Expression + ")"));
+	}
+
+	AffineDomain IdentityAffine()
+	{
+		AffineDomain Identity;
+		for (int r = 0; r < 6; ++r)
+		{
+			for (int c = 0; c < 6; ++c)
+				Identity.Matrix[r][c] = r == c ? Literal(1.0) : Absent();
+			Identity.Offset[r] = Absent();
+		}
+		return Identity;
+	}
+
+	bool IsIdentity(const AffineDomain& a)
+	{
+		for (int r = 0; r < 6; ++r)
+		{
+			for (int c = 0; c < 6; ++c)
+			{
+				if (r == c ? !a.Matrix[r][c].IsConstant || a.Matrix[r][c].Value != 1.0 : !a.Matrix[r][c].IsAbsent)
+					return false;
+			}
+			if (!a.Offset[r].IsConstant || a.Offset[r].Value != 0.0)
+				return false;
+		}
+		return true;
+	}
+
+	// the transform that applies First and then Second
+	AffineDomain ComposeAffine(ANLtoC_EmitData& Data, const AffineDomain& Second, const AffineDomain& First)
+	{
+		AffineDomain Result;
+		for (int r = 0; r < 6; ++r)
+		{
+			for (int c = 0; c < 6; ++c)
+			{
+				AffineCoefficient Accumulated = Absent();
+				for (int k = 0; k < 6; ++k)
+					Accumulated = Sum(Accumulated, Product(Second.Matrix[r][k], First.Matrix[k][c]));
+				Result.Matrix[r][c] = Materialize(Data, Accumulated);
+			}
+
+			AffineCoefficient Accumulated = Second.Offset[r];
+			for (int k = 0; k < 6; ++k)
+				Accumulated = Sum(Accumulated, Product(Second.Matrix[r][k], First.Offset[k]));
+			Result.Offset[r] = Materialize(Data, Accumulated);
+		}
+		return Result;
+	}
+
+	AffineCoefficient AffineAmount(ANLtoC_EmitData& Data, unsigned int index, std::vector<FunctionData>& FunctionList)
+	{
+		SInstruction& i = Data.k[index];
+		if (i.opcode_ == OP_Constant || i.opcode_ == OP_Seed || i.opcode_ == OP_NOP)
+			return Literal(i.outfloat_);
+
+		// prologue expressions are evaluated ahead of anything hoisted by a grid function
+		GridEmitData* Grid = Data.Grid;
+		Data.Grid = nullptr;
+		AffineCoefficient Amount = Materialize(Data, Runtime(InstructionToElement(Data, index, FunctionList)));
+		Data.Grid = Grid;
+		return Amount;
+	}
+
+	// returns false when the operator's amounts vary per sample and can't be folded into a transform
+	bool DomainOpToAffine(ANLtoC_EmitData& Data, const SInstruction& i, AffineDomain& Op, std::vector<FunctionData>& FunctionList)
+	{
+		const unsigned int AmountCount = i.opcode_ == OP_RotateDomain ? 4 : 1;
+		for (unsigned int s = 1; s <= AmountCount; ++s)
+		{
+			if (!IsCoordinateFree(Data, i.sources_[s]))
+				return false;
+		}
+
+		Op = IdentityAffine();
+		int Component = -1;
+		switch (i.opcode_)
+		{
+		case OP_ScaleDomain:
+		{
+			AffineCoefficient Amount = AffineAmount(Data, i.sources_[1], FunctionList);
+			for (int c = 0; c < 6; ++c)
+				Op.Matrix[c][c] = ActiveComponent(Data, c, Amount, Absent());
+			return true;
+		}
+		case OP_TranslateDomain:
+		{
+			AffineCoefficient Amount = AffineAmount(Data, i.sources_[1], FunctionList);
+			for (int c = 0; c < 6; ++c)
+				Op.Offset[c] = ActiveComponent(Data, c, Amount, Absent());
+			return true;
+		}
+
+		case OP_ScaleX: Component = 0; break;
+		case OP_ScaleY: Component = 1; break;
+		case OP_ScaleZ: Component = 2; break;
+		case OP_ScaleW: Component = 3; break;
+		case OP_ScaleU: Component = 4; break;
+		case OP_ScaleV: Component = 5; break;
+
+		case OP_TranslateX: case OP_DX: Component = 6; break;
+		case OP_TranslateY: case OP_DY: Component = 7; break;
+		case OP_TranslateZ: case OP_DZ: Component = 8; break;
+		case OP_TranslateW: case OP_DW: Component = 9; break;
+		case OP_TranslateU: case OP_DU: Component = 10; break;
+		case OP_TranslateV: case OP_DV: Component = 11; break;
+
+		case OP_RotateDomain:
+		{
+			// the same matrix RotateDomain builds at runtime
+			AffineCoefficient Angle = AffineAmount(Data, i.sources_[1], FunctionList);
+			AffineCoefficient ax = AffineAmount(Data, i.sources_[2], FunctionList);
+			AffineCoefficient ay = AffineAmount(Data, i.sources_[3], FunctionList);
+			AffineCoefficient az = AffineAmount(Data, i.sources_[4], FunctionList);
+			AffineCoefficient Length = Materialize(Data, Function("std::sqrt", [](double v) { return std::sqrt(v); }, Sum(Sum(Product(ax, ax), Product(ay, ay)), Product(az, az))));
+			ax = Materialize(Data, Quotient(ax, Length));
+			ay = Materialize(Data, Quotient(ay, Length));
+			az = Materialize(Data, Quotient(az, Length));
+			AffineCoefficient CosAngle = Materialize(Data, Function("std::cos", [](double v) { return std::cos(v); }, Angle));
+			AffineCoefficient SinAngle = Materialize(Data, Function("std::sin", [](double v) { return std::sin(v); }, Angle));
+			AffineCoefficient OneMinusCos = Materialize(Data, Difference(Literal(1.0), CosAngle));
+
+			Op.Matrix[0][0] = Sum(Literal(1.0), Product(OneMinusCos, Difference(Product(ax, ax), Literal(1.0))));
+			Op.Matrix[0][1] = Difference(Product(Product(OneMinusCos, ax), ay), Product(az, SinAngle));
+			Op.Matrix[0][2] = Sum(Product(ay, SinAngle), Product(Product(OneMinusCos, ax), az));
+
+			Op.Matrix[1][0] = Sum(Product(az, SinAngle), Product(Product(OneMinusCos, ax), ay));
+			Op.Matrix[1][1] = Sum(Literal(1.0), Product(OneMinusCos, Difference(Product(ay, ay), Literal(1.0))));
+			Op.Matrix[1][2] = Difference(Product(Product(OneMinusCos, ay), az), Product(ax, SinAngle));
+
+			Op.Matrix[2][0] = Difference(Product(Product(OneMinusCos, ax), az), Product(ay, SinAngle));
+			Op.Matrix[2][1] = Sum(Product(ax, SinAngle), Product(Product(OneMinusCos, ay), az));
+			Op.Matrix[2][2] = Sum(Literal(1.0), Product(OneMinusCos, Difference(Product(az, az), Literal(1.0))));
+			return true;
+		}
+
+		default:
+			return false;
+		}
+
+		AffineCoefficient Amount = AffineAmount(Data, i.sources_[1], FunctionList);
+		if (Component < 6)
+			Op.Matrix[Component][Component] = Amount;
+		else
+			Op.Offset[Component - 6] = Amount;
+		return true;
+	}
+
+	// the Point expression substituted for ^
+	std::string DomainPointExpression(ANLtoC_EmitData& Data)
+	{
+		const DomainInput& Domain = Data.DomainInputStack.back();
+		if (IsIdentity(Domain.Transform))
+		{
+			if (Domain.Base == "EvalPoint") {
+				// make a modifiable copy of this variable
+				return "Point(EvalPoint)";
+			}
+			return Domain.Base;
+		}
+
+		const char* Components[] = { "x", "y", "z", "w", "u", "v" };
+		std::string Body;
+		for (int r = 0; r < 6; ++r)
+		{
+			std::string Row;
+			bool IsUnchanged = Domain.Transform.Offset[r].IsConstant && Domain.Transform.Offset[r].Value == 0.0;
+			for (int c = 0; c < 6; ++c)
+			{
+				const AffineCoefficient& m = Domain.Transform.Matrix[r][c];
+				if (r == c ? !m.IsConstant || m.Value != 1.0 : !m.IsAbsent)
+					IsUnchanged = false;
+				if (m.IsAbsent)
+					continue;
+				std::string Term = std::string("p.") + Components[c];
+				if (!m.IsConstant || m.Value != 1.0)
+					Term = m.Expression + " * " + Term;
+				Row += (Row.empty() ? "" : " + ") + Term;
+			}
+			if (IsUnchanged)
+				continue;
+			if (!Domain.Transform.Offset[r].IsConstant || Domain.Transform.Offset[r].Value != 0.0)
+				Row += (Row.empty() ? "" : " + ") + Domain.Transform.Offset[r].Expression;
+			Body += std::string("\tr.") + Components[r] + " = " + (Row.empty() ? "0.0" : Row) + ";\n";
+		}
+
+		// only transforms with runtime coefficients read the cache
+		const bool UsesCache = UsesIdentifier(Body, "Cache");
+		auto TransformItr = Data.DomainTransforms.find(Body);
+		if (TransformItr == Data.DomainTransforms.end())
+		{
+			std::string Name = "DomainTransform_" + std::to_string(Data.DomainTransforms.size());
+			std::string Function =
+				"Point " + Name + "(const Point& p" + (UsesCache ? ", const double Cache[]" : "") + ")\n"
+				"{\n"
+				"\tPoint r = p;\n" +
+				Body +
+				"\treturn r;\n"
+				"}\n";
+			// transforms don't belong to a kernel index
+			Data.DomainTransformList.push_back({ Function, std::numeric_limits<unsigned int>::max() });
+			TransformItr = Data.DomainTransforms.insert({ Body, Name }).first;
+		}
+		return TransformItr->second + "(" + Domain.Base + (UsesCache ? ", Cache)" : ")");
+	}
+
+	// the largest distance a unit step along one sample axis moves the transformed point,
+	// the entry points only sample along x, y and z
+	AffineCoefficient TransformStretch(const AffineDomain& Transform)
+	{
+		AffineCoefficient Stretch = Literal(0.0);
+		for (int c = 0; c < 3; ++c)
+		{
+			AffineCoefficient SquaredLength = Literal(0.0);
+			for (int r = 0; r < 6; ++r)
+				SquaredLength = Sum(SquaredLength, Product(Transform.Matrix[r][c], Transform.Matrix[r][c]));
+			if (SquaredLength.IsConstant && SquaredLength.Value == 0.0)
+				continue;
+			AffineCoefficient Length = Function("std::sqrt", [](double v) { return std::sqrt(v); }, SquaredLength);
+			if (Stretch.IsConstant && Length.IsConstant)
+				Stretch = Literal(std::max(Stretch.Value, Length.Value));
+			else if (Stretch.IsConstant && Stretch.Value == 0.0)
+				Stretch = Length;
+			else
+				Stretch = Runtime("std::max(" + Stretch.Expression + ", " + Length.Expression + ")");
+		}
+		return Stretch;
+	}
+
+	// Wraps a basis with a zero mean in a weight that fades it out as its lattice cells approach the Nyquist
+	// limit of the caller's sample footprint. The weight only depends on the call, so the prologue computes it.
+	std::string FootprintCulled(ANLtoC_EmitData& Data, const std::string& Basis)
+	{
+		const DomainInput& Domain = Data.DomainInputStack.back();
+		if (!Domain.IsScaleKnown)
+			return Basis;
+		AffineCoefficient Scale = Product(Domain.BaseScale, TransformStretch(Domain.Transform));
+		if (Scale.IsConstant && Scale.Value == 0.0)
+			return Basis;
+		const std::string Weight = Materialize(Data, Runtime("FootprintWeight(Footprint * " + Scale.Expression + ")")).Expression;
+		return "(" + Weight + " > 0.0 ? " + Weight + " * " + Basis + " : 0.0)";
+	}
+
+	// the site and lattice stretch arguments of a basis call, the runtime keeps a window of lattice cells per site
+	// during map calls and only uses it while the stretch shows the samples are close enough together
+	std::string CoherentSite(ANLtoC_EmitData& Data)
+	{
+		const DomainInput& Domain = Data.DomainInputStack.back();
+		std::string Stretch = "0.0";
+		if (Domain.IsScaleKnown)
+			Stretch = Materialize(Data, Product(Domain.BaseScale, TransformStretch(Domain.Transform))).Expression;
+		return "," + std::to_string(Data.CoherentSites++) + "," + Stretch;
+	}
+
+	void PushDomain(ANLtoC_EmitData& Data, const SInstruction& i, const DomainInput& Domain)
+	{
+		Data.DomainInputStack.push_back(Domain);
+		if (Data.Retain != nullptr)
+		{
+			// the amounts of a domain operator change the value of everything evaluated below it
+			std::uint64_t Mask = Data.Retain->DomainMaskStack.back();
+			for (unsigned int s = 1; s < GetOperandCount(i.opcode_); ++s)
+				Mask |= InputDependency(Data, i.sources_[s]);
+			Data.Retain->DomainMaskStack.push_back(Mask);
+		}
+		if (Data.Grid == nullptr)
+			return;
+
+		GridEmitData& Grid = *Data.Grid;
+		Grid.DomainMaskStack.push_back(ApplyDomainDependency(Data, i, Grid.DomainMaskStack.back()));
+
+		// the domain expression can only be evaluated where every hoisted value it names is in scope
+		unsigned int ReferenceMask = Grid.DomainReferenceStack.back();
+		const std::string Prefix = "Hoisted_";
+		for (std::size_t Offset = Domain.Base.find(Prefix); Offset != std::string::npos; Offset = Domain.Base.find(Prefix, Offset + 1))
+		{
+			std::size_t HoistIndex = std::stoul(Domain.Base.substr(Offset + Prefix.size()));
+			ReferenceMask |= Grid.Hoists[HoistIndex].Mask;
+		}
+		Grid.DomainReferenceStack.push_back(ReferenceMask);
+	}
+
+	void PopDomain(ANLtoC_EmitData& Data)
+	{
+		Data.DomainInputStack.pop_back();
+		if (Data.Retain != nullptr)
+			Data.Retain->DomainMaskStack.pop_back();
+		if (Data.Grid == nullptr)
+			return;
+
+		Data.Grid->DomainMaskStack.pop_back();
+		Data.Grid->DomainReferenceStack.pop_back();
+	}
+
+	// the expression used to read a hoisted value from inside the loops it depends on
+	std::string GridIndex(const GridEmitData& Grid, unsigned int LoopMask)
+	{
+		std::string Index;
+		std::string Stride;
+		for (std::size_t n = 0; n < Grid.Loops.size(); ++n)
+		{
+			if ((LoopMask & (1u << n)) == 0)
+				continue;
+			const GridLoop& Loop = Grid.Loops[n];
+			if (Stride.empty())
+			{
+				Index = Loop.Variable;
+				Stride = Loop.Count;
+			}
+			else
+			{
+				Index = "(std::size_t)" + Loop.Variable + " * " + Stride + " + " + Index;
+				Stride += " * " + Loop.Count;
+			}
+		}
+		return Index;
+	}
+
+	std::string GridHoistReference(const GridEmitData& Grid, const GridHoist& Hoist)
+	{
+		if (Hoist.ArrayLoops == 0)
+			return Hoist.Name;
+		return Hoist.Name + "[" + GridIndex(Grid, Hoist.ArrayLoops) + "]";
+	}
+
+	// When emitting a grid mapping function, values that do not vary with every grid loop are
+	// evaluated once in an outer loop or a prepass and referenced through the returned expression.
+	bool HoistGridInvariant(ANLtoC_EmitData& Data, unsigned int index, std::vector<FunctionData>& FunctionList, std::string& Reference)
+	{
+		// the profiling build evaluates every node per sample so its counts are per sample
+		if (Data.Options.ProfileInstrumentation)
+			return false;
+		GridEmitData& Grid = *Data.Grid;
+		switch (Data.k[index].opcode_)
+		{
+			// nothing is saved by storing these
+		case OP_NOP:
+		case OP_Seed:
+		case OP_Constant:
+		case OP_NamedInput:
+		case OP_X:
+		case OP_Y:
+		case OP_Z:
+		case OP_W:
+		case OP_U:
+		case OP_V:
+			return false;
+		default:
+			break;
+		}
+
+		unsigned int Mask = CoordinateDependency(Data, index, Grid.DomainMaskStack.back());
+		if (Mask == Grid.EnclosingMask || (Mask & ~Grid.EnclosingMask) != 0)
+			return false;
+		if ((Grid.DomainReferenceStack.back() & ~Mask) != 0)
+			return false;
+
+		std::string Key = std::to_string(index) + "@" + DomainPointExpression(Data);
+		auto HoistItr = Grid.HoistLookup.find(Key);
+		if (HoistItr != Grid.HoistLookup.end())
+		{
+			Reference = GridHoistReference(Grid, Grid.Hoists[HoistItr->second]);
+			return true;
+		}
+
+		unsigned int EnclosingMask = Grid.EnclosingMask;
+		Grid.EnclosingMask = Mask;
+		std::string Expression = InstructionToElement(Data, index, FunctionList);
+		Grid.EnclosingMask = EnclosingMask;
+
+		GridHoist Hoist;
+		Hoist.Name = "Hoisted_" + std::to_string(Grid.Hoists.size());
+		Hoist.Expression = Expression;
+		Hoist.Mask = Mask;
+		Hoist.Scope = 0;
+		unsigned int Entered = 0;
+		for (int n = (int)Grid.Loops.size() - 1; n >= 0 && (Mask & (1u << n)) != 0; --n)
+		{
+			Hoist.Scope++;
+			Entered |= 1u << n;
+		}
+		Hoist.ArrayLoops = Mask & ~Entered;
+
+		// hoists are recorded after their own nested hoists, so list order is a valid evaluation order
+		Grid.HoistLookup[Key] = Grid.Hoists.size();
+		Grid.Hoists.push_back(Hoist);
+
+		Reference = GridHoistReference(Grid, Hoist);
+		return true;
+	}
+
+
+	// the named inputs the value at index depends on, ignoring the domain it is evaluated in
+	std::uint64_t InputDependency(ANLtoC_EmitData& Data, unsigned int index)
+	{
+		RetainEmitData& Retain = *Data.Retain;
+		auto MemoItr = Retain.DependencyMemo.find(index);
+		if (MemoItr != Retain.DependencyMemo.end())
+			return MemoItr->second;
+
+		const SInstruction& i = Data.k[index];
+		std::uint64_t Mask = 0;
+		if (i.opcode_ == OP_NamedInput)
+			Mask = Retain.InputBits[i.namedInput];
+		else if (GetOperandCount(i.opcode_) == sizeof(SInstruction::sources_) / sizeof(SInstruction::sources_[0]))
+		{
+			// the noise VM is given every named input declared before the instruction
+			for (unsigned int n = 0; n < index; ++n)
+			{
+				if (Data.k[n].opcode_ == OP_NamedInput)
+					Mask |= Retain.InputBits[Data.k[n].namedInput];
+			}
+		}
+		else
+		{
+			for (unsigned int s = 0; s < GetOperandCount(i.opcode_); ++s)
+				Mask |= InputDependency(Data, i.sources_[s]);
+		}
+
+		Retain.DependencyMemo[index] = Mask;
+		return Mask;
+	}
+
+	// When emitting the retained evaluator, values depending on fewer named inputs than the value using
+	// them are stored in a region buffer that is only recomputed when one of their own inputs changes.
+	bool RetainInputInvariant(ANLtoC_EmitData& Data, unsigned int index, std::vector<FunctionData>& FunctionList, std::string& Reference)
+	{
+		RetainEmitData& Retain = *Data.Retain;
+		switch (Data.k[index].opcode_)
+		{
+			// nothing is saved by storing these
+		case OP_NOP:
+		case OP_Seed:
+		case OP_Constant:
+		case OP_NamedInput:
+		case OP_X:
+		case OP_Y:
+		case OP_Z:
+		case OP_W:
+		case OP_U:
+		case OP_V:
+			return false;
+		default:
+			break;
+		}
+		if (IsCoordinateFree(Data, index))
+			return false;
+
+		std::uint64_t Mask = InputDependency(Data, index) | Retain.DomainMaskStack.back();
+		if (Mask == Retain.EnclosingMask)
+			return false;
+
+		std::string Key = std::to_string(index) + "@" + DomainPointExpression(Data);
+		auto BufferItr = Retain.BufferLookup.find(Key);
+		if (BufferItr == Retain.BufferLookup.end())
+		{
+			std::uint64_t EnclosingMask = Retain.EnclosingMask;
+			Retain.EnclosingMask = Mask;
+			std::string Expression = InstructionToElement(Data, index, FunctionList);
+			Retain.EnclosingMask = EnclosingMask;
+
+			// buffers are recorded after the buffers they read, so list order is a valid evaluation order
+			BufferItr = Retain.BufferLookup.emplace(Key, Retain.Buffers.size()).first;
+			Retain.Buffers.push_back({ Expression, Mask });
+		}
+
+		Reference = "Retained[" + std::to_string(BufferItr->second) + "][Sample]";
+		return true;
+	}
+
+	// returns the call of the function, stores function implementation in function list
+	std::string SetupFunctionCall(ANLtoC_EmitData& Data, unsigned int index, std::vector<FunctionData> &FunctionList)
+	{
+		const std::string Arguments = "(EvalPoint, NamedInput, CacheIsValid, Cache)";
+		// see if we already have a function setup, the body evaluates the node in the current domain
+		const std::string Key = std::to_string(index) + "@" + DomainPointExpression(Data);
+		auto FunctionItr = Data.IndexFunctions.find(Key);
+		if (FunctionItr != Data.IndexFunctions.end())
+			return FunctionItr->second + Arguments;
+
+		std::string Expression = InstructionToElement(Data, index, FunctionList);
+		// hoisted grid values are locals of the mapping function, retained buffers are members of the evaluator
+		if (Expression.find("Hoisted_") != std::string::npos || Expression.find("Retained[") != std::string::npos)
+			return Expression;
+
+		std::string FunctionName = "FunctionForIndex_" + std::to_string(index) + "_" + std::to_string(Data.IndexFunctions.size());
+		std::string function = 
+			"double " + FunctionName + "(" + NodeParameters(Expression) + ")\n"
+			"{\n"
+			"\treturn ";
+
+		function += Expression;
+
+		function +=
+			";\n}\n";
+
+		// Functions are pushed on the list in the order that is requred for proper dependency managment
+		FunctionList.push_back({ function, index });
+		Data.IndexFunctions[Key] = FunctionName;
+
+		return FunctionName + Arguments;
+	}
+	
+	// moves a subgraph to its own function once its expression exceeds the outline budget,
+	// keeping each function the compiler sees bounded in size
+	std::string OutlineElement(ANLtoC_EmitData& Data, unsigned int index, std::vector<FunctionData> &FunctionList)
+	{
+		if (Data.Options.OutlineBudget == 0)
+			return InstructionToElement(Data, index, FunctionList);
+
+		const std::string Arguments = "(EvalPoint, NamedInput, CacheIsValid, Cache)";
+		std::string Key = std::to_string(index) + "@" + DomainPointExpression(Data);
+		auto OutlinedItr = Data.Outlined.find(Key);
+		if (OutlinedItr != Data.Outlined.end())
+			return OutlinedItr->second + Arguments;
+
+		std::string Expression = InstructionToElement(Data, index, FunctionList);
+		// hoisted grid values are locals of the mapping function, retained buffers are members of the evaluator
+		if (Expression.size() <= Data.Options.OutlineBudget || Expression.find("Hoisted_") != std::string::npos ||
+			Expression.find("Retained[") != std::string::npos)
+			return Expression;
+
+		std::string FunctionName = "OutlinedFunction_" + std::to_string(Data.Outlined.size());
+		std::string function =
+			"double " + FunctionName + "(" + NodeParameters(Expression) + ")\n"
+			"{\n"
+			"\treturn " + Expression + ";\n}\n";
+		FunctionList.push_back({ function, index });
+		Data.Outlined[Key] = FunctionName;
+		return FunctionName + Arguments;
+	}
+
+	// replaces ^ with the Point structure representing the current coordinates
+	// replaces ~ with an evaluated statment
+	template<std::size_t size>
+	std::string RecursiveFormat(ANLtoC_EmitData& Data, std::string Format, std::array<unsigned int, size> args, std::vector<FunctionData> &FunctionList)
+	{
+		int ArgIndex = 0;
+		for (int i = 0; i < Format.size(); ++i)
+		{
+			if (Format[i] == '~')
+			{
+				if (ArgIndex >= args.size())
+					return "ArgIndex ERROR!";
+				Format.erase(i, 1);
+				std::string StringToInsert;
+
+				auto SubstitutionItr = Data.Substitutions.find(args[ArgIndex]);
+				if (SubstitutionItr != Data.Substitutions.end())
+				{
+					Format.insert(i, SubstitutionItr->second);
+					i += (int)SubstitutionItr->second.size() - 1;
+					ArgIndex++;
+					continue;
+				}
+
+				if ((Data.Grid != nullptr && HoistGridInvariant(Data, args[ArgIndex], FunctionList, StringToInsert)) ||
+					(Data.Retain != nullptr && RetainInputInvariant(Data, args[ArgIndex], FunctionList, StringToInsert)))
+				{
+					Format.insert(i, StringToInsert);
+					i += (int)StringToInsert.size() - 1;
+					ArgIndex++;
+					continue;
+				}
+
+				unsigned int CacheIndex = 0;
+				const bool IsCachable = IsCacheCandidate(Data, args[ArgIndex]);
+				// the functions take no substituted values
+				const bool IsFunction = Data.Substitutions.empty() && IsFunctionCandidate(Data, args[ArgIndex]);
+				if(IsCachable)
+				{
+					// a node read in several domains has a different value in each
+					const std::string CacheKey = std::to_string(args[ArgIndex]) + "@" + DomainPointExpression(Data);
+					auto CacheIndexItr = Data.KernalToCacheMap.find(CacheKey);
+					if (CacheIndexItr == Data.KernalToCacheMap.end()) {
+						Data.KernalToCacheMap[CacheKey] = Data.CacheSize;
+						CacheIndex = Data.CacheSize;
+						Data.CacheSize++;
+					}
+					else {
+						CacheIndex = CacheIndexItr->second;
+					}
+					StringToInsert += "(CacheIsValid[" + std::to_string(CacheIndex) + "] ? (Cache[" + std::to_string(CacheIndex) + "]) : (CacheIsValid[" + std::to_string(CacheIndex) + "]=true,Cache[" + std::to_string(CacheIndex) + "]=(";
+					//StringToInsert += "(CacheIsValid[" + std::to_string(args[ArgIndex]) + "] ? (Cache[" + std::to_string(args[ArgIndex]) + "]) : (CacheIsValid[" + std::to_string(args[ArgIndex]) + "]=true,Cache[" + std::to_string(args[ArgIndex]) + "]=(";
+				}
+				if (IsFunction)
+				{
+					StringToInsert += SetupFunctionCall(Data, args[ArgIndex], FunctionList);
+				}
+				else
+				{
+					StringToInsert += OutlineElement(Data, args[ArgIndex], FunctionList);
+				}
+
+				if (IsCachable)
+				{
+					StringToInsert += ")))";
+				}
+				if (Data.Options.ProfileInstrumentation)
+					StringToInsert = "(ProfileReach(" + std::to_string(args[ArgIndex]) + "), " + StringToInsert + ")";
+
+				Format.insert(i, StringToInsert);
+				i += (int)StringToInsert.size() - 1;
+				ArgIndex++;
+			}
+			else if (Format[i] == '^')
+			{
+				Format.erase(i, 1);
+				auto StringToInsert = DomainPointExpression(Data);
+				Format.insert(i, StringToInsert);
+				i += (int)StringToInsert.size() - 1;
+			}
+		}
+		return Format;
+	}
+
+	// the per-sample format of a domain operator whose amounts can't be folded into a transform
+	const char* DomainOpFormat(unsigned int opcode)
+	{
+		switch (opcode)
+		{
+		case OP_ScaleDomain: return "(^.Scale(~))";
+		case OP_ScaleX: return "(^.ScaleX(~))";
+		case OP_ScaleY: return "(^.ScaleY(~))";
+		case OP_ScaleZ: return "(^.ScaleZ(~))";
+		case OP_ScaleW: return "(^.ScaleW(~))";
+		case OP_ScaleU: return "(^.ScaleU(~))";
+		case OP_ScaleV: return "(^.ScaleV(~))";
+		case OP_TranslateX: return "(^.TranslateX(~))";
+		case OP_TranslateY: return "(^.TranslateY(~))";
+		case OP_TranslateZ: return "(^.TranslateZ(~))";
+		case OP_TranslateW: return "(^.TranslateW(~))";
+		case OP_TranslateU: return "(^.TranslateU(~))";
+		case OP_TranslateV: return "(^.TranslateV(~))";
+		case OP_TranslateDomain: return "(^.Translate(~))";
+		case OP_RotateDomain: return "RotateDomain(^,~,~,~,~)";
+		default: return nullptr;
+		}
+	}
+
+	// Emits sources_[0] of a domain operator in the domain it creates. Operators with amounts that don't
+	// vary per sample are folded into the enclosing transform, others apply DynamicFormat to the current point.
+	// Color selects whether sources_[0] is emitted as an RGBA or a scalar expression
+	std::string DomainToElement(ANLtoC_EmitData& Data, const SInstruction& i, const std::string& DynamicFormat, std::vector<FunctionData> &FunctionList, bool Color)
+	{
+		DomainInput Domain;
+		AffineDomain Op;
+		const DomainInput Enclosing = Data.DomainInputStack.back();
+		if (DomainOpToAffine(Data, i, Op, FunctionList))
+		{
+			Domain.Base = Enclosing.Base;
+			Domain.Transform = ComposeAffine(Data, Op, Enclosing.Transform);
+			Domain.IsScaleKnown = Enclosing.IsScaleKnown;
+			Domain.BaseScale = Enclosing.BaseScale;
+		}
+		else
+		{
+			// translations and rotations keep the scale of the point they are applied to
+			bool IsScale = false;
+			switch (i.opcode_)
+			{
+			case OP_ScaleDomain:
+			case OP_ScaleX: case OP_ScaleY: case OP_ScaleZ: case OP_ScaleW: case OP_ScaleU: case OP_ScaleV:
+				IsScale = true;
+				break;
+			default:
+				break;
+			}
+			Domain.IsScaleKnown = Enclosing.IsScaleKnown && !IsScale;
+			Domain.BaseScale = Domain.IsScaleKnown ? Product(Enclosing.BaseScale, TransformStretch(Enclosing.Transform)) : Literal(0.0);
+			std::array<unsigned int, 4> args;
+			args = { i.sources_[1], i.sources_[2], i.sources_[3], i.sources_[4], };
+			Domain.Base = RecursiveFormat(Data, DynamicFormat, args, FunctionList);
+			Domain.Transform = IdentityAffine();
+		}
+
+		PushDomain(Data, i, Domain);
+		std::string s = Color ? ColorToElement(Data, i.sources_[0], FunctionList) : InstructionToElement(Data, i.sources_[0], FunctionList);
+		PopDomain(Data);
+		return s;
+	}
+
+	// forward difference of sources_[0] along one axis, sources_[1] is the spacing
+	std::string DerivativeToElement(ANLtoC_EmitData& Data, const SInstruction& i, const std::string& DynamicFormat, std::vector<FunctionData> &FunctionList)
+	{
+		std::array<unsigned int, 1> args;
+		args = { i.sources_[0] };// value
+		std::string OriginalValue = RecursiveFormat(Data, std::string("~"), args, FunctionList);
+		std::string TranslatedValue = DomainToElement(Data, i, DynamicFormat, FunctionList, false);
+
+		args = { i.sources_[1] };// spacing
+		return RecursiveFormat(Data, std::string("((" + OriginalValue + " - " + TranslatedValue + ") / ~)"), args, FunctionList);
+	}
+
+	// cost of a scalar operator relative to an addition, negative for everything that isn't a continuous
+	// function of its sources alone, since no table interpolates a step within the tolerance
+	int TabulationCost(unsigned int opcode)
+	{
+		switch (opcode)
+		{
+		case OP_Add:
+		case OP_Subtract:
+		case OP_Multiply:
+		case OP_Min:
+		case OP_Max:
+		case OP_Abs:
+		case OP_Clamp:
+			return 1;
+
+		case OP_Divide:
+			return 4;
+
+		case OP_Blend:
+		case OP_Select:
+			return 6;
+
+		case OP_SmoothTiers:
+			return 10;
+
+		case OP_Pow:
+		case OP_Sin:
+		case OP_Cos:
+		case OP_Tan:
+		case OP_ASin:
+		case OP_ACos:
+		case OP_ATan:
+		case OP_Bias:
+		case OP_Gain:
+		case OP_Sigmoid:
+			return 20;
+
+		default:
+			return -1;
+		}
+	}
+
+	// a tabulated lookup costs about 8, cheaper subgraphs are evaluated directly
+	const int TabulationMinimumCost = 24;
+	// building a table takes thousands of exact evaluations, a profiled subgraph evaluated fewer times than
+	// this is left alone
+	const std::uint64_t TabulationMinimumReached = 65536;
+	const unsigned int NoTabulationInput = ~0u;
+
+	// Adds the cost of the scalar operators under index to Cost and finds the one value they vary with, every
+	// other leaf being a constant. Returns false when they vary with more than one value.
+	bool FindTabulationInput(ANLtoC_EmitData& Data, unsigned int index, unsigned int& Input, int& Cost, std::unordered_set<unsigned int>& Visited)
+	{
+		if (!Visited.insert(index).second)
+			return true;
+		const SInstruction& i = Data.k[index];
+		if (i.opcode_ == OP_Constant || i.opcode_ == OP_Seed)
+			return true;
+
+		int OperatorCost = TabulationCost(i.opcode_);
+		// a select without a falloff steps between its inputs
+		if (i.opcode_ == OP_Select && !(Data.k[i.sources_[4]].opcode_ == OP_Constant && Data.k[i.sources_[4]].outfloat_ > 0.0))
+			OperatorCost = -1;
+		if (OperatorCost < 0)
+		{
+			if (Input != NoTabulationInput)
+				return false;
+			Input = index;
+			return true;
+		}
+		Cost += OperatorCost;
+		for (unsigned int s = 0; s < GetSourceCount(i.opcode_); ++s)
+		{
+			if (!FindTabulationInput(Data, i.sources_[s], Input, Cost, Visited))
+				return false;
+		}
+		return true;
+	}
+
+	// the values a tabulated input takes, the bases are scaled to [-1, 1]
+	bool TabulationRange(const SInstruction& i, double& Low, double& High)
+	{
+		switch (i.opcode_)
+		{
+		case OP_ValueBasis:
+		case OP_GradientBasis:
+		case OP_SimplexBasis:
+			Low = -1.0;
+			High = 1.0;
+			return true;
+		default:
+			return false;
+		}
+	}
+
+	// Replaces a costly subgraph of scalar operators depending on a single noise basis with a lookup in a table
+	// of the subgraph over the basis' range. The runtime builds the table on first use, from an exact function
+	// that is also used for values outside the range.
+	bool TabulateElement(ANLtoC_EmitData& Data, unsigned int index, std::vector<FunctionData>& FunctionList, std::string& Result)
+	{
+		auto TabulatedItr = Data.Tabulated.find(index);
+		if (TabulatedItr == Data.Tabulated.end())
+		{
+			std::pair<std::string, unsigned int> Tabulation("", NoTabulationInput);
+			int Cost = 0;
+			double Low, High;
+			std::unordered_set<unsigned int> Visited;
+			if (TabulationCost(Data.k[index].opcode_) >= 0 &&
+				(Data.Profile == nullptr || ProfileReached(Data, index) >= TabulationMinimumReached) &&
+				FindTabulationInput(Data, index, Tabulation.second, Cost, Visited) &&
+				Tabulation.second != NoTabulationInput && Cost >= TabulationMinimumCost &&
+				TabulationRange(Data.k[Tabulation.second], Low, High))
+			{
+				ANLtoC_EmitData Exact(Data.k, Data.Options);
+				Exact.Options.OutlineBudget = 0;
+				Exact.Options.TabulationTolerance = 0.0;
+				Exact.Profile = Data.Profile;
+				Exact.DomainInputStack.push_back({ "EvalPoint", IdentityAffine(), true, Literal(1.0) });
+				Exact.Substitutions[Tabulation.second] = "Input";
+				const std::string Expression = InstructionToElement(Exact, index, FunctionList);
+				const std::string CacheSize = std::to_string(std::max(Exact.CacheSize, 1));
+
+				const std::string Name = "Tabulated_" + std::to_string(index);
+				std::string ExactFunction = "double " + Name + "_Exact(double Input)\n{\n";
+				std::string Statements;
+				for (const std::string& Statement : Exact.Prologue)
+					Statements += "\t" + Statement + "\n";
+				if (UsesIdentifier(Statements + Expression, "CacheIsValid"))
+					ExactFunction += "\tbool CacheIsValid[" + CacheSize + "] = {};\n";
+				if (UsesIdentifier(Statements + Expression, "Cache"))
+					ExactFunction += "\tdouble Cache[" + CacheSize + "];\n";
+				ExactFunction += Statements;
+				ExactFunction += "\treturn " + Expression + ";\n}\n";
+				FunctionList.push_back({ ExactFunction, index });
+
+				std::string LookupFunction = "double " + Name + "(double Input)\n{\n";
+				LookupFunction += "\tstatic const TabulatedFunction Table(" + Name + "_Exact, " + ToString(Low) + ", " + ToString(High) + ", " + ToString(Data.Options.TabulationTolerance) + ");\n";
+				LookupFunction += "\treturn Table(Input);\n}\n";
+				FunctionList.push_back({ LookupFunction, index });
+				Tabulation.first = Name;
+			}
+			TabulatedItr = Data.Tabulated.emplace(index, Tabulation).first;
+		}
+		if (TabulatedItr->second.first.empty())
+			return false;
+
+		std::array<unsigned int, 1> args = { TabulatedItr->second.second };
+		Result = RecursiveFormat(Data, TabulatedItr->second.first + "(~)", args, FunctionList);
+		return true;
+	}
+
+	// weights of the Luminance function in the generated runtime
+	const double LuminanceRed = 0.2126;
+	const double LuminanceGreen = 0.7152;
+	const double LuminanceBlue = 0.0722;
+
+	double Luminance(double r, double g, double b)
+	{
+		return LuminanceRed * r + LuminanceGreen * g + LuminanceBlue * b;
+	}
+
+	// Color valued nodes carry an RGBA value alongside their scalar one, which is the luminance
+	// of the color. Every other node reads as (v, v, v, 1) where a color is expected.
+	bool IsColorNode(ANLtoC_EmitData& Data, unsigned int index)
+	{
+		auto MemoItr = Data.ColorMemo.find(index);
+		if (MemoItr != Data.ColorMemo.end())
+			return MemoItr->second;
+
+		const SInstruction& i = Data.k[index];
+		bool IsColor = false;
+		switch (i.opcode_)
+		{
+		case OP_Color:
+		case OP_CombineRGBA:
+			IsColor = true;
+			break;
+
+		case OP_Add:
+		case OP_Subtract:
+		case OP_Multiply:
+		case OP_Divide:
+		case OP_Max:
+		case OP_Min:
+		case OP_Blend:
+		case OP_Select:
+			IsColor = IsColorNode(Data, i.sources_[0]) || IsColorNode(Data, i.sources_[1]);
+			break;
+
+		case OP_Abs:
+		case OP_Clamp:
+			IsColor = IsColorNode(Data, i.sources_[0]);
+			break;
+
+		default:
+			IsColor = DomainOpFormat(i.opcode_) != nullptr && IsColorNode(Data, i.sources_[0]);
+			break;
+		}
+		Data.ColorMemo[index] = IsColor;
+		return IsColor;
+	}
+
+	std::string ScalarToElement(ANLtoC_EmitData& Data, unsigned int index, std::vector<FunctionData> &FunctionList)
+	{
+		std::array<unsigned int, 1> args = { index };
+		return RecursiveFormat(Data, std::string("~"), args, FunctionList);
+	}
+
+	// Emits an expression of type ANL_CPP_RGBA. Color values aren't cached, the scalar subgraphs
+	// feeding them are cached and hoisted as usual.
+	std::string ColorToElement(ANLtoC_EmitData& Data, unsigned int index, std::vector<FunctionData> &FunctionList)
+	{
+		if (!IsColorNode(Data, index))
+			return "ColorFromScalar(" + ScalarToElement(Data, index, FunctionList) + ")";
+
+		const SInstruction& i = Data.k[index];
+		auto Source = [&](unsigned int s) { return ColorToElement(Data, i.sources_[s], FunctionList); };
+		auto Scalar = [&](unsigned int s) { return ScalarToElement(Data, i.sources_[s], FunctionList); };
+		switch (i.opcode_)
+		{
+		case OP_Color:
+			return "MakeRGBA(" + ToString(i.outrgba_.r) + ", " + ToString(i.outrgba_.g) + ", " + ToString(i.outrgba_.b) + ", " + ToString(i.outrgba_.a) + ")";
+		case OP_CombineRGBA:
+			return "MakeRGBA(" + Scalar(0) + ", " + Scalar(1) + ", " + Scalar(2) + ", " + Scalar(3) + ")";
+
+		case OP_Add: return "(" + Source(0) + " + " + Source(1) + ")";
+		case OP_Subtract: return "(" + Source(0) + " - " + Source(1) + ")";
+		case OP_Multiply: return "(" + Source(0) + " * " + Source(1) + ")";
+		case OP_Divide: return "(" + Source(0) + " / " + Source(1) + ")";
+		case OP_Max: return "RGBAMax(" + Source(0) + ", " + Source(1) + ")";
+		case OP_Min: return "RGBAMin(" + Source(0) + ", " + Source(1) + ")";
+		case OP_Abs: return "RGBAAbs(" + Source(0) + ")";
+		case OP_Clamp: return "RGBAClamp(" + Source(0) + ", " + Scalar(1) + ", " + Scalar(2) + ")";
+		case OP_Blend: return "RGBALerp(" + Source(0) + ", " + Source(1) + ", " + Scalar(2) + ")";
+		case OP_Select:
+			return "RGBASelect(" + Source(0) + ", " + Source(1) + ", " + Scalar(2) + ", " + Scalar(3) + ", " + Scalar(4) + ")";
+
+		default:
+			return DomainToElement(Data, i, DomainOpFormat(i.opcode_), FunctionList, true);
+		}
+	}
+
+	// one channel of a color as a scalar
+	std::string ExtractToElement(ANLtoC_EmitData& Data, unsigned int Source, const std::string& Channel, std::vector<FunctionData> &FunctionList)
+	{
+		if (IsColorNode(Data, Source))
+			return "(" + ColorToElement(Data, Source, FunctionList) + ")." + Channel;
+		if (Channel == "a")
+			return "1.0";
+		return ScalarToElement(Data, Source, FunctionList);
+	}
+
+	// Instructions with no native translation are evaluated by an anl::CNoiseExecutor embedded in the
+	// generated code, running on a copy of the kernel up to and including the instruction. Named inputs
+	// are passed in as constants, everything else below the instruction stays in the VM since the
+	// operator may evaluate its sources away from the current point.
+	std::string VMFallbackToElement(ANLtoC_EmitData& Data, unsigned int index, std::vector<FunctionData> &FunctionList)
+	{
+		std::string FunctionName = "VMFallback_" + std::to_string(index);
+		std::array<unsigned int, 0> EmptyArgs = {};
+		if (Data.VMFallbacks.count(index) != 0)
+			return RecursiveFormat(Data, FunctionName + "(^, NamedInput)", EmptyArgs, FunctionList);
+
+		std::string NamedInputs;
+		for (unsigned int n = 0; n <= index; ++n)
+		{
+			if (Data.k[n].opcode_ == OP_NamedInput)
+				NamedInputs += "\t\tk[" + std::to_string(n) + "].outfloat_ = NamedInput." + Data.k[n].namedInput + ";\n";
+		}
+
+		std::string function =
+			"double " + FunctionName + "(const Point EvalPoint, " + Parameter(NamedInputs, "const ANL_CPP_NamedInput&", "NamedInput") + ")\n"
+			"{\n"
+			"\t// the executor keeps per evaluation state, so every thread gets its own\n"
+			"\tstatic thread_local VMFallbackKernel VM(" + std::to_string(index + 1) + ");\n"
+			"\t{\n"
+			"\t\tanl::InstructionListType& k = *VM.Kernel.getKernel();\n"
+			+ NamedInputs +
+			"\t}\n"
+			"\treturn VM.Evaluate(EvalPoint);\n"
+			"}\n";
+		FunctionList.push_back({ function, std::numeric_limits<unsigned int>::max() });
+		Data.VMFallbacks[index] = FunctionName;
+		return RecursiveFormat(Data, FunctionName + "(^, NamedInput)", EmptyArgs, FunctionList);
+	}
+
+	// the instructions every VMFallback_ function copies its kernel from, empty when there are none
+	FunctionData VMFallbackKernelToC(ANLtoC_EmitData& Data)
+	{
+		if (Data.VMFallbacks.empty())
+			return { "", std::numeric_limits<unsigned int>::max() };
+
+		const unsigned int Count = Data.VMFallbacks.rbegin()->first + 1;
+		const std::size_t SourceSlots = sizeof(SInstruction::sources_) / sizeof(SInstruction::sources_[0]);
+		std::string Opcodes, Values, Sources, Colors;
+		for (unsigned int n = 0; n < Count; ++n)
+		{
+			const SInstruction& i = Data.k[n];
+			// named inputs are written by the fallback functions before each evaluation
+			unsigned int Opcode = i.opcode_ == OP_NamedInput ? (unsigned int)OP_Constant : i.opcode_;
+			Opcodes += (n % 16 == 0 ? "\n\t\t" : " ") + std::to_string(Opcode) + ",";
+			Values += "\n\t\t" + ToLiteral(i.outfloat_) + ",";
+			Sources += "\n\t\t{";
+			for (std::size_t Slot = 0; Slot < SourceSlots; ++Slot)
+				Sources += (Slot == 0 ? " " : ", ") + std::to_string(i.sources_[Slot]);
+			Sources += " },";
+			if (i.opcode_ == OP_Color)
 			{
-				Format.erase(i, 1);
-				auto StringToInsert = Data.DomainInputStack.back();
-				if (Data.DomainInputStack.size() == 1) {
-					// we have "EvalPoint", make a modifiable copy of this variable
-					StringToInsert = "Point(" + StringToInsert + ")";
-				}
-				Format.insert(i, StringToInsert);
-				i += (int)StringToInsert.size() - 1;
+				Colors += "\tif (" + std::to_string(n) + " < Count)\n";
+				Colors += "\t\tk[" + std::to_string(n) + "].outrgba_ = anl::SRGBA(" + ToString(i.outrgba_.r) + "f, " + ToString(i.outrgba_.g) + "f, " + ToString(i.outrgba_.b) + "f, " + ToString(i.outrgba_.a) + "f);\n";
 			}
 		}
-		return Format;
+
+		std::string function =
+			"anl::CKernel& BuildVMFallbackKernel(anl::CKernel& Kernel, unsigned int Count)\n"
+			"{\n"
+			"\tstatic const unsigned int Opcodes[] = {" + Opcodes + "\n\t};\n"
+			"\tstatic const double Values[] = {" + Values + "\n\t};\n"
+			"\tstatic const unsigned int Sources[][" + std::to_string(SourceSlots) + "] = {" + Sources + "\n\t};\n"
+			"\tanl::InstructionListType& k = *Kernel.getKernel();\n"
+			"\tk.resize(Count);\n"
+			"\tfor (unsigned int n = 0; n < Count; ++n)\n"
+			"\t{\n"
+			"\t\tk[n].opcode_ = Opcodes[n];\n"
+			"\t\tk[n].outfloat_ = Values[n];\n"
+			"\t\tfor (unsigned int Slot = 0; Slot < " + std::to_string(SourceSlots) + "; ++Slot)\n"
+			"\t\t\tk[n].sources_[Slot] = Sources[n][Slot];\n"
+			"\t}\n"
+			+ Colors +
+			"\treturn Kernel;\n"
+			"}\n";
+		return { function, std::numeric_limits<unsigned int>::max() };
+	}
+
+	std::string MathFunction(const ANLtoC_EmitData& Data, const std::string& Exact, const std::string& Fast)
+	{
+		return Data.Options.FastMathLevel > 0 ? Fast : Exact;
+	}
+
+	// lowers pow with a constant integer or half integer exponent to multiplies and a sqrt,
+	// returns an empty string when the exponent doesn't qualify
+	std::string ConstantPowToElement(ANLtoC_EmitData& Data, unsigned int Base, double Exponent, std::vector<FunctionData>& FunctionList)
+	{
+		const double MaxExponent = 16.0;
+		if (!(std::abs(Exponent) <= MaxExponent))
+			return "";
+
+		std::array<unsigned int, 1> args = { Base };
+		double Whole = std::floor(Exponent);
+		int Power = static_cast<int>(Whole);
+		if (Exponent == 0.0)
+			return "1.0";
+		if (Exponent == Whole)
+			return RecursiveFormat(Data, "PowInteger(~, " + std::to_string(Power) + ")", args, FunctionList);
+		if (Exponent - Whole == 0.5)
+			return RecursiveFormat(Data, "PowHalfInteger(~, " + std::to_string(Power) + ")", args, FunctionList);
+		return "";
 	}
 
 	std::string InstructionToElement(ANLtoC_EmitData& Data, unsigned int index, std::vector<FunctionData> &FunctionList)
 	{
+		auto SubstitutionItr = Data.Substitutions.find(index);
+		if (SubstitutionItr != Data.Substitutions.end())
+			return SubstitutionItr->second;
+
+		std::string Hoisted;
+		if (Data.Grid != nullptr && HoistGridInvariant(Data, index, FunctionList, Hoisted))
+			return Hoisted;
+		if (Data.Retain != nullptr && RetainInputInvariant(Data, index, FunctionList, Hoisted))
+			return Hoisted;
+		if (Data.Options.TabulationTolerance > 0.0 && !Data.Options.ProfileInstrumentation && TabulateElement(Data, index, FunctionList, Hoisted))
+			return Hoisted;
+
 		std::array<unsigned int, 0> EmptyArgs = {};
 		SInstruction& i = Data.k[index];
 		switch (i.opcode_)
@@ -254,7 +1851,7 @@ namespace ANLtoC {
 			std::array<unsigned int, 2> args;
 			// { Interpolation, seed }
 			args = { i.sources_[0], i.sources_[1], };
-			return RecursiveFormat(Data, std::string("ValueBasis(^,(int)~,(unsigned int)~"), args, FunctionList);
+			return FootprintCulled(Data, RecursiveFormat(Data, "ValueBasis(^,(int)~,(unsigned int)~" + CoherentSite(Data) + ")", args, FunctionList));
 		}
 
 		case OP_GradientBasis:
@@ -262,7 +1859,7 @@ namespace ANLtoC {
 			std::array<unsigned int, 2> args;
 			// { Interpolation, seed }
 			args = { i.sources_[0], i.sources_[1], };
-			return RecursiveFormat(Data, std::string("GradientBasis(^,(int)~,(unsigned int)~)"), args, FunctionList);
+			return FootprintCulled(Data, RecursiveFormat(Data, "GradientBasis(^,(int)~,(unsigned int)~" + CoherentSite(Data) + ")", args, FunctionList));
 		}
 
 		case OP_SimplexBasis:
@@ -270,14 +1867,30 @@ namespace ANLtoC {
 			std::array<unsigned int, 1> args;
 			// { seed }
 			args = { i.sources_[0], };
-			return RecursiveFormat(Data, std::string("SimplexBasis(^,(unsigned int)~)"), args, FunctionList);
+			return FootprintCulled(Data, RecursiveFormat(Data, std::string("SimplexBasis(^,(unsigned int)~)"), args, FunctionList));
 		}
 
 		case OP_CellularBasis:
 		{
 			std::array<unsigned int, 10> args;
 			args = { i.sources_[0], i.sources_[1], i.sources_[2], i.sources_[3], i.sources_[4], i.sources_[5], i.sources_[6], i.sources_[7], i.sources_[8], i.sources_[9] };
-			return RecursiveFormat(Data, std::string("CellularBasis(^,(unsigned int)~,~,~,~,~,~,~,~,~,(unsigned int)~)"), args, FunctionList);
+			// { dist, f1, f2, f3, f4, d1, d2, d3, d4, seed }, coefficients that are constant zero shorten the search
+			int Nearest = 0;
+			bool Displacement = false;
+			for (int c = 0; c < 8; ++c)
+			{
+				const SInstruction& Coefficient = Data.k[i.sources_[1 + c]];
+				if (Coefficient.opcode_ == OP_Constant && Coefficient.outfloat_ == 0.0)
+					continue;
+				Nearest = std::max(Nearest, c % 4 + 1);
+				Displacement = Displacement || c >= 4;
+			}
+			if (Nearest < 4 || !Displacement)
+			{
+				std::string Format = "CellularBasisNearest(^," + std::to_string(std::max(Nearest, 1)) + "," + (Displacement ? "true" : "false");
+				return RecursiveFormat(Data, Format + ",(unsigned int)~,~,~,~,~,~,~,~,~,(unsigned int)~" + CoherentSite(Data) + ")", args, FunctionList);
+			}
+			return RecursiveFormat(Data, "CellularBasis(^,(unsigned int)~,~,~,~,~,~,~,~,~,(unsigned int)~" + CoherentSite(Data) + ")", args, FunctionList);
 		}
 
 		case OP_Add:
@@ -339,43 +1952,49 @@ namespace ANLtoC {
 		{
 			std::array<unsigned int, 2> args;
 			args = { i.sources_[0], i.sources_[1], };
+			if (Data.Options.FastMathLevel > 0 && Data.k[i.sources_[1]].opcode_ == OP_Constant)
+			{
+				std::string Lowered = ConstantPowToElement(Data, i.sources_[0], Data.k[i.sources_[1]].outfloat_, FunctionList);
+				if (!Lowered.empty())
+					return Lowered;
+			}
 			return RecursiveFormat(Data, std::string("std::pow(~,~)"), args, FunctionList);
 		}
 		case OP_Cos:
 		{
 			std::array<unsigned int, 1> args;
 			args = { i.sources_[0], };
-			return RecursiveFormat(Data, std::string("std::cos(~)"), args, FunctionList);
+			return RecursiveFormat(Data, MathFunction(Data, "std::cos", "FastCos") + "(~)", args, FunctionList);
 		}
 		case OP_Sin:
 		{
 			std::array<unsigned int, 1> args;
 			args = { i.sources_[0], };
-			return RecursiveFormat(Data, std::string("std::sin(~)"), args, FunctionList);
+			return RecursiveFormat(Data, MathFunction(Data, "std::sin", "FastSin") + "(~)", args, FunctionList);
 		}
 		case OP_Tan:
 		{
 			std::array<unsigned int, 1> args;
 			args = { i.sources_[0], };
-			return RecursiveFormat(Data, std::string("std::tan(~)"), args, FunctionList);
+			return RecursiveFormat(Data, MathFunction(Data, "std::tan", "FastTan") + "(~)", args, FunctionList);
 		}
 		case OP_ACos:
 		{
 			std::array<unsigned int, 1> args;
 			args = { i.sources_[0], };
-			return RecursiveFormat(Data, std::string("std::acos(~)"), args, FunctionList);
+			return RecursiveFormat(Data, MathFunction(Data, "std::acos", "FastAcos") + "(~)", args, FunctionList);
 		}
 		case OP_ASin:
 		{
 			std::array<unsigned int, 1> args;
 			args = { i.sources_[0], };
-			return RecursiveFormat(Data, std::string("std::asin(~)"), args, FunctionList);
+			return RecursiveFormat(Data, MathFunction(Data, "std::asin", "FastAsin") + "(~)", args, FunctionList);
 		}
 		case OP_ATan:
 		{
 			std::array<unsigned int, 1> args;
 			args = { i.sources_[0], };
-			return RecursiveFormat(Data, std::string("std::atan(~)"), args, FunctionList);
+			return RecursiveFormat(Data, MathFunction(Data, "std::atan", "FastAtan") + "(~)", args, FunctionList);
 		}
 
 		case OP_Tiers:
@@ -395,166 +2014,21 @@ namespace ANLtoC {
 		}
 
 		case OP_ScaleDomain:
-		{
-			std::array<unsigned int, 1> args;
-			// scale i.sources_[0] by i.sources_[1]
-			args = { i.sources_[1] };
-			std::string s = RecursiveFormat(Data, std::string("(^.Scale(~))"), args, FunctionList);
-			Data.DomainInputStack.push_back(s);
-			s = InstructionToElement(Data, i.sources_[0], FunctionList);
-			Data.DomainInputStack.pop_back();
-			return s;
-		}
-
 		case OP_ScaleX:
-		{
-			std::array<unsigned int, 1> args;
-			// scale i.sources_[0] by i.sources_[1]
-			args = { i.sources_[1] };
-			std::string s = RecursiveFormat(Data, std::string("(^.ScaleX(~))"), args, FunctionList);
-			Data.DomainInputStack.push_back(s);
-			s = InstructionToElement(Data, i.sources_[0], FunctionList);
-			Data.DomainInputStack.pop_back();
-			return s;
-		}
 		case OP_ScaleY:
-		{
-			std::array<unsigned int, 1> args;
-			// scale i.sources_[0] by i.sources_[1]
-			args = { i.sources_[1] };
-			std::string s = RecursiveFormat(Data, std::string("(^.ScaleY(~))"), args, FunctionList);
-			Data.DomainInputStack.push_back(s);
-			s = InstructionToElement(Data, i.sources_[0], FunctionList);
-			Data.DomainInputStack.pop_back();
-			return s;
-		}
 		case OP_ScaleZ:
-		{
-			std::array<unsigned int, 1> args;
-			// scale i.sources_[0] by i.sources_[1]
-			args = { i.sources_[1] };
-			std::string s = RecursiveFormat(Data, std::string("(^.ScaleZ(~))"), args, FunctionList);
-			Data.DomainInputStack.push_back(s);
-			s = InstructionToElement(Data, i.sources_[0], FunctionList);
-			Data.DomainInputStack.pop_back();
-			return s;
-		}
 		case OP_ScaleW:
-		{
-			std::array<unsigned int, 1> args;
-			// scale i.sources_[0] by i.sources_[1]
-			args = { i.sources_[1] };
-			std::string s = RecursiveFormat(Data, std::string("(^.ScaleW(~))"), args, FunctionList);
-			Data.DomainInputStack.push_back(s);
-			s = InstructionToElement(Data, i.sources_[0], FunctionList);
-			Data.DomainInputStack.pop_back();
-			return s;
-		}
 		case OP_ScaleU:
-		{
-			std::array<unsigned int, 1> args;
-			// scale i.sources_[0] by i.sources_[1]
-			args = { i.sources_[1] };
-			std::string s = RecursiveFormat(Data, std::string("(^.ScaleU(~))"), args, FunctionList);
-			Data.DomainInputStack.push_back(s);
-			s = InstructionToElement(Data, i.sources_[0], FunctionList);
-			Data.DomainInputStack.pop_back();
-			return s;
-		}
 		case OP_ScaleV:
-		{
-			std::array<unsigned int, 1> args;
-			// scale i.sources_[0] by i.sources_[1]
-			args = { i.sources_[1] };
-			std::string s = RecursiveFormat(Data, std::string("(^.ScaleV(~))"), args, FunctionList);
-			Data.DomainInputStack.push_back(s);
-			s = InstructionToElement(Data, i.sources_[0], FunctionList);
-			Data.DomainInputStack.pop_back();
-			return s;
-		}
-
 		case OP_TranslateX:
-		{
-			std::array<unsigned int, 1> args;
-			args = { i.sources_[1] };
-			std::string s = RecursiveFormat(Data, std::string("(^.TranslateX(~))"), args, FunctionList);
-			Data.DomainInputStack.push_back(s);
-			s = InstructionToElement(Data, i.sources_[0], FunctionList);
-			Data.DomainInputStack.pop_back();
-			return s;
-		}
 		case OP_TranslateY:
-		{
-			std::array<unsigned int, 1> args;
-			args = { i.sources_[1] };
-			std::string s = RecursiveFormat(Data, std::string("(^.TranslateY(~))"), args, FunctionList);
-			Data.DomainInputStack.push_back(s);
-			s = InstructionToElement(Data, i.sources_[0], FunctionList);
-			Data.DomainInputStack.pop_back();
-			return s;
-		}
 		case OP_TranslateZ:
-		{
-			std::array<unsigned int, 1> args;
-			args = { i.sources_[1] };
-			std::string s = RecursiveFormat(Data, std::string("(^.TranslateZ(~))"), args, FunctionList);
-			Data.DomainInputStack.push_back(s);
-			s = InstructionToElement(Data, i.sources_[0], FunctionList);
-			Data.DomainInputStack.pop_back();
-			return s;
-		}
 		case OP_TranslateW:
-		{
-			std::array<unsigned int, 1> args;
-			args = { i.sources_[1] };
-			std::string s = RecursiveFormat(Data, std::string("(^.TranslateW(~))"), args, FunctionList);
-			Data.DomainInputStack.push_back(s);
-			s = InstructionToElement(Data, i.sources_[0], FunctionList);
-			Data.DomainInputStack.pop_back();
-			return s;
-		}
 		case OP_TranslateU:
-		{
-			std::array<unsigned int, 1> args;
-			args = { i.sources_[1] };
-			std::string s = RecursiveFormat(Data, std::string("(^.TranslateU(~))"), args, FunctionList);
-			Data.DomainInputStack.push_back(s);
-			s = InstructionToElement(Data, i.sources_[0], FunctionList);
-			Data.DomainInputStack.pop_back();
-			return s;
-		}
 		case OP_TranslateV:
-		{
-			std::array<unsigned int, 1> args;
-			args = { i.sources_[1] };
-			std::string s = RecursiveFormat(Data, std::string("(^.TranslateV(~))"), args, FunctionList);
-			Data.DomainInputStack.push_back(s);
-			s = InstructionToElement(Data, i.sources_[0], FunctionList);
-			Data.DomainInputStack.pop_back();
-			return s;
-		}
-
 		case OP_TranslateDomain:
-		{
-			std::array<unsigned int, 1> args;
-			args = { i.sources_[1] };
-			std::string s = RecursiveFormat(Data, std::string("(^.Translate(~))"), args, FunctionList);
-			Data.DomainInputStack.push_back(s);
-			s = InstructionToElement(Data, i.sources_[0], FunctionList);
-			Data.DomainInputStack.pop_back();
-			return s;
-		}
-
 		case OP_RotateDomain:
-		{
-			std::array<unsigned int, 4> args;
-			args = { i.sources_[1], i.sources_[2], i.sources_[3], i.sources_[4], };
-			std::string s = RecursiveFormat(Data, std::string("RotateDomain(^,~,~,~,~)"), args, FunctionList);
-			Data.DomainInputStack.push_back(s);
-			s = InstructionToElement(Data, i.sources_[0], FunctionList);
-			Data.DomainInputStack.pop_back();
-			return s;
-		}
+			return DomainToElement(Data, i, DomainOpFormat(i.opcode_), FunctionList, false);
 
 		case OP_Blend:
 		{
@@ -569,23 +2043,80 @@ namespace ANLtoC {
 			//i.sources_[0], i.sources_[1], i.sources_[2], i.sources_[3], i.sources_[4],
 			// low,				 high,			control,		threshold,		falloff,
 
-			// {	falloff,			control,	threshold,		falloff,		low,		control,		threshold,		falloff,		high,			low,			high,		control,		threshold,		falloff,	control,		threshold,		low,			high }
-			args = { i.sources_[4], i.sources_[2], i.sources_[3], i.sources_[4], i.sources_[0], i.sources_[2], i.sources_[3], i.sources_[4], i.sources_[1], i.sources_[0], i.sources_[1], i.sources_[2], i.sources_[3], i.sources_[4], i.sources_[2], i.sources_[3], i.sources_[0], i.sources_[1], };
-			std::string s = R"(
+			// the instrumented build counts the outcomes taken
+			std::string TakeLow, TakeHigh, TakeBlend;
+			if (Data.Options.ProfileInstrumentation)
+			{
+				TakeLow = "ProfileTake(" + std::to_string(index) + ", 0), ";
+				TakeHigh = "ProfileTake(" + std::to_string(index) + ", 1), ";
+				TakeBlend = "ProfileTake(" + std::to_string(index) + ", 2), ";
+			}
+
+			// When the profile took the high input most often it is tested first. The blend needs both tests
+			// whatever the order, so it never goes first.
+			bool HighFirst = false;
+			if (Data.Profile != nullptr)
+			{
+				auto TakenItr = Data.Profile->Taken.find(index);
+				HighFirst = TakenItr != Data.Profile->Taken.end() && TakenItr->second[1] > TakenItr->second[0] &&
+					TakenItr->second[1] > TakenItr->second[2];
+			}
+
+			std::string s;
+			if (HighFirst)
+			{
+				// {	falloff,			control,	threshold,		falloff,		high,		control,		threshold,		falloff,		low,			low,			high,		control,		threshold,		falloff,	control,		threshold,		low,			high }
+				args = { i.sources_[4], i.sources_[2], i.sources_[3], i.sources_[4], i.sources_[1], i.sources_[2], i.sources_[3], i.sources_[4], i.sources_[0], i.sources_[0], i.sources_[1], i.sources_[2], i.sources_[3], i.sources_[4], i.sources_[2], i.sources_[3], i.sources_[0], i.sources_[1], };
+				s = R"(
+			((/*falloff*/~ > 0.0) ?
+			(
+				((/*control*/~>(/*threshold*/~ + /*falloff*/~)) ?
+				(
+					)" + TakeHigh + R"(/*high*/~
+				)
+					: ((/*control*/~<(/*threshold*/~ - /*falloff*/~)) ?
+					(
+						)" + TakeLow + R"(/*low*/~
+					)
+						:
+					(
+						/*low high blend*/
+						)" + TakeBlend + R"(Select_Blend(~,~,~,~,~)
+					))
+				)
+			)
+				:
+			(
+				((/*control*/~ < /*threshold*/~) ?
+				(
+					)" + TakeLow + R"(/*low*/~
+				)
+					:
+				(
+					)" + TakeHigh + R"(/*high*/~
+				))
+			))
+			)";
+			}
+			else
+			{
+				// {	falloff,			control,	threshold,		falloff,		low,		control,		threshold,		falloff,		high,			low,			high,		control,		threshold,		falloff,	control,		threshold,		low,			high }
+				args = { i.sources_[4], i.sources_[2], i.sources_[3], i.sources_[4], i.sources_[0], i.sources_[2], i.sources_[3], i.sources_[4], i.sources_[1], i.sources_[0], i.sources_[1], i.sources_[2], i.sources_[3], i.sources_[4], i.sources_[2], i.sources_[3], i.sources_[0], i.sources_[1], };
+				s = R"(
 			((/*falloff*/~ > 0.0) ?
 			(
 				((/*control*/~<(/*threshold*/~ - /*falloff*/~)) ?
 				(
-					/*low*/~
+					)" + TakeLow + R"(/*low*/~
 				)
 					: ((/*control*/~>(/*threshold*/~ + /*falloff*/~)) ?
 					(
-						/*high*/~
+						)" + TakeHigh + R"(/*high*/~
 					)
 						:
 					(
 						/*low high blend*/
-						Select_Blend(~,~,~,~,~)
+						)" + TakeBlend + R"(Select_Blend(~,~,~,~,~)
 					))
 				)
 			)
@@ -593,14 +2124,15 @@ namespace ANLtoC {
 			(
 				((/*control*/~ < /*threshold*/~) ?
 				(
-					/*low*/~
+					)" + TakeLow + R"(/*low*/~
 				)
 					:
 				(
-					/*high*/~
+					)" + TakeHigh + R"(/*high*/~
 				))
 			))
 			)";
+			}
 			return RecursiveFormat(Data, std::string(s), args, FunctionList);
 		}
 
@@ -611,115 +2143,19 @@ namespace ANLtoC {
 		case OP_U: return RecursiveFormat(Data, std::string("(^.u)"), EmptyArgs, FunctionList);
 		case OP_V: return RecursiveFormat(Data, std::string("(^.v)"), EmptyArgs, FunctionList);
 
-		case OP_DX:
-		{
-			std::array<unsigned int, 1> args;
-			// { value, spacing }
-			args = { i.sources_[0] };// value
-			std::string OriginalValue = RecursiveFormat(Data, std::string("~"), args, FunctionList);
-			args = { i.sources_[1] };// spacing
-			std::string TranslateToNewPoint = RecursiveFormat(Data, std::string("(^ + Point(~,0.0,0.0,0.0,0.0,0.0))"), args, FunctionList);
-			Data.DomainInputStack.push_back(TranslateToNewPoint);
-			args = { i.sources_[0] };// value
-			std::string TranslatedValue = InstructionToElement(Data, i.sources_[0], FunctionList);
-			Data.DomainInputStack.pop_back();
-
-			std::string FinalResult;
-			args = { i.sources_[1] };// spacing
-			return RecursiveFormat(Data, std::string("((" + OriginalValue + " - " + TranslatedValue + ") / ~)"), args, FunctionList);
-		}
-		case OP_DY:
-		{
-			std::array<unsigned int, 1> args;
-			// { value, spacing }
-			args = { i.sources_[0] };// value
-			std::string OriginalValue = RecursiveFormat(Data, std::string("~"), args, FunctionList);
-			args = { i.sources_[1] };// spacing
-			std::string TranslateToNewPoint = RecursiveFormat(Data, std::string("(^ + Point(0.0,~,0.0,0.0,0.0,0.0))"), args, FunctionList);
-			Data.DomainInputStack.push_back(TranslateToNewPoint);
-			args = { i.sources_[0] };// value
-			std::string TranslatedValue = InstructionToElement(Data, i.sources_[0], FunctionList);
-			Data.DomainInputStack.pop_back();
-
-			std::string FinalResult;
-			args = { i.sources_[1] };// spacing
-			return RecursiveFormat(Data, std::string("((" + OriginalValue + " - " + TranslatedValue + ") / ~)"), args, FunctionList);
-		}
-		case OP_DZ:
-		{
-			std::array<unsigned int, 1> args;
-			// { value, spacing }
-			args = { i.sources_[0] };// value
-			std::string OriginalValue = RecursiveFormat(Data, std::string("~"), args, FunctionList);
-			args = { i.sources_[1] };// spacing
-			std::string TranslateToNewPoint = RecursiveFormat(Data, std::string("(^ + Point(0.0,0.0,~,0.0,0.0,0.0))"), args, FunctionList);
-			Data.DomainInputStack.push_back(TranslateToNewPoint);
-			args = { i.sources_[0] };// value
-			std::string TranslatedValue = InstructionToElement(Data, i.sources_[0], FunctionList);
-			Data.DomainInputStack.pop_back();
-
-			std::string FinalResult;
-			args = { i.sources_[1] };// spacing
-			return RecursiveFormat(Data, std::string("((" + OriginalValue + " - " + TranslatedValue + ") / ~)"), args, FunctionList);
-		}
-		case OP_DW:
-		{
-			std::array<unsigned int, 1> args;
-			// { value, spacing }
-			args = { i.sources_[0] };// value
-			std::string OriginalValue = RecursiveFormat(Data, std::string("~"), args, FunctionList);
-			args = { i.sources_[1] };// spacing
-			std::string TranslateToNewPoint = RecursiveFormat(Data, std::string("(^ + Point(0.0,0.0,0.0,~,0.0,0.0))"), args, FunctionList);
-			Data.DomainInputStack.push_back(TranslateToNewPoint);
-			args = { i.sources_[0] };// value
-			std::string TranslatedValue = InstructionToElement(Data, i.sources_[0], FunctionList);
-			Data.DomainInputStack.pop_back();
-
-			std::string FinalResult;
-			args = { i.sources_[1] };// spacing
-			return RecursiveFormat(Data, std::string("((" + OriginalValue + " - " + TranslatedValue + ") / ~)"), args, FunctionList);
-		}
-		case OP_DU:
-		{
-			std::array<unsigned int, 1> args;
-			// { value, spacing }
-			args = { i.sources_[0] };// value
-			std::string OriginalValue = RecursiveFormat(Data, std::string("~"), args, FunctionList);
-			args = { i.sources_[1] };// spacing
-			std::string TranslateToNewPoint = RecursiveFormat(Data, std::string("(^ + Point(0.0,0.0,0.0,0.0,~,0.0))"), args, FunctionList);
-			Data.DomainInputStack.push_back(TranslateToNewPoint);
-			args = { i.sources_[0] };// value
-			std::string TranslatedValue = InstructionToElement(Data, i.sources_[0], FunctionList);
-			Data.DomainInputStack.pop_back();
-
-			std::string FinalResult;
-			args = { i.sources_[1] };// spacing
-			return RecursiveFormat(Data, std::string("((" + OriginalValue + " - " + TranslatedValue + ") / ~)"), args, FunctionList);
-		}
-		case OP_DV:
-		{
-			std::array<unsigned int, 1> args;
-			// { value, spacing }
-			args = { i.sources_[0] };// value
-			std::string OriginalValue = RecursiveFormat(Data, std::string("~"), args, FunctionList);
-			args = { i.sources_[1] };// spacing
-			std::string TranslateToNewPoint = RecursiveFormat(Data, std::string("(^ + Point(0.0,0.0,0.0,0.0,0.0,~))"), args, FunctionList);
-			Data.DomainInputStack.push_back(TranslateToNewPoint);
-			args = { i.sources_[0] };// value
-			std::string TranslatedValue = InstructionToElement(Data, i.sources_[0], FunctionList);
-			Data.DomainInputStack.pop_back();
-
-			std::string FinalResult;
-			args = { i.sources_[1] };// spacing
-			return RecursiveFormat(Data, std::string("((" + OriginalValue + " - " + TranslatedValue + ") / ~)"), args, FunctionList);
-		}
+		case OP_DX: return DerivativeToElement(Data, i, "(^.TranslateX(~))", FunctionList);
+		case OP_DY: return DerivativeToElement(Data, i, "(^.TranslateY(~))", FunctionList);
+		case OP_DZ: return DerivativeToElement(Data, i, "(^.TranslateZ(~))", FunctionList);
+		case OP_DW: return DerivativeToElement(Data, i, "(^.TranslateW(~))", FunctionList);
+		case OP_DU: return DerivativeToElement(Data, i, "(^.TranslateU(~))", FunctionList);
+		case OP_DV: return DerivativeToElement(Data, i, "(^.TranslateV(~))", FunctionList);
 
 		case OP_Sigmoid:
 		{
 			std::array<unsigned int, 3> args;
 			// { r, s, c }
 			args = { i.sources_[2], i.sources_[0], i.sources_[1] };
-			return RecursiveFormat(Data, std::string("(1.0 / (1.0 + std::exp(-~ * (~ - ~)))"), args, FunctionList);
+			return RecursiveFormat(Data, "(1.0 / (1.0 + " + MathFunction(Data, "std::exp", "FastExp") + "(-~ * (~ - ~))))", args, FunctionList);
 		}
 		case OP_Radial:
 		{
@@ -747,61 +2183,640 @@ namespace ANLtoC {
 		}
 		
 		case OP_Color:
-			return "OP_Color is unsupported.";
+			return ToString(Luminance(i.outrgba_.r, i.outrgba_.g, i.outrgba_.b));
 		case OP_ExtractRed:
-			return "OP_ExtractRed is unsupported.";
+			return ExtractToElement(Data, i.sources_[0], "r", FunctionList);
 		case OP_ExtractGreen:
-			return "OP_ExtractGreen is unsupported.";
+			return ExtractToElement(Data, i.sources_[0], "g", FunctionList);
 		case OP_ExtractBlue:
-			return "OP_Color is unsupported.";
+			return ExtractToElement(Data, i.sources_[0], "b", FunctionList);
 		case OP_ExtractAlpha:
-			return "OP_Color is unsupported.";
+			return ExtractToElement(Data, i.sources_[0], "a", FunctionList);
 		case OP_Grayscale:
 		{
+			if (IsColorNode(Data, i.sources_[0]))
+				return "Luminance(" + ColorToElement(Data, i.sources_[0], FunctionList) + ")";
 			std::array<unsigned int, 1> args;
 			args = { i.sources_[0] };
 			return RecursiveFormat(Data, std::string("~"), args, FunctionList);
 		}
 		case OP_CombineRGBA:
-			return "OP_CombineRGBA is unsupported.";
+		{
+			std::array<unsigned int, 3> args;
+			// { r, g, b }
+			args = { i.sources_[0], i.sources_[1], i.sources_[2] };
+			return RecursiveFormat(Data, "(" + ToString(LuminanceRed) + " * ~ + " + ToString(LuminanceGreen) + " * ~ + " + ToString(LuminanceBlue) + " * ~)", args, FunctionList);
+		}
 
 		default:
-			return "Error!";
+			return VMFallbackToElement(Data, index, FunctionList);
+		}
+	}
+
+	// Emits the body of a grid mapping function that writes every sample of the loops in Grid to Output.
+	// Values depending on only some of the loops are evaluated once per combination of those loops.
+	// Returns the per sample expression, the values it hoists are recorded in Grid.
+	std::string KernelToGrid(ANLtoC_EmitData& Data, unsigned int Root, GridEmitData& Grid, const DomainDependency& InitialDomain, bool Color, std::vector<FunctionData>& FunctionList)
+	{
+		Grid.DomainMaskStack.push_back(InitialDomain);
+		Grid.DomainReferenceStack.push_back(0);
+		Grid.EnclosingMask = (1u << Grid.Loops.size()) - 1;
+
+		Data.Grid = &Grid;
+		Data.Dimensions = Grid.Dimensions;
+		std::string Expression = Color ? ColorToElement(Data, Root, FunctionList) : InstructionToElement(Data, Root, FunctionList);
+		Data.Dimensions = 0;
+		Data.Grid = nullptr;
+		return Expression;
+	}
+
+	// how a grid mapping function stores its samples
+	enum class GridStore
+	{
+		Output,
+		// also adds each row to the function's Reduction argument right after it is written
+		OutputAndReduce,
+		// hands the index, the first two loop variables and the sample to the function's Write argument
+		Quantized
+	};
+
+	// The body of a grid mapping function that stores every sample of the loops in Grid.
+	// Must run after all emission so the cache size and prologue are final.
+	std::string GridToC(ANLtoC_EmitData& Data, const GridEmitData& Grid, const std::string& Expression, GridStore Store = GridStore::Output)
+	{
+		const unsigned int AllLoops = (1u << Grid.Loops.size()) - 1;
+		const std::string CacheSize = std::to_string(std::max(Data.CacheSize, 1));
+		std::string ResetCache = "std::fill(CacheIsValid, CacheIsValid + " + CacheSize + ", false);\n";
+		std::string Code = Expression;
+		for (const std::string& Statement : Data.Prologue)
+			Code += Statement;
+		for (const GridHoist& Hoist : Grid.Hoists)
+			Code += Hoist.Expression;
+
+		std::string Body = UnusedEntryParameters(Code, { "NamedInput", "Footprint" });
+		Body += "\tPoint EvalPoint;\n";
+		Body += "\tEvalPoint.x = EvalPoint.y = EvalPoint.z = EvalPoint.w = EvalPoint.u = EvalPoint.v = 0.0;\n";
+		Body += "\tEvalPoint.dimensions = " + std::to_string(Grid.Dimensions) + ";\n";
+		for (const GridLoop& Loop : Grid.Loops)
+			Body += "\t" + Loop.SetStart + "\n";
+		Body += CacheLocals(Code, Data.CacheSize, ResetCache);
+		if (!Data.Prologue.empty())
+		{
+			if (!ResetCache.empty())
+				Body += "\t" + ResetCache;
+			for (const std::string& Statement : Data.Prologue)
+				Body += "\t" + Statement + "\n";
+		}
+		for (const GridHoist& Hoist : Grid.Hoists)
+		{
+			if (Hoist.ArrayLoops == 0)
+				continue;
+			std::string Size;
+			for (std::size_t n = 0; n < Grid.Loops.size(); ++n)
+			{
+				if ((Hoist.ArrayLoops & (1u << n)) != 0)
+					Size += (Size.empty() ? "(std::size_t)" : " * ") + Grid.Loops[n].Count;
+			}
+			Body += "\tstd::vector<double> " + Hoist.Name + "(" + Size + ");\n";
+		}
+
+		// Scope n is entered after the n outermost loops have been opened. Scalars come first, then
+		// each group of prepass arrays with the smaller groups ahead of the groups that may read them.
+		std::string Indent = "\t";
+		for (std::size_t Scope = 0; Scope <= Grid.Loops.size(); ++Scope)
+		{
+			if (Scope > 0)
+			{
+				const GridLoop& Loop = Grid.Loops[Grid.Loops.size() - Scope];
+				Body += "\n" + Indent + "for (int " + Loop.Variable + " = 0; " + Loop.Variable + " < " + Loop.Count + "; ++" + Loop.Variable + ")\n";
+				Body += Indent + "{\n";
+				Indent += "\t";
+				Body += Indent + Loop.SetCoordinate + "\n";
+			}
+
+			std::string Scalars;
+			std::vector<unsigned int> ArrayGroups;
+			for (const GridHoist& Hoist : Grid.Hoists)
+			{
+				if (Hoist.Scope != Scope)
+					continue;
+				if (Hoist.ArrayLoops == 0)
+					Scalars += Indent + "const double " + Hoist.Name + " = " + Hoist.Expression + ";\n";
+				else if (std::find(ArrayGroups.begin(), ArrayGroups.end(), Hoist.ArrayLoops) == ArrayGroups.end())
+					ArrayGroups.push_back(Hoist.ArrayLoops);
+			}
+			if (!Scalars.empty())
+				Body += (ResetCache.empty() ? "" : Indent + ResetCache) + Scalars;
+
+			std::sort(ArrayGroups.begin(), ArrayGroups.end(), [](unsigned int a, unsigned int b) {
+				std::size_t CountA = 0, CountB = 0;
+				for (unsigned int m = a; m != 0; m &= m - 1) CountA++;
+				for (unsigned int m = b; m != 0; m &= m - 1) CountB++;
+				return CountA != CountB ? CountA < CountB : a < b;
+			});
+			for (unsigned int ArrayLoops : ArrayGroups)
+			{
+				std::string PrepassIndent = Indent;
+				Body += "\n";
+				for (int n = (int)Grid.Loops.size() - 1; n >= 0; --n)
+				{
+					if ((ArrayLoops & (1u << n)) == 0)
+						continue;
+					const GridLoop& Loop = Grid.Loops[n];
+					Body += PrepassIndent + "for (int " + Loop.Variable + " = 0; " + Loop.Variable + " < " + Loop.Count + "; ++" + Loop.Variable + ")\n";
+					Body += PrepassIndent + "{\n";
+					PrepassIndent += "\t";
+					Body += PrepassIndent + Loop.SetCoordinate + "\n";
+				}
+				if (!ResetCache.empty())
+					Body += PrepassIndent + ResetCache;
+				for (const GridHoist& Hoist : Grid.Hoists)
+				{
+					if (Hoist.Scope == Scope && Hoist.ArrayLoops == ArrayLoops)
+						Body += PrepassIndent + GridHoistReference(Grid, Hoist) + " = " + Hoist.Expression + ";\n";
+				}
+				while (PrepassIndent.size() > Indent.size())
+				{
+					PrepassIndent.pop_back();
+					Body += PrepassIndent + "}\n";
+				}
+			}
+		}
+
+		if (!ResetCache.empty())
+			Body += Indent + ResetCache;
+		if (Data.Options.ProfileInstrumentation)
+			Body += Indent + "ProfileSample();\n";
+		if (Store == GridStore::Quantized)
+			Body += Indent + "Write(" + GridIndex(Grid, AllLoops) + ", " + Grid.Loops[0].Variable + ", " + Grid.Loops[1].Variable + ", " + Expression + ");\n";
+		else
+			Body += Indent + "Output[" + GridIndex(Grid, AllLoops) + "] = " + Expression + ";\n";
+		while (Indent.size() > 1)
+		{
+			Indent.pop_back();
+			Body += Indent + "}\n";
+			if (Store == GridStore::OutputAndReduce && Indent.size() == Grid.Loops.size())
+			{
+				const std::string& Width = Grid.Loops[0].Count;
+				Body += Indent + "if (Reduction)\n";
+				Body += Indent + "\tReduction->Add(Output + (std::size_t)" + Width + " * (" + GridIndex(Grid, AllLoops & ~1u) + "), " + Width + ");\n";
+			}
+		}
+		return Body;
+	}
+
+	// The body of ANL_CPP_RetainedMap2D::Update, which recomputes the buffers depending on a changed named
+	// input in list order and returns the buffer of the root. Must run after all emission.
+	std::string RetainedToC(ANLtoC_EmitData& Data, const RetainEmitData& Retain, const std::vector<std::string>& InputNames, std::size_t RootBuffer)
+	{
+		const std::string CacheSize = std::to_string(std::max(Data.CacheSize, 1));
+		std::string ResetCache = "std::fill(CacheIsValid, CacheIsValid + " + CacheSize + ", false);\n";
+		std::string Code;
+		for (const std::string& Statement : Data.Prologue)
+			Code += Statement;
+		for (const RetainedBuffer& Buffer : Retain.Buffers)
+			Code += Buffer.Expression;
+		auto Hex = [](std::uint64_t Mask) {
+			char Text[32];
+			snprintf(Text, sizeof(Text), "0x%016llxull", (unsigned long long)Mask);
+			return std::string(Text);
+		};
+
+		std::string Body;
+		Body += "\t// the top bit marks the first update, which evaluates every buffer\n";
+		Body += "\t// so does a new footprint, which can reweight any of them\n";
+		Body += "\tstd::uint64_t Changed = Valid && Footprint == PreviousFootprint ? 0 : ~(std::uint64_t)0;\n";
+		if (!InputNames.empty())
+		{
+			Body += "\tif (Valid)\n";
+			Body += "\t{\n";
+			for (const std::string& Name : InputNames)
+				Body += "\t\tif (NamedInput." + Name + " != Previous." + Name + ")\n\t\t\tChanged |= " + Hex(Retain.InputBits.at(Name)) + ";\n";
+			Body += "\t}\n";
+		}
+		Body += "\tPrevious = NamedInput;\n";
+		Body += "\tPreviousFootprint = Footprint;\n";
+		Body += "\tValid = true;\n";
+		Body += "\tif (Changed == 0)\n";
+		Body += "\t\treturn Retained[" + std::to_string(RootBuffer) + "].data();\n";
+		Body += "\n";
+		Body += "\tPoint EvalPoint;\n";
+		Body += "\tEvalPoint.x = EvalPoint.y = EvalPoint.z = EvalPoint.w = EvalPoint.u = EvalPoint.v = 0.0;\n";
+		Body += "\tEvalPoint.dimensions = 2;\n";
+		Body += CacheLocals(Code, Data.CacheSize, ResetCache);
+		if (!Data.Prologue.empty())
+		{
+			if (!ResetCache.empty())
+				Body += "\t" + ResetCache;
+			for (const std::string& Statement : Data.Prologue)
+				Body += "\t" + Statement + "\n";
+		}
+
+		for (std::size_t b = 0; b < Retain.Buffers.size(); ++b)
+		{
+			const RetainedBuffer& Buffer = Retain.Buffers[b];
+			Body += "\n";
+			Body += "\tif ((Changed & " + Hex(Buffer.Mask | 1ull << 63) + ") != 0)\n";
+			Body += "\t{\n";
+			Body += "\t\tfor (int j = 0; j < Height; ++j)\n";
+			Body += "\t\t{\n";
+			Body += "\t\t\tEvalPoint.y = StartY + StepY * j;\n";
+			Body += "\t\t\tfor (int i = 0; i < Width; ++i)\n";
+			Body += "\t\t\t{\n";
+			Body += "\t\t\t\tEvalPoint.x = StartX + StepX * i;\n";
+			Body += "\t\t\t\tconst std::size_t Sample = (std::size_t)j * Width + i;\n";
+			if (!ResetCache.empty())
+				Body += "\t\t\t\t" + ResetCache;
+			Body += "\t\t\t\tRetained[" + std::to_string(b) + "][Sample] = " + Buffer.Expression + ";\n";
+			Body += "\t\t\t}\n";
+			Body += "\t\t}\n";
+			Body += "\t}\n";
+		}
+		Body += "\treturn Retained[" + std::to_string(RootBuffer) + "].data();";
+		return Body;
+	}
+}
+
+// Points the sources of every instruction at the first instruction with the same opcode, payload and
+// canonical sources, so structurally identical subgraphs become one node. Sources of additions and
+// multiplications are compared unordered, those of std::max and std::min aren't as NaN and signed zeros make
+// them depend on the order. The domain a node is evaluated in comes from the path to it, which the emitter
+// already keys its caches by, so nodes are merged regardless of where they are used.
+// Returns the instruction each index was merged into.
+std::vector<unsigned int> CanonicalizeKernel(anl::InstructionListType& k)
+{
+	std::vector<unsigned int> Representative(k.size());
+	std::unordered_map<std::string, unsigned int> Seen;
+	for (unsigned int n = 0; n < k.size(); ++n)
+	{
+		SInstruction& i = k[n];
+		const unsigned int OperandCount = ANLtoC::GetOperandCount(i.opcode_);
+		// sources always come before the instruction using them, anything else isn't an index
+		for (unsigned int s = 0; s < OperandCount; ++s)
+		{
+			if (i.sources_[s] < n)
+				i.sources_[s] = Representative[i.sources_[s]];
+		}
+
+		std::vector<unsigned int> Sources(i.sources_, i.sources_ + OperandCount);
+		switch (i.opcode_)
+		{
+		case OP_Add:
+		case OP_Multiply:
+			std::sort(Sources.begin(), Sources.end());
+			break;
+		}
+
+		std::string Key;
+		auto Append = [&Key](const void* Bytes, std::size_t Size) { Key.append(static_cast<const char*>(Bytes), Size); };
+		Append(&i.opcode_, sizeof(i.opcode_));
+		Append(&i.outfloat_, sizeof(i.outfloat_));
+		Append(&i.outrgba_.r, sizeof(i.outrgba_.r));
+		Append(&i.outrgba_.g, sizeof(i.outrgba_.g));
+		Append(&i.outrgba_.b, sizeof(i.outrgba_.b));
+		Append(&i.outrgba_.a, sizeof(i.outrgba_.a));
+		if (!Sources.empty())
+			Append(Sources.data(), sizeof(Sources[0]) * Sources.size());
+		if (i.opcode_ == OP_NamedInput)
+			Key += i.namedInput;
+
+		Representative[n] = Seen.emplace(Key, n).first->second;
+	}
+	return Representative;
+}
+
+// FNV-1a over the instructions up to Root and the options that change the generated values, so the hash
+// changes whenever the samples of the generated map functions may have
+std::uint64_t KernelHash(anl::InstructionListType& k, const std::vector<unsigned int>& Roots, const ANLtoC::TranspileOptions& Options)
+{
+	// bump when the generated code changes the values it produces
+	const std::uint32_t FormatVersion = 1;
+	std::uint64_t Hash = 14695981039346656037ull;
+	auto Mix = [&Hash](const void* Bytes, std::size_t Size)
+	{
+		for (std::size_t b = 0; b < Size; ++b)
+		{
+			Hash ^= static_cast<const unsigned char*>(Bytes)[b];
+			Hash *= 1099511628211ull;
 		}
+	};
+
+	Mix(&FormatVersion, sizeof(FormatVersion));
+	Mix(&Options.FastMathLevel, sizeof(Options.FastMathLevel));
+	if (Options.TabulationTolerance > 0.0)
+		Mix(&Options.TabulationTolerance, sizeof(Options.TabulationTolerance));
+	unsigned int Last = 0;
+	for (unsigned int Root : Roots)
+	{
+		Mix(&Root, sizeof(Root));
+		Last = std::max(Last, Root);
+	}
+	for (unsigned int n = 0; n <= Last; ++n)
+	{
+		const SInstruction& i = k[n];
+		std::uint64_t Value;
+		std::memcpy(&Value, &i.outfloat_, sizeof(Value));
+		Mix(&i.opcode_, sizeof(i.opcode_));
+		Mix(&Value, sizeof(Value));
+		Mix(&i.outrgba_.r, sizeof(i.outrgba_.r));
+		Mix(&i.outrgba_.g, sizeof(i.outrgba_.g));
+		Mix(&i.outrgba_.b, sizeof(i.outrgba_.b));
+		Mix(&i.outrgba_.a, sizeof(i.outrgba_.a));
+		Mix(i.sources_, sizeof(i.sources_[0]) * ANLtoC::GetOperandCount(i.opcode_));
+		if (i.opcode_ == OP_NamedInput)
+			Mix(i.namedInput.c_str(), i.namedInput.size() + 1);
 	}
+	return Hash;
 }
 
-void ANLtoC::KernelToC(anl::CKernel& Kernel, const anl::CInstructionIndex& Root, std::string& ExpressionToExecute, std::string& NamedInputStructGuts, std::vector<FunctionData> &FunctionList)
+// the body of a function evaluating Expression once at EvalPoint into a local of type ResultType named FinalResult
+std::string EvaluateToC(ANLtoC::ANLtoC_EmitData& Data, const std::string& ResultType, const std::string& Expression)
 {
-	ANLtoC_EmitData Data(*Kernel.getKernel());
-	Data.DomainInputStack.push_back("EvalPoint");
+	std::string Code = Expression;
+	for (const std::string& Statement : Data.Prologue)
+		Code += Statement;
+	std::string ResetCache = "for(int i = 0; i < " + std::to_string(Data.CacheSize) + "; ++i)\n\t\tCacheIsValid[i] = false;\n";
+
+	std::string Body = ANLtoC::UnusedEntryParameters(Code, { "EvalPoint", "NamedInput", "Footprint" });
+	Body += ANLtoC::CacheLocals(Code, Data.CacheSize, ResetCache);
+	if (!ResetCache.empty())
+		Body += "\t" + ResetCache;
+	for (const std::string& Statement : Data.Prologue)
+		Body += "\t" + Statement + "\n";
+	Body += "\n";
+	if (Data.Options.ProfileInstrumentation)
+		Body += "\tProfileSample();\n";
+	Body += "\t" + ResultType + " FinalResult = ";
+	Body += Expression;
+	Body += ";";
+	return Body;
+}
+
+void ANLtoC::KernelToC(anl::CKernel& Kernel, const anl::CInstructionIndex& Root, KernelCode& Code, const TranspileOptions& Options)
+{
+	KernelToC(Kernel, Root, std::vector<KernelOutput>(), Code, Options);
+}
 
-	unsigned int index = Root.GetIndex();
+void ANLtoC::KernelToC(anl::CKernel& Kernel, const anl::CInstructionIndex& Root, const std::vector<KernelOutput>& Outputs, KernelCode& Code, const TranspileOptions& Options)
+{
+	InstructionListType Canonical = *Kernel.getKernel();
+	const std::vector<unsigned int> Representative = CanonicalizeKernel(Canonical);
+	ANLtoC_EmitData Data(Canonical, Options);
+	Data.DomainInputStack.push_back({ "EvalPoint", IdentityAffine(), true, Literal(1.0) });
+	std::vector<FunctionData>& FunctionList = Code.Functions;
+	FunctionList.clear();
+
+	unsigned int index = Representative[Root.GetIndex()];
+
+	std::vector<unsigned int> Roots = { index };
+	for (const KernelOutput& Output : Outputs)
+		Roots.push_back(Representative[Output.Root]);
+	Code.KernelHash = KernelHash(Data.k, Roots, Options);
+	// profiles only depend on the graph, not on the options used to generate the profiled build
+	Code.ProfileHash = KernelHash(Data.k, Roots, TranspileOptions());
+	Code.ProfileNodeCount = (unsigned int)Data.k.size();
+	Code.ProfileUsed = Options.Profile != nullptr && Options.Profile->KernelHash == Code.ProfileHash && Options.Profile->Samples > 0;
+	if (Code.ProfileUsed)
+		Data.Profile = Options.Profile.get();
 	
 	std::string Body = InstructionToElement(Data, index, FunctionList);
+	const bool IsColor = IsColorNode(Data, index);
+	std::string ColorBody;
+	if (IsColor)
+		ColorBody = ColorToElement(Data, index, FunctionList);
+
+	GridEmitData Grid2D;
+	Grid2D.Dimensions = 2;
+	Grid2D.Loops.push_back({ "i", "Width", "EvalPoint.x = StartX + StepX * i;", "EvalPoint.x = StartX;" });
+	Grid2D.Loops.push_back({ "j", "Height", "EvalPoint.y = StartY + StepY * j;", "EvalPoint.y = StartY;" });
+	GridEmitData GridRGBA2D = Grid2D;
+	GridEmitData GridOutputs2D = Grid2D;
+	std::string Map2DExpression = KernelToGrid(Data, index, Grid2D, { 1u, 2u, 0u, 0u, 0u, 0u }, false, FunctionList);
+
+	GridEmitData Grid3D;
+	Grid3D.Dimensions = 3;
+	Grid3D.Loops.push_back({ "i", "Width", "EvalPoint.x = StartX + StepX * i;", "EvalPoint.x = StartX;" });
+	Grid3D.Loops.push_back({ "j", "Height", "EvalPoint.y = StartY + StepY * j;", "EvalPoint.y = StartY;" });
+	Grid3D.Loops.push_back({ "k", "Depth", "EvalPoint.z = StartZ + StepZ * k;", "EvalPoint.z = StartZ;" });
+	GridEmitData GridOutputs3D = Grid3D;
+	std::string Map3DExpression = KernelToGrid(Data, index, Grid3D, { 1u, 2u, 4u, 0u, 0u, 0u }, false, FunctionList);
+
+	// the seamless grids walk the precomputed circles, each loop moving two coordinates
+	GridEmitData GridSeamless2D, GridSeamless3D;
+	std::string MapSeamless2DExpression, MapSeamless3DExpression;
+	if (Options.SeamlessMap)
+	{
+		GridSeamless2D.Dimensions = 4;
+		GridSeamless2D.Loops.push_back({ "i", "Width", "EvalPoint.x = CosX[i]; EvalPoint.y = SinX[i];", "EvalPoint.x = CosX[0]; EvalPoint.y = SinX[0];" });
+		GridSeamless2D.Loops.push_back({ "j", "Height", "EvalPoint.z = CosY[j]; EvalPoint.w = SinY[j];", "EvalPoint.z = CosY[0]; EvalPoint.w = SinY[0];" });
+		MapSeamless2DExpression = KernelToGrid(Data, index, GridSeamless2D, { 1u, 1u, 2u, 2u, 0u, 0u }, false, FunctionList);
+
+		GridSeamless3D.Dimensions = 6;
+		GridSeamless3D.Loops = GridSeamless2D.Loops;
+		GridSeamless3D.Loops.push_back({ "k", "Depth", "EvalPoint.u = CosZ[k]; EvalPoint.v = SinZ[k];", "EvalPoint.u = CosZ[0]; EvalPoint.v = SinZ[0];" });
+		MapSeamless3DExpression = KernelToGrid(Data, index, GridSeamless3D, { 1u, 1u, 2u, 2u, 4u, 4u }, false, FunctionList);
+	}
+
+	std::string MapRGBA2DExpression;
+	if (IsColor)
+		MapRGBA2DExpression = KernelToGrid(Data, index, GridRGBA2D, { 1u, 2u, 0u, 0u, 0u, 0u }, true, FunctionList);
+
+	// the outputs share one cache, so a node used by several of them is evaluated once per sample
+	std::string OutputsBody, MapOutputs2DExpression, MapOutputs3DExpression;
+	Code.OutputsStructGuts.clear();
+	for (const KernelOutput& Output : Outputs)
+	{
+		const unsigned int OutputIndex = Representative[Output.Root];
+		const std::string Separator = OutputsBody.empty() ? "ANL_CPP_Outputs{ " : ", ";
+		OutputsBody += Separator + InstructionToElement(Data, OutputIndex, FunctionList);
+		MapOutputs2DExpression += Separator + KernelToGrid(Data, OutputIndex, GridOutputs2D, { 1u, 2u, 0u, 0u, 0u, 0u }, false, FunctionList);
+		MapOutputs3DExpression += Separator + KernelToGrid(Data, OutputIndex, GridOutputs3D, { 1u, 2u, 4u, 0u, 0u, 0u }, false, FunctionList);
+		Code.OutputsStructGuts += "\tdouble " + Output.Name + ";\n";
+	}
+
+	// the scalar maps are also evaluated in bands, which offset the outermost loop
+	GridEmitData GridRows2D = Grid2D;
+	GridRows2D.Loops[1].SetCoordinate = "EvalPoint.y = StartY + StepY * (FirstRow + j);";
+	GridRows2D.Loops[1].SetStart = "EvalPoint.y = StartY + StepY * FirstRow;";
+	GridEmitData GridSlices3D = Grid3D;
+	GridSlices3D.Loops[2].SetCoordinate = "EvalPoint.z = StartZ + StepZ * (FirstSlice + k);";
+	GridSlices3D.Loops[2].SetStart = "EvalPoint.z = StartZ + StepZ * FirstSlice;";
+	Code.Map2D = GridToC(Data, GridRows2D, Map2DExpression, GridStore::OutputAndReduce);
+	Code.Map3D = GridToC(Data, GridSlices3D, Map3DExpression, GridStore::OutputAndReduce);
+	Code.MapQuantized2D.clear();
+	Code.MapQuantized3D.clear();
+	if (Options.QuantizedMap)
+	{
+		Code.MapQuantized2D = GridToC(Data, Grid2D, Map2DExpression, GridStore::Quantized);
+		Code.MapQuantized3D = GridToC(Data, Grid3D, Map3DExpression, GridStore::Quantized);
+	}
+	Code.MapSeamless2D.clear();
+	Code.MapSeamless3D.clear();
+	if (Options.SeamlessMap)
+	{
+		Code.MapSeamless2D = GridToC(Data, GridSeamless2D, MapSeamless2DExpression);
+		Code.MapSeamless3D = GridToC(Data, GridSeamless3D, MapSeamless3DExpression);
+	}
+	Code.MapRGBA2D.clear();
+	if (IsColor)
+		Code.MapRGBA2D = GridToC(Data, GridRGBA2D, MapRGBA2DExpression);
+	Code.MapOutputs2D.clear();
+	Code.MapOutputs3D.clear();
+	if (!Outputs.empty())
+	{
+		Code.MapOutputs2D = GridToC(Data, GridOutputs2D, MapOutputs2DExpression + " }");
+		Code.MapOutputs3D = GridToC(Data, GridOutputs3D, MapOutputs3DExpression + " }");
+	}
+
+	Code.RetainedUpdate.clear();
+	Code.RetainedBufferCount = 0;
+	if (Options.RetainedMap)
+	{
+		std::vector<std::string> InputNames;
+		RetainEmitData Retain;
+		for (auto& NameValuePair : Kernel.ListNamedInput())
+		{
+			const std::string& Name = std::get<0>(NameValuePair);
+			if (Retain.InputBits.count(Name) != 0)
+				continue;
+			// bit 63 is reserved for the first update
+			Retain.InputBits[Name] = 1ull << std::min<std::size_t>(InputNames.size(), 62);
+			InputNames.push_back(Name);
+		}
+		Retain.DomainMaskStack.push_back(0);
+		// the root is always stored, it is the returned buffer
+		Retain.EnclosingMask = ~0ull;
+
+		Data.Retain = &Retain;
+		Data.Dimensions = 2;
+		std::string RootExpression = InstructionToElement(Data, index, FunctionList);
+		std::uint64_t RootMask = InputDependency(Data, index);
+		Data.Dimensions = 0;
+		Data.Retain = nullptr;
+
+		// a root not worth storing on its own, such as a constant, still gets a buffer to return
+		std::size_t RootBuffer = Retain.Buffers.size();
+		const std::string RootReference = "Retained[" + std::to_string(RootBuffer - 1) + "][Sample]";
+		if (RootBuffer > 0 && RootExpression == RootReference)
+			RootBuffer--;
+		else
+			Retain.Buffers.push_back({ RootExpression, RootMask });
+
+		Code.RetainedUpdate = RetainedToC(Data, Retain, InputNames, RootBuffer);
+		Code.RetainedBufferCount = (unsigned int)Retain.Buffers.size();
+	}
+
+	// domain transforms and the fallback kernel are used by the functions but never use them
+	FunctionList.insert(FunctionList.begin(), Data.DomainTransformList.begin(), Data.DomainTransformList.end());
+	Code.VMFallbackCount = (unsigned int)Data.VMFallbacks.size();
+	if (!Data.VMFallbacks.empty())
+		FunctionList.insert(FunctionList.begin(), VMFallbackKernelToC(Data));
 
 	// search through the Kernel and generate a list of all NamedInput
-	NamedInputStructGuts.clear();
+	Code.NamedInputStructGuts.clear();
 	std::vector<std::tuple<std::string, double>> NameList = Kernel.ListNamedInput();
 	for (auto& NameValuePair : NameList)
 	{
 		std::string& Name = std::get<0>(NameValuePair);
 		double DefaultValue = std::get<1>(NameValuePair);
 
-		NamedInputStructGuts += "\tdouble " + Name + " = " + ToString(DefaultValue) + ";\n";
+		Code.NamedInputStructGuts += "\tdouble " + Name + " = " + ToString(DefaultValue) + ";\n";
 	}
-	
 
-	ExpressionToExecute.clear();
-	ExpressionToExecute += "\tbool CacheIsValid[" + std::to_string(Data.CacheSize) + "];\n";
-	ExpressionToExecute += "\tdouble Cache[" + std::to_string(Data.CacheSize) + "];\n";
-	ExpressionToExecute += "\tfor(int i = 0; i < " + std::to_string(Data.CacheSize) + "; ++i)\n";
-	ExpressionToExecute += "\t\tCacheIsValid[i] = false;\n";
-	ExpressionToExecute += "\n";
-	ExpressionToExecute += "\tdouble FinalResult = ";
-	ExpressionToExecute += Body;
-	ExpressionToExecute += ";";
+	Code.Evaluate = EvaluateToC(Data, "double", Body);
+	Code.EvaluateRGBA.clear();
+	if (IsColor)
+		Code.EvaluateRGBA = EvaluateToC(Data, "ANL_CPP_RGBA", ColorBody);
+	Code.EvaluateOutputs.clear();
+	if (!Outputs.empty())
+		Code.EvaluateOutputs = EvaluateToC(Data, "ANL_CPP_Outputs", OutputsBody + " }");
+}
+
+unsigned int ANLtoC::AppendKernel(anl::CKernel& Destination, anl::CKernel& Source, const anl::CInstructionIndex& Root)
+{
+	InstructionListType& From = *Source.getKernel();
+	std::vector<std::tuple<std::string, double>> SourceInputs = Source.ListNamedInput();
+	std::vector<unsigned int> Copied(Root.GetIndex() + 1);
+	for (unsigned int n = 0; n <= Root.GetIndex(); ++n)
+	{
+		const SInstruction& i = From[n];
+		if (i.opcode_ == OP_NamedInput)
+		{
+			// a name Destination already has is the same input, otherwise it is declared with the source's default
+			InstructionListType& To = *Destination.getKernel();
+			auto Existing = std::find_if(To.begin(), To.end(), [&i](const SInstruction& d) {
+				return d.opcode_ == OP_NamedInput && d.namedInput == i.namedInput;
+			});
+			if (Existing != To.end())
+			{
+				Copied[n] = (unsigned int)(Existing - To.begin());
+				continue;
+			}
+			double DefaultValue = 0.0;
+			for (auto& NameValuePair : SourceInputs)
+			{
+				if (std::get<0>(NameValuePair) == i.namedInput)
+					DefaultValue = std::get<1>(NameValuePair);
+			}
+			Copied[n] = Destination.namedInput(i.namedInput, DefaultValue).GetIndex();
+			continue;
+		}
+
+		SInstruction Copy = i;
+		// sources always come before the instruction using them, anything else isn't an index
+		for (unsigned int s = 0; s < GetOperandCount(i.opcode_); ++s)
+		{
+			if (i.sources_[s] < n)
+				Copy.sources_[s] = Copied[i.sources_[s]];
+		}
+		Destination.getKernel()->push_back(Copy);
+		Copied[n] = (unsigned int)Destination.getKernel()->size() - 1;
+	}
+	return Copied[Root.GetIndex()];
 }
 
 
 
+bool ANLtoC::ReadProfile(const std::string& Text, KernelProfile& Profile)
+{
+	std::istringstream Lines(Text);
+	std::string Line, Word;
+	int Version = 0;
+	if (!std::getline(Lines, Line) || !(std::istringstream(Line) >> Word >> Version) || Word != "ANLProfile" || Version != 1)
+		return false;
+
+	Profile = KernelProfile();
+	bool HasHash = false;
+	while (std::getline(Lines, Line))
+	{
+		std::istringstream Fields(Line);
+		if (!(Fields >> Word))
+			continue;
+		bool Valid;
+		if (Word == "KernelHash")
+			Valid = HasHash = static_cast<bool>(Fields >> std::hex >> Profile.KernelHash);
+		else if (Word == "Samples")
+			Valid = static_cast<bool>(Fields >> Profile.Samples);
+		else if (Word == "Node")
+		{
+			unsigned int Index;
+			std::uint64_t Count;
+			Valid = static_cast<bool>(Fields >> Index >> Count);
+			if (Valid)
+				Profile.Reached[Index] = Count;
+		}
+		else if (Word == "Select")
+		{
+			unsigned int Index;
+			std::array<std::uint64_t, 3> Counts;
+			Valid = static_cast<bool>(Fields >> Index >> Counts[0] >> Counts[1] >> Counts[2]);
+			if (Valid)
+				Profile.Taken[Index] = Counts;
+		}
+		else
+			Valid = false;
+		if (!Valid)
+			return false;
+	}
+	return HasHash;
+}
@@ -4,7 +4,11 @@
 //
 /////////////////////////////////////////
 
+#include <array>
+#include <cstdint>
+#include <memory>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
 namespace anl {
@@ -19,7 +23,119 @@ namespace ANLtoC {
 		unsigned int RelatedIndex;
 	};
 
-	void KernelToC(anl::CKernel& Kernel, const anl::CInstructionIndex& Root, std::string& ExpressionToExecute, std::string& NamedInputStructGuts, std::vector<FunctionData>& FunctionList);
+	// what a build with TranspileOptions::ProfileInstrumentation counted over a run, indexed like the
+	// kernel after identical subgraphs are merged
+	struct KernelProfile
+	{
+		// KernelCode::ProfileHash of the instrumented build, a profile of any other kernel is ignored
+		std::uint64_t KernelHash = 0;
+		std::uint64_t Samples = 0;
+		// times each node was evaluated, cache hits included
+		std::unordered_map<unsigned int, std::uint64_t> Reached;
+		// samples each select took its low input, its high input and the blend of both for
+		std::unordered_map<unsigned int, std::array<std::uint64_t, 3>> Taken;
+	};
+
+	// parses the file written by ANL_CPP_WriteProfile, returns false if it isn't one
+	bool ReadProfile(const std::string& Text, KernelProfile& Profile);
+
+	// samples of the kernel evaluated ahead of time over a grid, embedded in the output for ANL_CPP_SampleBaked
+	struct BakedMap
+	{
+		int Width = 0, Height = 0;
+		double StartX = 0.0, StartY = 0.0;
+		double StepX = 1.0, StepY = 1.0;
+		// Width * Height values, row after row
+		std::vector<double> Samples;
+	};
+
+	struct TranspileOptions
+	{
+		// 0 calls the standard library, 1 and 2 use the polynomial approximations
+		// in the generated source, 2 trading accuracy (about 5e-7) for speed
+		int FastMathLevel = 0;
+		static const int MaxFastMathLevel = 2;
+		// subgraphs whose expression grows past this many characters are moved to their own function, 0 disables
+		std::size_t OutlineBudget = 16384;
+		// number of extra source files the generated functions are spread across, 0 keeps them in the main source
+		int SplitSourceCount = 0;
+		// costly subgraphs of scalar operators applied to one noise basis are replaced by a table over the basis'
+		// range, interpolated within this absolute error, 0 disables
+		double TabulationTolerance = 0.0;
+		// emits ANL_CPP_ChunkService, a prioritized thread pool evaluating map requests asynchronously
+		bool ChunkService = false;
+		// emits ANL_CPP_TileCache, an in memory and on disk cache of map results
+		bool TileCache = false;
+		// emits ANL_CPP_RetainedMap2D, which only recomputes what depends on the named inputs that changed
+		bool RetainedMap = false;
+		// emits ANL_CPP_MapAdaptive, which refines a coarse grid only where interpolating it is not accurate enough
+		bool AdaptiveMap = false;
+		// emits ANL_CPP_MapQuantized2D/3D, which store 8 or 16 bit integers or half floats straight from the grid loop
+		bool QuantizedMap = false;
+		// emits ANL_CPP_MapSeamless2D/3D, which evaluate the kernel in 4D or 6D on circles so the result tiles
+		bool SeamlessMap = false;
+		// emits ANL_CPP_SampleBaked, interpolating these samples stored as 16 bit integers
+		std::shared_ptr<const BakedMap> Baked;
+		// counts the evaluations of every node and the branches each select takes, for ANL_CPP_WriteProfile
+		bool ProfileInstrumentation = false;
+		// counts of a representative run of the instrumented build, guiding caching, outlining, select
+		// branch order and tabulation in place of the fixed opcode lists
+		std::shared_ptr<const KernelProfile> Profile;
+	};
+
+	// a value evaluated alongside the root by the fused ANL_CPP_EvalOutputs and ANL_CPP_MapOutputs functions,
+	// Name is its member of ANL_CPP_Outputs
+	struct KernelOutput
+	{
+		std::string Name;
+		unsigned int Root;
+	};
+
+	// everything generated for one kernel, OutputFullCppFile places it into the output files
+	struct KernelCode
+	{
+		// bodies of ANL_CPP_Evaluate and the grid mapping functions
+		std::string Evaluate;
+		std::string Map2D;
+		std::string Map3D;
+		// bodies of the RGBA entry points, empty unless the root is color valued
+		std::string EvaluateRGBA;
+		std::string MapRGBA2D;
+		std::string NamedInputStructGuts;
+		std::vector<FunctionData> Functions;
+		// members of ANL_CPP_Outputs and the bodies of the fused entry points, empty without outputs
+		std::string OutputsStructGuts;
+		std::string EvaluateOutputs;
+		std::string MapOutputs2D;
+		std::string MapOutputs3D;
+		// bodies of the quantized grid mapping functions, empty unless TranspileOptions::QuantizedMap is set
+		std::string MapQuantized2D;
+		std::string MapQuantized3D;
+		// bodies of the seamless tile functions, empty unless TranspileOptions::SeamlessMap is set
+		std::string MapSeamless2D;
+		std::string MapSeamless3D;
+		// body of ANL_CPP_RetainedMap2D::Update and the number of region buffers it uses
+		std::string RetainedUpdate;
+		unsigned int RetainedBufferCount = 0;
+		// instructions with no native translation, evaluated by the noise VM embedded in the output
+		unsigned int VMFallbackCount = 0;
+		// identifies the kernel and the options affecting its values, ANL_CPP_KERNEL_HASH in the header
+		std::uint64_t KernelHash = 0;
+		// identifies the kernel alone, matched against KernelProfile::KernelHash
+		std::uint64_t ProfileHash = 0;
+		// size of the counter arrays of the instrumented build
+		unsigned int ProfileNodeCount = 0;
+		// false when TranspileOptions::Profile was given for another kernel and ignored
+		bool ProfileUsed = false;
+	};
+
+	void KernelToC(anl::CKernel& Kernel, const anl::CInstructionIndex& Root, KernelCode& Code, const TranspileOptions& Options);
+	// also emits the fused entry points of Outputs, evaluating the nodes they share with each other and the root once per sample
+	void KernelToC(anl::CKernel& Kernel, const anl::CInstructionIndex& Root, const std::vector<KernelOutput>& Outputs, KernelCode& Code, const TranspileOptions& Options);
+
+	// copies the instructions Root depends on to the end of Destination, named inputs already in Destination
+	// are shared. Returns the index of the copied root.
+	unsigned int AppendKernel(anl::CKernel& Destination, anl::CKernel& Source, const anl::CInstructionIndex& Root);
 }
 
 
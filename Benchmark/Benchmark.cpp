@@ -0,0 +1,373 @@
+/////////////////////////////////////////
+//
+// File Header Place Holder
+//
+/////////////////////////////////////////
+
+// Times each transpiler stage against synthetic kernels of growing size so
+// super-linear behaviour in the emitter shows up before real kernels hit it.
+
+#include "ANLtoCPP/ANLtoC.h"
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <random>
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstdio>
+#include "Output.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#include <psapi.h>
+#pragma comment(lib, "psapi.lib")
+#else
+#include <sys/resource.h>
+#endif
+
+#define ANL_IMPLEMENTATION
+// ANL is currently in a transition to a single file format, thus
+// we need to IMPLEMENT_STB even though we don't use it.
+#define IMPLEMENT_STB
+#include <accidental-noise-library/anl.h>
+#include <accidental-noise-library/lang/NoiseParser.h>
+
+struct SyntheticKernelShape
+{
+	unsigned int Nodes = 1000;
+	// longest chain of operators from a leaf to the root
+	unsigned int Depth = 32;
+	// average number of operators reading each node
+	double FanOut = 1.5;
+	// fraction of operators that are a Select
+	double SelectDensity = 0.05;
+	unsigned int Seed = 1;
+};
+
+// Builds a random graph of roughly Shape.Nodes instructions. Leaves are coordinates, constants
+// and basis functions, the rest are a mix of arithmetic, domain and Select operators. Every node
+// ends up reachable from the returned root.
+anl::CInstructionIndex BuildSyntheticKernel(anl::CKernel& Kernel, const SyntheticKernelShape& Shape)
+{
+	std::mt19937 Random(Shape.Seed);
+	std::uniform_real_distribution<double> Unit(0.0, 1.0);
+
+	struct Node
+	{
+		anl::CInstructionIndex Index;
+		unsigned int Depth;
+		unsigned int Readers;
+	};
+	std::vector<Node> Nodes;
+	std::vector<std::size_t> Unread;
+
+	auto AddNode = [&](anl::CInstructionIndex Index, unsigned int Depth) {
+		Unread.push_back(Nodes.size());
+		Nodes.push_back({ Index, Depth, 0 });
+	};
+
+	// prefers nodes nobody reads yet, reusing a read node often enough to reach the requested fan out
+	auto PickSource = [&]() -> std::size_t {
+		std::size_t Picked;
+		if (!Unread.empty() && Unit(Random) * Shape.FanOut < 1.0)
+		{
+			std::size_t Slot = Unread.size() - 1 - std::min<std::size_t>(Unread.size() - 1, (std::size_t)(Unit(Random) * 4.0));
+			Picked = Unread[Slot];
+			Unread.erase(Unread.begin() + Slot);
+		}
+		else
+		{
+			Picked = (std::size_t)(Unit(Random) * Nodes.size());
+			for (std::size_t Attempt = 0; Attempt < 8 && Nodes[Picked].Depth >= Shape.Depth; ++Attempt)
+				Picked = (std::size_t)(Unit(Random) * Nodes.size());
+			auto UnreadItr = std::find(Unread.begin(), Unread.end(), Picked);
+			if (UnreadItr != Unread.end())
+				Unread.erase(UnreadItr);
+		}
+		Nodes[Picked].Readers++;
+		return Picked;
+	};
+
+	auto Constant = [&](double Low, double High) {
+		return Kernel.constant(Low + (High - Low) * Unit(Random));
+	};
+
+	const unsigned int LeafCount = std::max(4u, Shape.Nodes / 16);
+	for (unsigned int n = 0; n < LeafCount; ++n)
+	{
+		switch (n % 6)
+		{
+		case 0: AddNode(Kernel.x(), 0); break;
+		case 1: AddNode(Kernel.y(), 0); break;
+		case 2: AddNode(Kernel.gradientBasis(Kernel.constant(3), Kernel.seed(n)), 0); break;
+		case 3: AddNode(Kernel.valueBasis(Kernel.constant(3), Kernel.seed(n)), 0); break;
+		case 4: AddNode(Kernel.simplexBasis(Kernel.seed(n)), 0); break;
+		default: AddNode(Constant(-1.0, 1.0), 0); break;
+		}
+	}
+
+	while (Kernel.getKernel()->size() < Shape.Nodes)
+	{
+		std::size_t a = PickSource();
+		unsigned int Depth = Nodes[a].Depth + 1;
+		anl::CInstructionIndex A = Nodes[a].Index;
+		auto Second = [&]() {
+			std::size_t b = PickSource();
+			Depth = std::max(Depth, Nodes[b].Depth + 1);
+			return Nodes[b].Index;
+		};
+
+		if (Unit(Random) < Shape.SelectDensity)
+		{
+			anl::CInstructionIndex B = Second();
+			anl::CInstructionIndex Control = Second();
+			AddNode(Kernel.select(A, B, Control, Constant(-0.5, 0.5), Constant(0.0, 0.2)), Depth);
+			continue;
+		}
+
+		switch ((unsigned int)(Unit(Random) * 9.0))
+		{
+		case 0: AddNode(Kernel.add(A, Second()), Depth); break;
+		case 1: AddNode(Kernel.subtract(A, Second()), Depth); break;
+		case 2: AddNode(Kernel.multiply(A, Second()), Depth); break;
+		case 3: AddNode(Kernel.maximum(A, Second()), Depth); break;
+		case 4: AddNode(Kernel.minimum(A, Second()), Depth); break;
+		case 5: AddNode(Kernel.sin(A), Depth); break;
+		case 6: AddNode(Kernel.bias(A, Constant(0.2, 0.8)), Depth); break;
+		case 7: AddNode(Kernel.scaleDomain(A, Constant(0.5, 4.0)), Depth); break;
+		default: AddNode(Kernel.translateDomain(A, Constant(-8.0, 8.0)), Depth); break;
+		}
+	}
+
+	// fold whatever nobody reads into the root
+	anl::CInstructionIndex Root = Nodes.back().Index;
+	for (std::size_t n : Unread)
+	{
+		if (Nodes[n].Index.GetIndex() != Root.GetIndex())
+			Root = Kernel.add(Root, Nodes[n].Index);
+	}
+	return Root;
+}
+
+double PeakResidentMegabytes()
+{
+#ifdef _WIN32
+	PROCESS_MEMORY_COUNTERS Counters;
+	if (!GetProcessMemoryInfo(GetCurrentProcess(), &Counters, sizeof(Counters)))
+		return 0.0;
+	return (double)Counters.PeakWorkingSetSize / (1024.0 * 1024.0);
+#else
+	rusage Usage;
+	if (getrusage(RUSAGE_SELF, &Usage) != 0)
+		return 0.0;
+#ifdef __APPLE__
+	return (double)Usage.ru_maxrss / (1024.0 * 1024.0);
+#else
+	return (double)Usage.ru_maxrss / 1024.0;
+#endif
+#endif
+}
+
+class StageTimer
+{
+public:
+	StageTimer() : Start(std::chrono::steady_clock::now()) {}
+
+	// milliseconds since construction or the previous call
+	double Lap()
+	{
+		auto Now = std::chrono::steady_clock::now();
+		double Elapsed = std::chrono::duration<double, std::milli>(Now - Start).count();
+		Start = Now;
+		return Elapsed;
+	}
+
+private:
+	std::chrono::steady_clock::time_point Start;
+};
+
+struct StageReport
+{
+	std::string Name;
+	std::size_t NodeCount = 0;
+	double ParseMs = -1.0;
+	double KernelToCMs = 0.0;
+	double OutputMs = 0.0;
+	double WriteMs = 0.0;
+	std::size_t OutputBytes = 0;
+	double PeakMegabytes = 0.0;
+};
+
+void PrintReportHeader()
+{
+	printf("%-28s %8s %10s %12s %10s %10s %12s %10s %10s\n",
+		"kernel", "nodes", "parse ms", "toC ms", "output ms", "write ms", "bytes", "us/node", "peak MB");
+}
+
+void PrintReport(const StageReport& Report)
+{
+	char Parse[32] = "-";
+	if (Report.ParseMs >= 0.0)
+		snprintf(Parse, sizeof(Parse), "%.2f", Report.ParseMs);
+	double PerNode = Report.NodeCount > 0 ? (Report.KernelToCMs + Report.OutputMs) * 1000.0 / Report.NodeCount : 0.0;
+	printf("%-28s %8zu %10s %12.2f %10.2f %10.2f %12zu %10.2f %10.1f\n",
+		Report.Name.c_str(), Report.NodeCount, Parse, Report.KernelToCMs, Report.OutputMs, Report.WriteMs,
+		Report.OutputBytes, PerNode, Report.PeakMegabytes);
+	fflush(stdout);
+}
+
+bool WriteBenchmarkFile(const std::string& FileName, const std::string& Contents)
+{
+	std::ofstream File(FileName, std::ios::binary);
+	File.write(Contents.data(), Contents.size());
+	return File.good();
+}
+
+// runs every stage after parsing on Kernel, filling in everything but the parse time
+bool TranspileStages(anl::CKernel& Kernel, const anl::CInstructionIndex& Root, const ANLtoC::TranspileOptions& Options, const std::string& OutputStem, StageReport& Report)
+{
+	Report.NodeCount = Kernel.getKernel()->size();
+	StageTimer Timer;
+
+	std::string Code;
+	std::string HeaderFile;
+	std::string InternalHeaderFile;
+	std::vector<std::string> PartFiles;
+	ANLtoC::KernelCode Generated;
+	ANLtoC::KernelToC(Kernel, Root, Generated, Options);
+	Report.KernelToCMs = Timer.Lap();
+
+	std::string StemFileName = OutputStem.substr(OutputStem.find_last_of("/\\") + 1);
+	OutputFullCppFile(Generated, StemFileName + ".h", StemFileName + "_internal.h", Code, HeaderFile, InternalHeaderFile, PartFiles, Options);
+	Report.OutputMs = Timer.Lap();
+
+	bool Written = WriteBenchmarkFile(OutputStem + ".cpp", Code) && WriteBenchmarkFile(OutputStem + ".h", HeaderFile);
+	Report.OutputBytes = Code.size() + HeaderFile.size();
+	if (!InternalHeaderFile.empty())
+	{
+		Written = Written && WriteBenchmarkFile(OutputStem + "_internal.h", InternalHeaderFile);
+		Report.OutputBytes += InternalHeaderFile.size();
+	}
+	for (std::size_t Part = 0; Part < PartFiles.size(); ++Part)
+	{
+		Written = Written && WriteBenchmarkFile(OutputStem + "_part" + std::to_string(Part) + ".cpp", PartFiles[Part]);
+		Report.OutputBytes += PartFiles[Part].size();
+	}
+	Report.WriteMs = Timer.Lap();
+	Report.PeakMegabytes = PeakResidentMegabytes();
+
+	if (!Written)
+		std::cerr << "Write failed for: " << OutputStem << std::endl;
+	return Written;
+}
+
+std::vector<unsigned int> ParseSizeList(const std::string& Text)
+{
+	std::vector<unsigned int> Sizes;
+	std::stringstream Stream(Text);
+	std::string Item;
+	while (std::getline(Stream, Item, ','))
+	{
+		unsigned long Size = strtoul(Item.c_str(), nullptr, 10);
+		if (Size > 0)
+			Sizes.push_back((unsigned int)Size);
+	}
+	return Sizes;
+}
+
+int main(int argc, char* argv[])
+{
+	SyntheticKernelShape Shape;
+	ANLtoC::TranspileOptions Options;
+	std::vector<unsigned int> Sizes = { 100, 300, 1000, 3000, 10000 };
+	std::string OutputDirectory = ".";
+	std::vector<std::string> InputFiles;
+
+	for (int a = 1; a < argc; ++a)
+	{
+		std::string Arg = argv[a];
+		bool HasValue = a + 1 < argc;
+		if (Arg == "--sizes" && HasValue)
+			Sizes = ParseSizeList(argv[++a]);
+		else if (Arg == "--depth" && HasValue)
+			Shape.Depth = (unsigned int)strtoul(argv[++a], nullptr, 10);
+		else if (Arg == "--fan-out" && HasValue)
+			Shape.FanOut = std::max(1.0, strtod(argv[++a], nullptr));
+		else if (Arg == "--select-density" && HasValue)
+			Shape.SelectDensity = strtod(argv[++a], nullptr);
+		else if (Arg == "--seed" && HasValue)
+			Shape.Seed = (unsigned int)strtoul(argv[++a], nullptr, 10);
+		else if (Arg == "--out" && HasValue)
+			OutputDirectory = argv[++a];
+		else if (Arg == "--fast-math-level" && HasValue)
+			Options.FastMathLevel = std::min(std::max(atoi(argv[++a]), 0), (int)ANLtoC::TranspileOptions::MaxFastMathLevel);
+		else if (Arg == "--outline-budget" && HasValue)
+			Options.OutlineBudget = (std::size_t)strtoul(argv[++a], nullptr, 10);
+		else if (Arg == "--split-sources" && HasValue)
+			Options.SplitSourceCount = std::max(0, atoi(argv[++a]));
+		else if (Arg.compare(0, 2, "--") == 0)
+		{
+			std::cerr << "USAGE: ANLTranspilerBenchmark.exe [--sizes 100,1000,...] [--depth N] [--fan-out F]" << std::endl;
+			std::cerr << "  [--select-density D] [--seed N] [--out directory] [--fast-math-level N]" << std::endl;
+			std::cerr << "  [--outline-budget N] [--split-sources N] [kernel.anl ...]" << std::endl;
+			std::cerr << "  Transpiles a synthetic kernel of each size, then each .anl file given," << std::endl;
+			std::cerr << "  and reports the time spent in every stage." << std::endl;
+			return Arg == "--help" ? 0 : -1;
+		}
+		else
+			InputFiles.push_back(Arg);
+	}
+
+	printf("depth %u, fan out %.2f, select density %.3f, seed %u\n", Shape.Depth, Shape.FanOut, Shape.SelectDensity, Shape.Seed);
+	PrintReportHeader();
+
+	int Result = 0;
+	for (unsigned int Size : Sizes)
+	{
+		Shape.Nodes = Size;
+		anl::CKernel Kernel;
+		anl::CInstructionIndex Root = BuildSyntheticKernel(Kernel, Shape);
+
+		StageReport Report;
+		Report.Name = "synthetic_" + std::to_string(Size);
+		if (!TranspileStages(Kernel, Root, Options, OutputDirectory + "/" + Report.Name, Report))
+			Result = -9;
+		PrintReport(Report);
+	}
+
+	for (const std::string& InputFile : InputFiles)
+	{
+		std::ifstream File(InputFile, std::ios::binary);
+		if (!File)
+		{
+			std::cerr << "Unable to open file: " << InputFile << std::endl;
+			Result = -9;
+			continue;
+		}
+		std::stringstream Text;
+		Text << File.rdbuf();
+
+		StageReport Report;
+		Report.Name = InputFile.substr(InputFile.find_last_of("/\\") + 1);
+		StageTimer Timer;
+		anl::lang::NoiseParser NoiseParser(Text.str());
+		bool Success = NoiseParser.Parse();
+		Report.ParseMs = Timer.Lap();
+		if (!Success)
+		{
+			std::cerr << "Error parsing noise file: " << InputFile << "\nErrors:\n" << NoiseParser.FormErrorMsgs() << std::endl;
+			Result = -30;
+			continue;
+		}
+
+		std::string Stem = Report.Name.substr(0, Report.Name.find_last_of('.'));
+		if (!TranspileStages(NoiseParser.GetKernel(), NoiseParser.GetParseResult(), Options, OutputDirectory + "/" + Stem, Report))
+			Result = -9;
+		PrintReport(Report);
+	}
+
+	return Result;
+}
@@ -4,215 +4,16 @@
 //
 /////////////////////////////////////////
 
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <limits>
 #include <string>
 #include "ANLtoCPP/ANLtoC.h"
 
 const static std::string OutputString = R"abc(
-#include <string>
-#include <vector>
-#include <cmath>
-#include <accidental-noise-library/anl.h>
-#include "<HEADER_FILE_NAME>"
-
-double hex_function(double x, double y);// from vm.cpp
-
-struct Point
-{
-	double x, y, z, w, u, v;
-	int dimensions = 0;
-
-	Point()
-	{
-	}
-
-	Point(double x, double y, double z, double w, double u, double v)
-		: x(x), y(y), z(z), w(w), u(u), v(v)
-	{
-	}
-
-	double Length() const {
-		return std::sqrt(x * x + y * y + z * z + w * w + u * u + v * v);
-	}
-
-	Point Scale(double d) const {
-		Point p;
-		p.z = p.w = p.u = p.v = 0.0;
-		p.dimensions = dimensions;
-		switch (dimensions)
-		{
-		default:
-			p.v = v * d;
-			p.u = u * d;
-		case 4:
-			p.w = w * d;
-		case 3:
-			p.z = z * d;
-		case 2:
-			p.y = y * d;
-			p.x = x * d;
-		}
-		return p;
-	}
-
-	Point& ScaleX(double d) {
-		x *= d;
-		return *this;
-	}
-	
-	Point& ScaleY(double d) {
-		y *= d;
-		return *this;
-	}
-	
-	Point& ScaleZ(double d) {
-		z *= d;
-		return *this;
-	}
-	
-	Point& ScaleW(double d) {
-		w *= d;
-		return *this;
-	}
-
-	Point& ScaleU(double d) {
-		u *= d;
-		return *this;
-	}
-
-	Point& ScaleV(double d) {
-		v *= d;
-		return *this;
-	}
-
-	Point Translate(double d) {
-		Point p = *this;
-		p.dimensions = dimensions;
-		switch (dimensions)
-		{
-		default:
-			p.v = v + d;
-			p.u = u + d;
-		case 4:
-			p.w = w + d;
-		case 3:
-			p.z = z + d;
-		case 2:
-			p.y = y + d;
-			p.x = x + d;
-		}
-		return p;
-	}
-
-	Point& TranslateX(double d) {
-		x += d;
-		return *this;
-	}
-
-	Point& TranslateY(double d) {
-		y += d;
-		return *this;
-	}
-
-	Point& TranslateZ(double d) {
-		z += d;
-		return *this;
-	}
-
-	Point& TranslateW(double d) {
-		w += d;
-		return *this;
-	}
-
-	Point& TranslateU(double d) {
-		u += d;
-		return *this;
-	}
-
-	Point& TranslateV(double d) {
-		v += d;
-		return *this;
-	}
-};
-
-TileCoord  CalcHexPointTile(float px, float py)
-{
-	TileCoord tile;
-	float rise = 0.5f;
-	float slope = rise / 0.8660254f;
-	int X = (int)(px / 1.732051f);
-	int Y = (int)(py / 1.5f);
-
-	float offsetX = px - (float)X*1.732051f;
-	float offsetY = py - (float)Y*1.5f;
-
-	if (fmod(Y, 2) == 0)
-	{
-		if (offsetY < (-slope * offsetX + rise))
-		{
-			--X;
-			--Y;
-		}
-		else if (offsetY < (slope*offsetX - rise))
-		{
-			--Y;
-		}
-	}
-	else
-	{
-		if (offsetX >= 0.8660254f)
-		{
-			if (offsetY <(-slope*offsetX + rise * 2))
-			{
-				--Y;
-			}
-		}
-		else
-		{
-			if (offsetY<(slope*offsetX))
-			{
-				--Y;
-			}
-			else
-			{
-				--X;
-			}
-		}
-	}
-	tile.x = X;
-	tile.y = Y;
-	return tile;
-}
-
-CoordPair CalcHexTileCenter(int tx, int ty)
-{
-	CoordPair origin;
-	float ymod = (float)fmod(ty, 2.0f);
-	if (ymod == 1.0f) ymod = 0.8660254f;
-	else ymod = 0.0f;
-	origin.x = (float)tx*1.732051 + ymod;
-	origin.y = (float)ty*1.5;
-	CoordPair center;
-	center.x = origin.x + 0.8660254;
-	center.y = origin.y + 1.0;
-	return center;
-}
-
-double HexTile(Point p, unsigned int seed)
-{
-	TileCoord tile = CalcHexPointTile((float)p.x, (float)p.y);
-	unsigned int hash = hash_coords_2(tile.x, tile.y, seed);
-	return (double)hash / 255.0;
-}
-
-double HexBump(Point p)
-{
-	TileCoord tile = CalcHexPointTile((float)p.x, (float)p.y);
-	CoordPair center = CalcHexTileCenter(tile.x, tile.y);
-	double dx = p.x - center.x;
-	double dy = p.y - center.y;
-	return hex_function(dx, dy);
-}
-
+<THIS_IS_WHERE_THE_RUNTIME_TYPES_GO>
 double SmoothTiers(double Value, int NumberOfSteps)
 {
 	NumberOfSteps -= 1;
@@ -227,12 +28,15 @@ double SmoothTiers(double Value, int NumberOfSteps)
 	return Tb + t * (Tt - Tb);
 }
 
+<THIS_IS_WHERE_THE_COHERENT_BASES_GO>
 double CellularBasis(Point p, unsigned int dist,
 	double f1, double f2, double f3, double f4,
 	double d1, double d2, double d3, double d4,
-	unsigned int seed)
+	unsigned int seed, unsigned int Site, double Stretch)
 {
 	double f[4], d[4];
+	if (CoherentCellular(p, dist, seed, Site, Stretch, f, d))
+		return f1*f[0] + f2*f[1] + f3*f[2] + f4*f[3] + d1*d[0] + d2*d[1] + d3*d[2] + d4*d[3];
 	switch (p.dimensions)
 	{
 	case 2:
@@ -287,8 +91,11 @@ double SimplexBasis(Point p, unsigned int seed)
 	}
 }
 
-double GradientBasis(Point p, int Interpolation, unsigned int seed)
+double GradientBasis(Point p, int Interpolation, unsigned int seed, unsigned int Site, double Stretch)
 {
+	double Result;
+	if (CoherentLattice<true>(p, Interpolation, seed, Site, Stretch, Result))
+		return Result;
 	switch (p.dimensions)
 	{
 	case 2:
@@ -327,8 +134,11 @@ double GradientBasis(Point p, int Interpolation, unsigned int seed)
 	}
 }
 
-double ValueBasis(Point p, int Interpolation, unsigned int seed)
+double ValueBasis(Point p, int Interpolation, unsigned int seed, unsigned int Site, double Stretch)
 {
+	double Result;
+	if (CoherentLattice<false>(p, Interpolation, seed, Site, Stretch, Result))
+		return Result;
 	switch (p.dimensions)
 	{
 	case 2:
@@ -366,6 +176,114 @@ double ValueBasis(Point p, int Interpolation, unsigned int seed)
 	}
 }
 
+// Approximations used in place of the standard library when ANL_CPP_FAST_MATH_LEVEL > 0,
+// the header lists their maximum error. They are branch free so loops calling them can be vectorized.
+#if ANL_CPP_FAST_MATH_LEVEL >= 2
+#define ANL_CPP_FAST_POLY(full, short) short
+#else
+#define ANL_CPP_FAST_POLY(full, short) full
+#endif
+
+double FastExp(double x)
+{
+	// Results outside this range would be subnormal or infinite. NaN fails both comparisons and is clamped
+	// too, so the conversion of k below stays defined, the select at the end returns it unchanged.
+	double c = x > -708.0 ? (x < 709.0 ? x : 709.0) : -708.0;
+	double k = std::floor(c * 1.4426950408889634 + 0.5);
+	// Cody-Waite reduction, r is within [-ln(2)/2, ln(2)/2]
+	double r = (c - k * 6.93147180369123816490e-01) - k * 1.90821492927058770002e-10;
+	double p = ANL_CPP_FAST_POLY(
+		1.0 + r * (1.0 + r * (1.0 / 2 + r * (1.0 / 6 + r * (1.0 / 24 + r * (1.0 / 120 + r * (1.0 / 720 + r * (1.0 / 5040 + r * (1.0 / 40320 + r * (1.0 / 362880 + r * (1.0 / 3628800 + r * (1.0 / 39916800 + r * (1.0 / 479001600)))))))))))),
+		1.0 + r * (1.0 + r * (1.0 / 2 + r * (1.0 / 6 + r * (1.0 / 24 + r * (1.0 / 120 + r * (1.0 / 720)))))));
+	int64_t Bits = (static_cast<int64_t>(k) + 1023) << 52;
+	double Scale;
+	std::memcpy(&Scale, &Bits, sizeof(Scale));
+	return x == x ? p * Scale : x;
+}
+
+// Reduces x by multiples of pi/2, r is within [-pi/4, pi/4]
+inline double FastReduceHalfPi(double x, int64_t& Quadrant)
+{
+	double q = std::floor(x * 0.63661977236758134308 + 0.5);
+	Quadrant = static_cast<int64_t>(q);
+	return ((x - q * 1.57079632673412561417e+00) - q * 6.07710050650619224932e-11) - q * 2.02226624879595063154e-21;
+}
+
+inline double FastSinPoly(double r)
+{
+	double r2 = r * r;
+	return r + r * r2 * ANL_CPP_FAST_POLY(
+		(-1.0 / 6 + r2 * (1.0 / 120 + r2 * (-1.0 / 5040 + r2 * (1.0 / 362880 + r2 * (-1.0 / 39916800 + r2 * (1.0 / 6227020800.0 + r2 * (-1.0 / 1307674368000.0))))))),
+		(-1.0 / 6 + r2 * (1.0 / 120 + r2 * (-1.0 / 5040))));
+}
+
+inline double FastCosPoly(double r)
+{
+	double r2 = r * r;
+	return 1.0 - 0.5 * r2 + r2 * r2 * ANL_CPP_FAST_POLY(
+		(1.0 / 24 + r2 * (-1.0 / 720 + r2 * (1.0 / 40320 + r2 * (-1.0 / 3628800 + r2 * (1.0 / 479001600 + r2 * (-1.0 / 87178291200.0 + r2 * (1.0 / 20922789888000.0))))))),
+		(1.0 / 24 + r2 * (-1.0 / 720 + r2 * (1.0 / 40320))));
+}
+
+double FastSin(double x)
+{
+	int64_t Quadrant;
+	double r = FastReduceHalfPi(x, Quadrant);
+	double s = FastSinPoly(r);
+	double c = FastCosPoly(r);
+	double v = (Quadrant & 1) ? c : s;
+	return (Quadrant & 2) ? -v : v;
+}
+
+double FastCos(double x)
+{
+	int64_t Quadrant;
+	double r = FastReduceHalfPi(x, Quadrant);
+	double s = FastSinPoly(r);
+	double c = FastCosPoly(r);
+	double v = (Quadrant & 1) ? s : c;
+	return ((Quadrant + 1) & 2) ? -v : v;
+}
+
+double FastTan(double x)
+{
+	int64_t Quadrant;
+	double r = FastReduceHalfPi(x, Quadrant);
+	double s = FastSinPoly(r);
+	double c = FastCosPoly(r);
+	return (Quadrant & 1) ? -c / s : s / c;
+}
+
+double FastAtan(double x)
+{
+	const double Tan15 = 0.26794919243112270647;
+	const double Sqrt3 = 1.73205080756887729353;
+	double a = std::abs(x);
+	// atan(a) = pi/2 - atan(1/a) brings a into [0, 1]
+	bool Invert = a > 1.0;
+	double t = Invert ? 1.0 / a : a;
+	// atan(t) = pi/6 + atan((t*sqrt(3) - 1) / (t + sqrt(3))) brings t into [-tan(15), tan(15)]
+	bool Shift = t > Tan15;
+	t = Shift ? (t * Sqrt3 - 1.0) / (t + Sqrt3) : t;
+	double t2 = t * t;
+	double p = t + t * t2 * ANL_CPP_FAST_POLY(
+		(-1.0 / 3 + t2 * (1.0 / 5 + t2 * (-1.0 / 7 + t2 * (1.0 / 9 + t2 * (-1.0 / 11 + t2 * (1.0 / 13 + t2 * (-1.0 / 15 + t2 * (1.0 / 17 + t2 * (-1.0 / 19 + t2 * (1.0 / 21 + t2 * (-1.0 / 23 + t2 * (1.0 / 25 + t2 * (-1.0 / 27))))))))))))),
+		(-1.0 / 3 + t2 * (1.0 / 5 + t2 * (-1.0 / 7 + t2 * (1.0 / 9 + t2 * (-1.0 / 11))))));
+	p = Shift ? p + 0.52359877559829887308 : p;
+	p = Invert ? 1.57079632679489661923 - p : p;
+	return x < 0.0 ? -p : p;
+}
+
+double FastAsin(double x)
+{
+	return FastAtan(x / std::sqrt((1.0 - x) * (1.0 + x)));
+}
+
+double FastAcos(double x)
+{
+	return 2.0 * FastAtan(std::sqrt((1.0 - x) / (1.0 + x)));
+}
+
 Point RotateDomain(Point EvalPoint, double angle, double ax, double ay, double az)
 {
 	double len = std::sqrt(ax * ax + ay * ay + az * az);
@@ -373,8 +291,13 @@ Point RotateDomain(Point EvalPoint, double angle, double ax, double ay, double a
 	ay /= len;
 	az /= len;
 
-	double cosangle = cos(angle);
-	double sinangle = sin(angle);
+#if ANL_CPP_FAST_MATH_LEVEL > 0
+	double cosangle = FastCos(angle);
+	double sinangle = FastSin(angle);
+#else
+	double cosangle = std::cos(angle);
+	double sinangle = std::sin(angle);
+#endif
 
 	double rotmatrix[3][3];
 
@@ -408,25 +331,32 @@ double Select_Blend(double low, double high, double control, double threshold, d
 	return low + (high - low) * blend;
 }
 
+// weight of a zero mean basis whose lattice cell spans 1 / LatticeFootprint samples,
+// fading out between 4 and 2 samples per cell so it is gone before it would alias
+inline double FootprintWeight(double LatticeFootprint)
+{
+	return std::max(0.0, std::min(1.0, (0.5 - LatticeFootprint) * 4.0));
+}
+
 <THIS_IS_WHERE_ADDITIONAL_FUNCTIONS_GO>
 
-double ANL_CPP_Evaluate(const Point EvalPoint, const ANL_CPP_NamedInput& NamedInput)
+double ANL_CPP_Evaluate(const Point EvalPoint, const ANL_CPP_NamedInput& NamedInput, double Footprint)
 {
 <THIS_IS_WHERE_THE_CODE_GOES>
 	return FinalResult;
 }
 
-double ANL_CPP_EvalScalar(double x, double y, const ANL_CPP_NamedInput& NamedInput)
+double ANL_CPP_EvalScalar(double x, double y, const ANL_CPP_NamedInput& NamedInput, double Footprint)
 {
 	Point p;
 	p.x = p.y = p.z = p.w = p.u = p.v = 0.0;
 	p.dimensions = 2;
 	p.x = x;
 	p.y = y;
-	return ANL_CPP_Evaluate(p, NamedInput);
+	return ANL_CPP_Evaluate(p, NamedInput, Footprint);
 }
 
-double ANL_CPP_EvalScalar(double x, double y, double z, const ANL_CPP_NamedInput& NamedInput)
+double ANL_CPP_EvalScalar(double x, double y, double z, const ANL_CPP_NamedInput& NamedInput, double Footprint)
 {
 	Point p;
 	p.x = p.y = p.z = p.w = p.u = p.v = 0.0;
@@ -434,45 +364,2745 @@ double ANL_CPP_EvalScalar(double x, double y, double z, const ANL_CPP_NamedInput
 	p.x = x;
 	p.y = y;
 	p.z = z;
-	return ANL_CPP_Evaluate(p, NamedInput);
+	return ANL_CPP_Evaluate(p, NamedInput, Footprint);
 }
-)abc";
 
-static const std::string HeaderOutput = R"abc(
+namespace {
+	// the rows of an ANL_CPP_Map2D call from FirstRow on, row j of Output is taken at StartY + StepY * (FirstRow + j)
+	// so a map evaluated in bands matches the single call bit for bit
+	void Map2DRows(double* Output, int Width, int Height, int FirstRow, double StartX, double StartY, double StepX, double StepY, const ANL_CPP_NamedInput& NamedInput, double Footprint, ANL_CPP_Reduction* Reduction)
+	{
+		const CoherentMapScope CoherentScope(std::max(std::abs(StepX), std::abs(StepY)));
+<THIS_IS_WHERE_THE_MAP2D_CODE_GOES>
+	}
 
-struct ANL_CPP_NamedInput
+	// the slices of an ANL_CPP_Map3D call from FirstSlice on, the same way
+	void Map3DSlices(double* Output, int Width, int Height, int Depth, int FirstSlice, double StartX, double StartY, double StartZ, double StepX, double StepY, double StepZ, const ANL_CPP_NamedInput& NamedInput, double Footprint, ANL_CPP_Reduction* Reduction)
+	{
+		const CoherentMapScope CoherentScope(std::max(std::max(std::abs(StepX), std::abs(StepY)), std::abs(StepZ)));
+<THIS_IS_WHERE_THE_MAP3D_CODE_GOES>
+	}
+}
+
+void ANL_CPP_Map2D(double* Output, int Width, int Height, double StartX, double StartY, double StepX, double StepY, const ANL_CPP_NamedInput& NamedInput, double Footprint, ANL_CPP_Reduction* Reduction)
 {
-<THIS_IS_WHERE_THE_NAMED_INPUT_GOES>
-};
+	Map2DRows(Output, Width, Height, 0, StartX, StartY, StepX, StepY, NamedInput, Footprint, Reduction);
+}
+
+void ANL_CPP_Map3D(double* Output, int Width, int Height, int Depth, double StartX, double StartY, double StartZ, double StepX, double StepY, double StepZ, const ANL_CPP_NamedInput& NamedInput, double Footprint, ANL_CPP_Reduction* Reduction)
+{
+	Map3DSlices(Output, Width, Height, Depth, 0, StartX, StartY, StartZ, StepX, StepY, StepZ, NamedInput, Footprint, Reduction);
+}
+<THIS_IS_WHERE_THE_RGBA_FUNCTIONS_GO>
+<THIS_IS_WHERE_THE_EXTENSIONS_GO>)abc";
+
+// entry points of kernels whose root is color valued
+static const std::string RGBAOutput = R"abc(
+ANL_CPP_RGBA ANL_CPP_EvaluateRGBA(const Point EvalPoint, const ANL_CPP_NamedInput& NamedInput, double Footprint)
+{
+<THIS_IS_WHERE_THE_CODE_GOES>
+	return FinalResult;
+}
+
+ANL_CPP_RGBA ANL_CPP_EvalRGBA(double x, double y, const ANL_CPP_NamedInput& NamedInput, double Footprint)
+{
+	Point p;
+	p.x = p.y = p.z = p.w = p.u = p.v = 0.0;
+	p.dimensions = 2;
+	p.x = x;
+	p.y = y;
+	return ANL_CPP_EvaluateRGBA(p, NamedInput, Footprint);
+}
 
-double ANL_CPP_EvalScalar(double x, double y, const ANL_CPP_NamedInput& NamedInput);
-double ANL_CPP_EvalScalar(double x, double y, double z, const ANL_CPP_NamedInput& NamedInput);
+ANL_CPP_RGBA ANL_CPP_EvalRGBA(double x, double y, double z, const ANL_CPP_NamedInput& NamedInput, double Footprint)
+{
+	Point p;
+	p.x = p.y = p.z = p.w = p.u = p.v = 0.0;
+	p.dimensions = 3;
+	p.x = x;
+	p.y = y;
+	p.z = z;
+	return ANL_CPP_EvaluateRGBA(p, NamedInput, Footprint);
+}
 
+void ANL_CPP_MapRGBA2D(ANL_CPP_RGBA* Output, int Width, int Height, double StartX, double StartY, double StepX, double StepY, const ANL_CPP_NamedInput& NamedInput, double Footprint)
+{
+	const CoherentMapScope CoherentScope(std::max(std::abs(StepX), std::abs(StepY)));
+<THIS_IS_WHERE_THE_MAP2D_CODE_GOES>
+}
 )abc";
 
-static const std::string AdditionalFunctionsReplaceToken = "<THIS_IS_WHERE_ADDITIONAL_FUNCTIONS_GO>";
-static const std::string NamedInputReplaceToken = "<THIS_IS_WHERE_THE_NAMED_INPUT_GOES>";
-static const std::string CodeReplaceToken = "<THIS_IS_WHERE_THE_CODE_GOES>";
-static const std::string HeaderFileNameReplaceToken = "<HEADER_FILE_NAME>";
+// the part of the runtime every generated source file needs
+static const std::string RuntimeTypesOutput = R"abc(
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+#include <accidental-noise-library/anl.h>
+#include "<HEADER_FILE_NAME>"
 
-void OutputFullCppFile(std::string CppExpressionToExecute, std::string NamedInputStructGuts, std::string HeaderFileName, std::string& SourceFile, std::string& HeaderFile, const std::vector<ANLtoC::FunctionData>& FunctionList)
+struct Point
 {
-	SourceFile = OutputString;
-	HeaderFile = HeaderOutput;
+	double x, y, z, w, u, v;
+	int dimensions = 0;
 
-	std::string AdditionalFunctionString;
-	for (ANLtoC::FunctionData d : FunctionList)
+	Point()
 	{
-		AdditionalFunctionString += d.FunctionImplementation;
-		AdditionalFunctionString += "\n";
 	}
 
-	std::size_t Offset = SourceFile.find(CodeReplaceToken);
-	SourceFile.replace(Offset, CodeReplaceToken.size(), CppExpressionToExecute);
-	Offset = SourceFile.find(HeaderFileNameReplaceToken);
-	SourceFile.replace(Offset, HeaderFileNameReplaceToken.size(), HeaderFileName);
-	Offset = SourceFile.find(AdditionalFunctionsReplaceToken);
-	SourceFile.replace(Offset, AdditionalFunctionsReplaceToken.size(), AdditionalFunctionString);
-	Offset = HeaderFile.find(NamedInputReplaceToken);
-	HeaderFile.replace(Offset, NamedInputReplaceToken.size(), NamedInputStructGuts);
-}
\ No newline at end of file
+	Point(double x, double y, double z, double w, double u, double v)
+		: x(x), y(y), z(z), w(w), u(u), v(v)
+	{
+	}
+
+	double Length() const {
+		return std::sqrt(x * x + y * y + z * z + w * w + u * u + v * v);
+	}
+
+	Point Scale(double d) const {
+		Point p;
+		p.z = p.w = p.u = p.v = 0.0;
+		p.dimensions = dimensions;
+		switch (dimensions)
+		{
+		default:
+			p.v = v * d;
+			p.u = u * d;
+		case 4:
+			p.w = w * d;
+		case 3:
+			p.z = z * d;
+		case 2:
+			p.y = y * d;
+			p.x = x * d;
+		}
+		return p;
+	}
+
+	Point& ScaleX(double d) {
+		x *= d;
+		return *this;
+	}
+	
+	Point& ScaleY(double d) {
+		y *= d;
+		return *this;
+	}
+	
+	Point& ScaleZ(double d) {
+		z *= d;
+		return *this;
+	}
+	
+	Point& ScaleW(double d) {
+		w *= d;
+		return *this;
+	}
+
+	Point& ScaleU(double d) {
+		u *= d;
+		return *this;
+	}
+
+	Point& ScaleV(double d) {
+		v *= d;
+		return *this;
+	}
+
+	Point Translate(double d) {
+		Point p = *this;
+		p.dimensions = dimensions;
+		switch (dimensions)
+		{
+		default:
+			p.v = v + d;
+			p.u = u + d;
+		case 4:
+			p.w = w + d;
+		case 3:
+			p.z = z + d;
+		case 2:
+			p.y = y + d;
+			p.x = x + d;
+		}
+		return p;
+	}
+
+	Point& TranslateX(double d) {
+		x += d;
+		return *this;
+	}
+
+	Point& TranslateY(double d) {
+		y += d;
+		return *this;
+	}
+
+	Point& TranslateZ(double d) {
+		z += d;
+		return *this;
+	}
+
+	Point& TranslateW(double d) {
+		w += d;
+		return *this;
+	}
+
+	Point& TranslateU(double d) {
+		u += d;
+		return *this;
+	}
+
+	Point& TranslateV(double d) {
+		v += d;
+		return *this;
+	}
+};
+
+inline double PowInteger(double x, int n)
+{
+	double Result = 1.0;
+	double Square = x;
+	for (unsigned int e = n < 0 ? -n : n; e != 0; e >>= 1)
+	{
+		if (e & 1)
+			Result *= Square;
+		Square *= Square;
+	}
+	return n < 0 ? 1.0 / Result : Result;
+}
+
+// x^(n + 0.5)
+inline double PowHalfInteger(double x, int n)
+{
+	return PowInteger(x, n) * std::sqrt(x);
+}
+
+// A function of one value tabulated over [Low, High] for cubic interpolation. The table doubles in size until
+// it is within Tolerance between its samples. Values outside the range, and functions the largest table can't
+// meet the tolerance for, are evaluated by Exact.
+class TabulatedFunction
+{
+public:
+	TabulatedFunction(double (*Exact)(double), double Low, double High, double Tolerance)
+		: Exact(Exact), Low(Low), High(High)
+	{
+		for (int Count = 64; Count <= 65536; Count *= 2)
+		{
+			if (Build(Count, Tolerance))
+				return;
+		}
+		Intervals = 0;
+		Samples.clear();
+	}
+
+	double operator()(double x) const
+	{
+		if (Intervals == 0 || !(x >= Low && x <= High))
+			return Exact(x);
+		double t = (x - Low) * Scale;
+		int i = std::min((int)t, Intervals - 1);
+		t -= i;
+		// Catmull-Rom through the samples i - 1 to i + 2, stored one slot further
+		const double* s = &Samples[i];
+		return s[1] + 0.5 * t * (s[2] - s[0] + t * (2.0 * s[0] - 5.0 * s[1] + 4.0 * s[2] - s[3] + t * (3.0 * (s[1] - s[2]) + s[3] - s[0])));
+	}
+
+private:
+	double (*Exact)(double);
+	double Low, High, Scale = 0.0;
+	int Intervals = 0;
+	std::vector<double> Samples;
+
+	bool Build(int Count, double Tolerance)
+	{
+		Intervals = Count;
+		Scale = Count / (High - Low);
+		Samples.resize(Count + 3);
+		for (int i = 0; i <= Count; ++i)
+		{
+			Samples[i + 1] = Exact(Low + (High - Low) * i / Count);
+			if (!std::isfinite(Samples[i + 1]))
+				return false;
+		}
+		// the ends continue linearly so no sample is taken outside the range
+		Samples[0] = 2.0 * Samples[1] - Samples[2];
+		Samples[Count + 2] = 2.0 * Samples[Count + 1] - Samples[Count];
+		for (int i = 0; i < Count; ++i)
+		{
+			for (double f : { 0.25, 0.5, 0.75 })
+			{
+				double x = Low + (High - Low) * (i + f) / Count;
+				if (!(std::abs((*this)(x) - Exact(x)) <= Tolerance))
+					return false;
+			}
+		}
+		return true;
+	}
+};
+
+double hex_function(double x, double y);// from vm.cpp
+
+// The hex tile containing (px, py), the same float arithmetic as the VM with the row parity taken from the
+// integer and every candidate tested, so the selection compiles to conditional moves.
+inline TileCoord HexPointTile(float px, float py)
+{
+	const float rise = 0.5f;
+	const float slope = rise / 0.8660254f;
+	const int X = (int)(px / 1.732051f);
+	const int Y = (int)(py / 1.5f);
+	const float offsetX = px - (float)X * 1.732051f;
+	const float offsetY = py - (float)Y * 1.5f;
+
+	const bool Odd = (Y & 1) != 0;
+	const bool Right = offsetX >= 0.8660254f;
+	const bool BelowFalling = offsetY < (-slope * offsetX + rise);
+	const bool BelowRising = offsetY < (slope * offsetX - rise);
+	const bool BelowUpperFalling = offsetY < (-slope * offsetX + rise * 2);
+	const bool BelowCenterRising = offsetY < (slope * offsetX);
+
+	const int StepX = Odd ? (!Right && !BelowCenterRising) : BelowFalling;
+	const int StepY = Odd ? (Right ? BelowUpperFalling : BelowCenterRising) : (BelowFalling || BelowRising);
+	TileCoord tile;
+	tile.x = X - StepX;
+	tile.y = Y - StepY;
+	return tile;
+}
+
+inline double HexTile(Point p, unsigned int seed)
+{
+	TileCoord tile = HexPointTile((float)p.x, (float)p.y);
+	unsigned int hash = hash_coords_2(tile.x, tile.y, seed);
+	return (double)hash / 255.0;
+}
+
+inline double HexBump(Point p)
+{
+	TileCoord tile = HexPointTile((float)p.x, (float)p.y);
+	// Positive odd rows are shifted by half a tile. As in the VM, the remainder of a negative odd row is -1
+	// and it isn't shifted.
+	const float Shift = (tile.y % 2 == 1) ? 0.8660254f : 0.0f;
+	const float OriginX = (float)((float)tile.x * 1.732051 + Shift);
+	const float OriginY = (float)((float)tile.y * 1.5);
+	const float CenterX = (float)(OriginX + 0.8660254);
+	const float CenterY = (float)(OriginY + 1.0);
+	return hex_function(p.x - CenterX, p.y - CenterY);
+}
+
+// fills Kernel with the first Count instructions of the transpiled kernel, only emitted when an instruction needs it
+anl::CKernel& BuildVMFallbackKernel(anl::CKernel& Kernel, unsigned int Count);
+
+// a noise VM for the instructions that have no native translation
+struct VMFallbackKernel
+{
+	anl::CKernel Kernel;
+	anl::CNoiseExecutor Executor;
+
+	VMFallbackKernel(unsigned int Count)
+		: Executor(BuildVMFallbackKernel(Kernel, Count))
+	{
+	}
+
+	// evaluates the last instruction of Kernel
+	double Evaluate(const Point& p)
+	{
+		anl::CCoordinate Coordinate;
+		switch (p.dimensions)
+		{
+		case 2: Coordinate = anl::CCoordinate(p.x, p.y); break;
+		case 3: Coordinate = anl::CCoordinate(p.x, p.y, p.z); break;
+		case 4: Coordinate = anl::CCoordinate(p.x, p.y, p.z, p.w); break;
+		default: Coordinate = anl::CCoordinate(p.x, p.y, p.z, p.w, p.u, p.v); break;
+		}
+		return Executor.evaluateAt(Coordinate, Kernel.lastIndex()).outfloat_;
+	}
+};
+
+inline ANL_CPP_RGBA MakeRGBA(double r, double g, double b, double a)
+{
+	ANL_CPP_RGBA c;
+	c.r = (float)r;
+	c.g = (float)g;
+	c.b = (float)b;
+	c.a = (float)a;
+	return c;
+}
+
+// a scalar used where a color is expected
+inline ANL_CPP_RGBA ColorFromScalar(double v)
+{
+	return MakeRGBA(v, v, v, 1.0);
+}
+
+// a color used where a scalar is expected, Rec. 709 weights
+inline double Luminance(const ANL_CPP_RGBA& c)
+{
+	return 0.2126 * c.r + 0.7152 * c.g + 0.0722 * c.b;
+}
+
+inline ANL_CPP_RGBA operator+(const ANL_CPP_RGBA& l, const ANL_CPP_RGBA& r)
+{
+	return MakeRGBA(l.r + r.r, l.g + r.g, l.b + r.b, l.a + r.a);
+}
+
+inline ANL_CPP_RGBA operator-(const ANL_CPP_RGBA& l, const ANL_CPP_RGBA& r)
+{
+	return MakeRGBA(l.r - r.r, l.g - r.g, l.b - r.b, l.a - r.a);
+}
+
+inline ANL_CPP_RGBA operator*(const ANL_CPP_RGBA& l, const ANL_CPP_RGBA& r)
+{
+	return MakeRGBA(l.r * r.r, l.g * r.g, l.b * r.b, l.a * r.a);
+}
+
+inline ANL_CPP_RGBA operator/(const ANL_CPP_RGBA& l, const ANL_CPP_RGBA& r)
+{
+	return MakeRGBA(l.r / r.r, l.g / r.g, l.b / r.b, l.a / r.a);
+}
+
+inline ANL_CPP_RGBA RGBAMax(const ANL_CPP_RGBA& l, const ANL_CPP_RGBA& r)
+{
+	return MakeRGBA(std::max(l.r, r.r), std::max(l.g, r.g), std::max(l.b, r.b), std::max(l.a, r.a));
+}
+
+inline ANL_CPP_RGBA RGBAMin(const ANL_CPP_RGBA& l, const ANL_CPP_RGBA& r)
+{
+	return MakeRGBA(std::min(l.r, r.r), std::min(l.g, r.g), std::min(l.b, r.b), std::min(l.a, r.a));
+}
+
+inline ANL_CPP_RGBA RGBAAbs(const ANL_CPP_RGBA& c)
+{
+	return MakeRGBA(std::abs(c.r), std::abs(c.g), std::abs(c.b), std::abs(c.a));
+}
+
+inline ANL_CPP_RGBA RGBAClamp(const ANL_CPP_RGBA& c, double low, double high)
+{
+	return MakeRGBA(
+		std::max(low, std::min(high, (double)c.r)),
+		std::max(low, std::min(high, (double)c.g)),
+		std::max(low, std::min(high, (double)c.b)),
+		std::max(low, std::min(high, (double)c.a)));
+}
+
+// the VM's Blend of two colors, which interpolates alpha like the other channels
+inline ANL_CPP_RGBA RGBALerp(const ANL_CPP_RGBA& low, const ANL_CPP_RGBA& high, double t)
+{
+	return MakeRGBA(
+		low.r + (high.r - low.r) * t,
+		low.g + (high.g - low.g) * t,
+		low.b + (high.b - low.b) * t,
+		low.a + (high.a - low.a) * t);
+}
+
+// the same selection as the scalar Select, applied to every channel
+inline ANL_CPP_RGBA RGBASelect(const ANL_CPP_RGBA& low, const ANL_CPP_RGBA& high, double control, double threshold, double falloff)
+{
+	if (falloff > 0.0)
+	{
+		if (control < threshold - falloff)
+			return low;
+		if (control > threshold + falloff)
+			return high;
+		double blend = quintic_blend((control - (threshold - falloff)) / (2.0 * falloff));
+		return MakeRGBA(
+			low.r + (high.r - low.r) * blend,
+			low.g + (high.g - low.g) * blend,
+			low.b + (high.b - low.b) * blend,
+			low.a + (high.a - low.a) * blend);
+	}
+	return control < threshold ? low : high;
+}
+)abc";
+
+// coherent basis evaluation during map calls, placed in the main source before CellularBasis
+static const std::string CoherentCellularOutput = R"abc(
+#include <memory>
+
+namespace {
+	// During map calls the cellular basis takes the feature points of the cells around a sample from a window
+	// of cells kept for its call site, instead of hashing the 7 x 7 (x 7) neighbouring cells again for every
+	// sample. The feature points are placed as anl::cellular_function2D and 3D place them, which is checked
+	// against the library once, falling back to it if they differ.
+	thread_local int CoherentMapDepth = 0;
+	// the largest distance between neighbouring samples of the innermost map call
+	thread_local double CoherentMapStep = 0.0;
+
+	struct CoherentMapScope
+	{
+		double EnclosingStep;
+		explicit CoherentMapScope(double Step) : EnclosingStep(CoherentMapStep) { ++CoherentMapDepth; CoherentMapStep = Step; }
+		~CoherentMapScope() { --CoherentMapDepth; CoherentMapStep = EnclosingStep; }
+	};
+
+	// Stretch is how far a basis moves in lattice cells per unit of the sample coordinates, zero when that is
+	// only known per sample. A window only pays off while neighbouring samples are at most Limit cells apart,
+	// beyond that nearly every sample exposes cells the window doesn't hold yet.
+	inline bool UsesCoherentWindow(double Stretch, double Limit)
+	{
+		return CoherentMapDepth > 0 && Stretch > 0.0 && CoherentMapStep * Stretch <= Limit;
+	}
+
+	// anl's fast_floor, which also rounds whole numbers that aren't positive down
+	inline int CellFloor(double t)
+	{
+		return t > 0 ? (int)t : (int)t - 1;
+	}
+
+	inline double CellValue(unsigned int Hash)
+	{
+		return (double)Hash / 255.0 * 2.0 - 1.0;
+	}
+
+	struct CellFeature
+	{
+		double x, y, z, d;
+	};
+
+	// the displacement hash is skipped when no coefficient uses it
+	inline CellFeature MakeCellFeature(int Dimensions, int x, int y, int z, unsigned int Seed, bool Displacement)
+	{
+		CellFeature Cell;
+		if (Dimensions == 2)
+		{
+			Cell.x = x + CellValue(hash_coords_2(x, y, Seed));
+			Cell.y = y + CellValue(hash_coords_2(x, y, Seed + 1));
+			Cell.z = 0.0;
+			Cell.d = Displacement ? CellValue(hash_coords_2(CellFloor(Cell.x), CellFloor(Cell.y), Seed + 3)) : 0.0;
+		}
+		else
+		{
+			Cell.x = x + CellValue(hash_coords_3(x, y, z, Seed));
+			Cell.y = y + CellValue(hash_coords_3(x, y, z, Seed + 1));
+			Cell.z = z + CellValue(hash_coords_3(x, y, z, Seed + 2));
+			Cell.d = Displacement ? CellValue(hash_coords_3(CellFloor(Cell.x), CellFloor(Cell.y), CellFloor(Cell.z), Seed + 3)) : 0.0;
+		}
+		return Cell;
+	}
+
+	// A window of the lattice cells around the recent samples of one basis call. The cells are stored as a ring,
+	// so moving the window only makes the cells it newly exposes. The sides are powers of two.
+	template <typename Cell>
+	struct CoherentWindow
+	{
+		int Side[3];
+		bool Valid = false;
+		unsigned int Seed = 0;
+		// the window's cells hold what a caller asking for Extra needs, like the cellular displacement
+		bool Extra = false;
+		int Origin[3] = { 0, 0, 0 };
+		std::vector<Cell> Cells;
+
+		explicit CoherentWindow(const int* WindowSide)
+			: Cells((std::size_t)WindowSide[0] * WindowSide[1] * WindowSide[2])
+		{
+			for (int a = 0; a < 3; ++a)
+				Side[a] = WindowSide[a];
+		}
+
+		std::size_t Index(int x, int y, int z) const
+		{
+			return ((std::size_t)((unsigned int)z & (Side[2] - 1)) * Side[1] + ((unsigned int)y & (Side[1] - 1))) * Side[0] + ((unsigned int)x & (Side[0] - 1));
+		}
+
+		const Cell& operator()(int x, int y, int z) const
+		{
+			return Cells[Index(x, y, z)];
+		}
+
+		// moves the window over the cells from Low to High on every axis, calling Make(x, y, z) for those it didn't hold
+		template <typename MakeCell>
+		void Cover(const int* Low, const int* High, unsigned int CellSeed, bool CellExtra, const MakeCell& Make)
+		{
+			const bool Compatible = Valid && Seed == CellSeed && (Extra || !CellExtra);
+			bool Covered = Compatible;
+			for (int a = 0; a < 3; ++a)
+				Covered = Covered && Low[a] >= Origin[a] && High[a] - Origin[a] < Side[a];
+			if (Covered)
+				return;
+
+			int Next[3];
+			bool Keep = Compatible;
+			for (int a = 0; a < 3; ++a)
+			{
+				Next[a] = Low[a] - (Side[a] - (High[a] - Low[a] + 1)) / 2;
+				Keep = Keep && Next[a] - Origin[a] < Side[a] && Origin[a] - Next[a] < Side[a];
+			}
+			auto Held = [&](int a, int c) { return Keep && c >= Origin[a] && c - Origin[a] < Side[a]; };
+			for (int z = Next[2]; z < Next[2] + Side[2]; ++z)
+				for (int y = Next[1]; y < Next[1] + Side[1]; ++y)
+				{
+					const bool Row = Held(2, z) && Held(1, y);
+					for (int x = Next[0]; x < Next[0] + Side[0]; ++x)
+						if (!Row || !Held(0, x))
+							Cells[Index(x, y, z)] = Make(x, y, z);
+				}
+			Valid = true;
+			Seed = CellSeed;
+			Extra = CellExtra;
+			for (int a = 0; a < 3; ++a)
+				Origin[a] = Next[a];
+		}
+	};
+
+	const int CellSearch = 3;
+	const int CellWindowSide[2][3] = { { 16, 16, 1 }, { 16, 16, 8 } };
+	// in lattice cells between neighbouring samples
+	const double CellStepLimit[2] = { 2.0, 1.0 };
+
+	typedef CoherentWindow<CellFeature> CellWindow;
+
+	// indexed by dimensions - 2 and the call site of the basis, so bases sharing a seed under different domains
+	// don't take each other's windows
+	struct CellWindows
+	{
+		std::vector<std::unique_ptr<CellWindow>> Sites[2];
+	};
+
+	thread_local std::unique_ptr<CellWindows> CellWindowStorage;
+
+	// the window of Site during a map call, null when the samples are too far apart for one to pay off
+	CellWindow* FindCellWindow(int Dimensions, unsigned int Site, double Stretch)
+	{
+		if (!UsesCoherentWindow(Stretch, CellStepLimit[Dimensions - 2]))
+			return nullptr;
+		if (!CellWindowStorage)
+			CellWindowStorage.reset(new CellWindows());
+		std::vector<std::unique_ptr<CellWindow>>& Windows = CellWindowStorage->Sites[Dimensions - 2];
+		if (Site >= Windows.size())
+			Windows.resize(Site + 1);
+		if (!Windows[Site])
+			Windows[Site].reset(new CellWindow(CellWindowSide[Dimensions - 2]));
+		return Windows[Site].get();
+	}
+
+	// the cells searched around (xi, yi, zi), moving Window over them when there is one
+	inline void CoverCellSearch(CellWindow* Window, int Dimensions, int xi, int yi, int zi, unsigned int Seed, bool Displacement)
+	{
+		if (!Window)
+			return;
+		const int Low[3] = { xi - CellSearch, yi - CellSearch, Dimensions == 3 ? zi - CellSearch : 0 };
+		const int High[3] = { xi + CellSearch, yi + CellSearch, Dimensions == 3 ? zi + CellSearch : 0 };
+		Window->Cover(Low, High, Seed, Displacement, [&](int x, int y, int z) { return MakeCellFeature(Dimensions, x, y, z, Seed, Displacement); });
+	}
+
+	// the insertion of anl's cellular functions, which keeps the earlier of equal distances. Keeping only the
+	// Nearest smallest distances gives the same Nearest first entries as keeping four.
+	template <int Nearest, bool Displacement>
+	inline void AddCellDistance(double* f, double* d, double Distance, double CellDisplacement)
+	{
+		if (Distance < f[Nearest - 1])
+		{
+			int Index = Nearest - 1;
+			while (Index > 0 && Distance < f[Index - 1])
+				--Index;
+			for (int i = Nearest - 1; i-- > Index;)
+			{
+				f[i + 1] = f[i];
+				if (Displacement)
+					d[i + 1] = d[i];
+			}
+			f[Index] = Distance;
+			if (Displacement)
+				d[Index] = CellDisplacement;
+		}
+	}
+
+	// fills the first Nearest entries of f, and of d with Displacement. The cells come from Window, or are
+	// generated for this sample without one.
+	template <int Nearest, bool Displacement>
+	void CoherentCellular2D(double x, double y, unsigned int dist, unsigned int seed, CellWindow* Window, double* f, double* d)
+	{
+		auto Distance = anl::distEuclid2;
+		switch (dist)
+		{
+		case 1: Distance = anl::distManhattan2; break;
+		case 2: Distance = anl::distGreatestAxis2; break;
+		case 3: Distance = anl::distLeastAxis2; break;
+		}
+		const int xi = CellFloor(x), yi = CellFloor(y);
+		CoverCellSearch(Window, 2, xi, yi, 0, seed, Displacement);
+		for (int c = 0; c < Nearest; ++c)
+		{
+			f[c] = 99999.0;
+			d[c] = 0.0;
+		}
+		for (int yc = yi - CellSearch; yc <= yi + CellSearch; ++yc)
+			for (int xc = xi - CellSearch; xc <= xi + CellSearch; ++xc)
+			{
+				const CellFeature Cell = Window ? (*Window)(xc, yc, 0) : MakeCellFeature(2, xc, yc, 0, seed, Displacement);
+				AddCellDistance<Nearest, Displacement>(f, d, Distance(x, y, Cell.x, Cell.y), Cell.d);
+			}
+	}
+
+	template <int Nearest, bool Displacement>
+	void CoherentCellular3D(double x, double y, double z, unsigned int dist, unsigned int seed, CellWindow* Window, double* f, double* d)
+	{
+		auto Distance = anl::distEuclid3;
+		switch (dist)
+		{
+		case 1: Distance = anl::distManhattan3; break;
+		case 2: Distance = anl::distGreatestAxis3; break;
+		case 3: Distance = anl::distLeastAxis3; break;
+		}
+		const int xi = CellFloor(x), yi = CellFloor(y), zi = CellFloor(z);
+		CoverCellSearch(Window, 3, xi, yi, zi, seed, Displacement);
+		for (int c = 0; c < Nearest; ++c)
+		{
+			f[c] = 99999.0;
+			d[c] = 0.0;
+		}
+		for (int zc = zi - CellSearch; zc <= zi + CellSearch; ++zc)
+			for (int yc = yi - CellSearch; yc <= yi + CellSearch; ++yc)
+				for (int xc = xi - CellSearch; xc <= xi + CellSearch; ++xc)
+				{
+					const CellFeature Cell = Window ? (*Window)(xc, yc, zc) : MakeCellFeature(3, xc, yc, zc, seed, Displacement);
+					AddCellDistance<Nearest, Displacement>(f, d, Distance(x, y, z, Cell.x, Cell.y, Cell.z), Cell.d);
+				}
+	}
+
+	// Compares the search with and without a window over whole, negative and fractional coordinates with every
+	// distance. The windows are local, so the check doesn't depend on or disturb the map call it may run in.
+	bool CoherentCellularMatchesLibrary()
+	{
+		const double Coordinates[] = { -7.0, -2.0, -1.5, -0.25, 0.0, 0.3, 1.0, 2.75, 5.5, 19.125 };
+		CellWindow Window2(CellWindowSide[0]), Window3(CellWindowSide[1]);
+		for (unsigned int dist = 0; dist < 4; ++dist)
+			for (double a : Coordinates)
+				for (double b : Coordinates)
+				{
+					const unsigned int Seed = 1234 + dist;
+					const double c = Coordinates[(dist * 3 + 1) % 10];
+					double f[4], d[4], wf[4], wd[4], ef[4], ed[4];
+					CoherentCellular2D<4, true>(a, b, dist, Seed, nullptr, f, d);
+					CoherentCellular2D<4, true>(a, b, dist, Seed, &Window2, wf, wd);
+					switch (dist)
+					{
+					case 0: anl::cellular_function2D(a, b, Seed, ef, ed, anl::distEuclid2); break;
+					case 1: anl::cellular_function2D(a, b, Seed, ef, ed, anl::distManhattan2); break;
+					case 2: anl::cellular_function2D(a, b, Seed, ef, ed, anl::distGreatestAxis2); break;
+					default: anl::cellular_function2D(a, b, Seed, ef, ed, anl::distLeastAxis2); break;
+					}
+					if (!std::equal(f, f + 4, ef) || !std::equal(d, d + 4, ed) || !std::equal(wf, wf + 4, ef) || !std::equal(wd, wd + 4, ed))
+						return false;
+					CoherentCellular3D<4, true>(a, b, c, dist, Seed, nullptr, f, d);
+					CoherentCellular3D<4, true>(a, b, c, dist, Seed, &Window3, wf, wd);
+					switch (dist)
+					{
+					case 0: anl::cellular_function3D(a, b, c, Seed, ef, ed, anl::distEuclid3); break;
+					case 1: anl::cellular_function3D(a, b, c, Seed, ef, ed, anl::distManhattan3); break;
+					case 2: anl::cellular_function3D(a, b, c, Seed, ef, ed, anl::distGreatestAxis3); break;
+					default: anl::cellular_function3D(a, b, c, Seed, ef, ed, anl::distLeastAxis3); break;
+					}
+					if (!std::equal(f, f + 4, ef) || !std::equal(d, d + 4, ed) || !std::equal(wf, wf + 4, ef) || !std::equal(wd, wd + 4, ed))
+						return false;
+				}
+		return true;
+	}
+
+	bool CellularSearchMatches()
+	{
+		static const bool Matches = CoherentCellularMatchesLibrary();
+		return Matches;
+	}
+
+	template <int Nearest, bool Displacement>
+	void CoherentCellular(const Point& p, unsigned int dist, unsigned int seed, CellWindow* Window, double* f, double* d)
+	{
+		if (p.dimensions == 2)
+			CoherentCellular2D<Nearest, Displacement>(p.x, p.y, dist, seed, Window, f, d);
+		else
+			CoherentCellular3D<Nearest, Displacement>(p.x, p.y, p.z, dist, seed, Window, f, d);
+	}
+
+	// fills f and d and returns true when the window of Site applies to p
+	bool CoherentCellular(const Point& p, unsigned int dist, unsigned int seed, unsigned int Site, double Stretch, double* f, double* d)
+	{
+		if ((p.dimensions != 2 && p.dimensions != 3) || !CellularSearchMatches())
+			return false;
+		CellWindow* Window = FindCellWindow(p.dimensions, Site, Stretch);
+		if (!Window)
+			return false;
+		CoherentCellular<4, true>(p, dist, seed, Window, f, d);
+		return true;
+	}
+}
+
+double CellularBasis(Point p, unsigned int dist,
+	double f1, double f2, double f3, double f4,
+	double d1, double d2, double d3, double d4,
+	unsigned int seed, unsigned int Site, double Stretch);
+
+// CellularBasis whose coefficients after the first Nearest distances and, without Displacement, all displacement
+// coefficients are known to be zero, so the search keeps fewer distances and skips the displacement hash
+double CellularBasisNearest(Point p, int Nearest, bool Displacement, unsigned int dist,
+	double f1, double f2, double f3, double f4,
+	double d1, double d2, double d3, double d4,
+	unsigned int seed, unsigned int Site, double Stretch)
+{
+	if ((p.dimensions != 2 && p.dimensions != 3) || !CellularSearchMatches())
+		return CellularBasis(p, dist, f1, f2, f3, f4, d1, d2, d3, d4, seed, Site, Stretch);
+	CellWindow* Window = FindCellWindow(p.dimensions, Site, Stretch);
+	double f[4] = { 0.0, 0.0, 0.0, 0.0 }, d[4] = { 0.0, 0.0, 0.0, 0.0 };
+	switch (Nearest * 2 + (Displacement ? 1 : 0))
+	{
+	case 2: CoherentCellular<1, false>(p, dist, seed, Window, f, d); break;
+	case 3: CoherentCellular<1, true>(p, dist, seed, Window, f, d); break;
+	case 4: CoherentCellular<2, false>(p, dist, seed, Window, f, d); break;
+	case 5: CoherentCellular<2, true>(p, dist, seed, Window, f, d); break;
+	case 6: CoherentCellular<3, false>(p, dist, seed, Window, f, d); break;
+	case 7: CoherentCellular<3, true>(p, dist, seed, Window, f, d); break;
+	case 8: CoherentCellular<4, false>(p, dist, seed, Window, f, d); break;
+	default: CoherentCellular<4, true>(p, dist, seed, Window, f, d); break;
+	}
+	return f1*f[0] + f2*f[1] + f3*f[2] + f4*f[3] + d1*d[0] + d2*d[1] + d3*d[2] + d4*d[3];
+}
+)abc";
+
+static const std::string CoherentLatticeOutput = R"abc(
+namespace {
+	// During map calls gradient and value noise take their corners from a window of lattice corners kept for their
+	// call site, instead of hashing the 4 (8) corners of every sample. The gradient and value of a hash are read back from
+	// anl once, at corners where the other offsets are exactly zero, and the result is checked against the library.
+	struct LatticeTables
+	{
+		double Gradient2[256][2];
+		double Gradient3[256][3];
+		double Value2[256];
+		double Value3[256];
+	};
+
+	inline double LatticeLerp(double s, double v1, double v2)
+	{
+		return v1 + s * (v2 - v1);
+	}
+
+	inline double LatticeInterpolate(int Interpolation, double t)
+	{
+		switch (Interpolation)
+		{
+		case 0: return anl::noInterp(t);
+		case 1: return anl::linearInterp(t);
+		case 2: return anl::hermiteInterp(t);
+		default: return anl::quinticInterp(t);
+		}
+	}
+
+	struct LatticeCorner
+	{
+		double g[3];
+	};
+
+	const int LatticeWindowSide[2][3] = { { 32, 32, 1 }, { 16, 16, 4 } };
+	// in lattice cells between neighbouring samples, the library hashes only 4 (8) corners per sample
+	const double LatticeStepLimit = 1.0;
+
+	typedef CoherentWindow<LatticeCorner> LatticeWindow;
+
+	// indexed by dimensions - 2, gradient and the call site of the basis
+	struct LatticeWindows
+	{
+		std::vector<std::unique_ptr<LatticeWindow>> Sites[2][2];
+	};
+
+	thread_local std::unique_ptr<LatticeWindows> LatticeWindowStorage;
+
+	// the window of Site during a map call, null when the samples are too far apart for one to pay off
+	LatticeWindow* FindLatticeWindow(int Dimensions, bool Gradient, unsigned int Site, double Stretch)
+	{
+		if (!UsesCoherentWindow(Stretch, LatticeStepLimit))
+			return nullptr;
+		if (!LatticeWindowStorage)
+			LatticeWindowStorage.reset(new LatticeWindows());
+		std::vector<std::unique_ptr<LatticeWindow>>& Windows = LatticeWindowStorage->Sites[Dimensions - 2][Gradient];
+		if (Site >= Windows.size())
+			Windows.resize(Site + 1);
+		if (!Windows[Site])
+			Windows[Site].reset(new LatticeWindow(LatticeWindowSide[Dimensions - 2]));
+		return Windows[Site].get();
+	}
+
+	// moves Window over the corners of the cell at (x0, y0, z0)
+	template <bool Gradient>
+	void CoverLatticeCell(const LatticeTables& Tables, LatticeWindow& Window, int Dimensions, unsigned int Seed, int x0, int y0, int z0)
+	{
+		const int Low[3] = { x0, y0, Dimensions == 3 ? z0 : 0 };
+		const int High[3] = { x0 + 1, y0 + 1, Dimensions == 3 ? z0 + 1 : 0 };
+		Window.Cover(Low, High, Seed, false, [&](int cx, int cy, int cz)
+		{
+			const unsigned int Hash = (Dimensions == 2 ? hash_coords_2(cx, cy, Seed) : hash_coords_3(cx, cy, cz, Seed)) & 255;
+			if (Gradient && Dimensions == 2)
+				return LatticeCorner{ { Tables.Gradient2[Hash][0], Tables.Gradient2[Hash][1], 0.0 } };
+			else if (Gradient)
+				return LatticeCorner{ { Tables.Gradient3[Hash][0], Tables.Gradient3[Hash][1], Tables.Gradient3[Hash][2] } };
+			return LatticeCorner{ { Dimensions == 2 ? Tables.Value2[Hash] : Tables.Value3[Hash], 0.0, 0.0 } };
+		});
+	}
+
+	// the interpolation of anl's gradient and value noise, with the corners read from a window
+	template <bool Gradient>
+	double CoherentLattice2D(const LatticeTables& Tables, LatticeWindow& Window, double x, double y, int Interpolation, unsigned int seed)
+	{
+		const int x0 = CellFloor(x), y0 = CellFloor(y);
+		CoverLatticeCell<Gradient>(Tables, Window, 2, seed, x0, y0, 0);
+		const double xs = LatticeInterpolate(Interpolation, x - (double)x0);
+		const double ys = LatticeInterpolate(Interpolation, y - (double)y0);
+		auto Corner = [&](int ix, int iy)
+		{
+			const LatticeCorner& c = Window(ix, iy, 0);
+			return Gradient ? (x - (double)ix) * c.g[0] + (y - (double)iy) * c.g[1] : c.g[0];
+		};
+		const double v1 = LatticeLerp(xs, Corner(x0, y0), Corner(x0 + 1, y0));
+		const double v2 = LatticeLerp(xs, Corner(x0, y0 + 1), Corner(x0 + 1, y0 + 1));
+		return LatticeLerp(ys, v1, v2);
+	}
+
+	template <bool Gradient>
+	double CoherentLattice3D(const LatticeTables& Tables, LatticeWindow& Window, double x, double y, double z, int Interpolation, unsigned int seed)
+	{
+		const int x0 = CellFloor(x), y0 = CellFloor(y), z0 = CellFloor(z);
+		CoverLatticeCell<Gradient>(Tables, Window, 3, seed, x0, y0, z0);
+		const double xs = LatticeInterpolate(Interpolation, x - (double)x0);
+		const double ys = LatticeInterpolate(Interpolation, y - (double)y0);
+		const double zs = LatticeInterpolate(Interpolation, z - (double)z0);
+		auto Corner = [&](int ix, int iy, int iz)
+		{
+			const LatticeCorner& c = Window(ix, iy, iz);
+			return Gradient ? (x - (double)ix) * c.g[0] + (y - (double)iy) * c.g[1] + (z - (double)iz) * c.g[2] : c.g[0];
+		};
+		auto Plane = [&](int iz)
+		{
+			const double v1 = LatticeLerp(xs, Corner(x0, y0, iz), Corner(x0 + 1, y0, iz));
+			const double v2 = LatticeLerp(xs, Corner(x0, y0 + 1, iz), Corner(x0 + 1, y0 + 1, iz));
+			return LatticeLerp(ys, v1, v2);
+		};
+		const double v1 = Plane(z0);
+		const double v2 = Plane(z0 + 1);
+		return LatticeLerp(zs, v1, v2);
+	}
+
+	double LibraryLattice(bool Gradient, int Dimensions, double x, double y, double z, int Interpolation, unsigned int seed)
+	{
+		auto Interp = anl::quinticInterp;
+		switch (Interpolation)
+		{
+		case 0: Interp = anl::noInterp; break;
+		case 1: Interp = anl::linearInterp; break;
+		case 2: Interp = anl::hermiteInterp; break;
+		}
+		if (Dimensions == 2)
+			return Gradient ? anl::gradient_noise2D(x, y, seed, Interp) : anl::value_noise2D(x, y, seed, Interp);
+		return Gradient ? anl::gradient_noise3D(x, y, z, seed, Interp) : anl::value_noise3D(x, y, z, seed, Interp);
+	}
+
+	// reads every hash back from corners with positive coordinates, so the probe's other offsets are exactly zero
+	bool BuildLatticeTables(LatticeTables& Tables)
+	{
+		bool Found[2][256] = {};
+		int Remaining[2] = { 256, 256 };
+		for (int y = 1; y <= 64 && Remaining[0]; ++y)
+			for (int x = 1; x <= 64; ++x)
+			{
+				const unsigned int Hash = hash_coords_2(x, y, 0);
+				if (Hash > 255 || Found[0][Hash])
+					continue;
+				Found[0][Hash] = true;
+				--Remaining[0];
+				Tables.Gradient2[Hash][0] = 2.0 * anl::gradient_noise2D(x + 0.5, y, 0, anl::noInterp);
+				Tables.Gradient2[Hash][1] = 2.0 * anl::gradient_noise2D(x, y + 0.5, 0, anl::noInterp);
+				Tables.Value2[Hash] = anl::value_noise2D(x + 0.5, y + 0.5, 0, anl::noInterp);
+			}
+		for (int z = 1; z <= 16 && Remaining[1]; ++z)
+			for (int y = 1; y <= 16; ++y)
+				for (int x = 1; x <= 16; ++x)
+				{
+					const unsigned int Hash = hash_coords_3(x, y, z, 0);
+					if (Hash > 255 || Found[1][Hash])
+						continue;
+					Found[1][Hash] = true;
+					--Remaining[1];
+					Tables.Gradient3[Hash][0] = 2.0 * anl::gradient_noise3D(x + 0.5, y, z, 0, anl::noInterp);
+					Tables.Gradient3[Hash][1] = 2.0 * anl::gradient_noise3D(x, y + 0.5, z, 0, anl::noInterp);
+					Tables.Gradient3[Hash][2] = 2.0 * anl::gradient_noise3D(x, y, z + 0.5, 0, anl::noInterp);
+					Tables.Value3[Hash] = anl::value_noise3D(x + 0.5, y + 0.5, z + 0.5, 0, anl::noInterp);
+				}
+		if (Remaining[0] || Remaining[1])
+			return false;
+
+		// local windows, so the check doesn't disturb the map call it may run in
+		const double Coordinates[] = { -7.0, -2.0, -1.5, -0.25, 0.0, 0.3, 1.0, 2.75, 5.5, 19.125 };
+		LatticeWindow Gradient2(LatticeWindowSide[0]), Value2(LatticeWindowSide[0]), Gradient3(LatticeWindowSide[1]), Value3(LatticeWindowSide[1]);
+		for (int Interpolation = 0; Interpolation < 4; ++Interpolation)
+			for (double a : Coordinates)
+				for (double b : Coordinates)
+				{
+					const unsigned int Seed = 77 + Interpolation;
+					const double c = Coordinates[(Interpolation * 3 + 1) % 10];
+					if (CoherentLattice2D<true>(Tables, Gradient2, a, b, Interpolation, Seed) != LibraryLattice(true, 2, a, b, c, Interpolation, Seed) ||
+						CoherentLattice2D<false>(Tables, Value2, a, b, Interpolation, Seed) != LibraryLattice(false, 2, a, b, c, Interpolation, Seed) ||
+						CoherentLattice3D<true>(Tables, Gradient3, a, b, c, Interpolation, Seed) != LibraryLattice(true, 3, a, b, c, Interpolation, Seed) ||
+						CoherentLattice3D<false>(Tables, Value3, a, b, c, Interpolation, Seed) != LibraryLattice(false, 3, a, b, c, Interpolation, Seed))
+						return false;
+				}
+		return true;
+	}
+
+	// null when the library doesn't match
+	const LatticeTables* GetLatticeTables()
+	{
+		static const std::unique_ptr<LatticeTables> Tables = []()
+		{
+			std::unique_ptr<LatticeTables> Built(new LatticeTables());
+			if (!BuildLatticeTables(*Built))
+				Built.reset();
+			return Built;
+		}();
+		return Tables.get();
+	}
+
+	// sets Result and returns true when the window of Site applies to p
+	template <bool Gradient>
+	bool CoherentLattice(const Point& p, int Interpolation, unsigned int seed, unsigned int Site, double Stretch, double& Result)
+	{
+		if (p.dimensions != 2 && p.dimensions != 3)
+			return false;
+		LatticeWindow* Window = FindLatticeWindow(p.dimensions, Gradient, Site, Stretch);
+		if (!Window)
+			return false;
+		const LatticeTables* Tables = GetLatticeTables();
+		if (!Tables)
+			return false;
+		Result = p.dimensions == 2 ? CoherentLattice2D<Gradient>(*Tables, *Window, p.x, p.y, Interpolation, seed) : CoherentLattice3D<Gradient>(*Tables, *Window, p.x, p.y, p.z, Interpolation, seed);
+		return true;
+	}
+}
+)abc";
+
+// declarations of the runtime functions defined in the main source, used by the split source files
+static const std::string RuntimeDeclarationsOutput = R"abc(
+double SmoothTiers(double Value, int NumberOfSteps);
+double CellularBasis(Point p, unsigned int dist,
+	double f1, double f2, double f3, double f4,
+	double d1, double d2, double d3, double d4,
+	unsigned int seed, unsigned int Site, double Stretch);
+double CellularBasisNearest(Point p, int Nearest, bool Displacement, unsigned int dist,
+	double f1, double f2, double f3, double f4,
+	double d1, double d2, double d3, double d4,
+	unsigned int seed, unsigned int Site, double Stretch);
+double SimplexBasis(Point p, unsigned int seed);
+double GradientBasis(Point p, int Interpolation, unsigned int seed, unsigned int Site, double Stretch);
+double ValueBasis(Point p, int Interpolation, unsigned int seed, unsigned int Site, double Stretch);
+double FastExp(double x);
+double FastSin(double x);
+double FastCos(double x);
+double FastTan(double x);
+double FastAtan(double x);
+double FastAsin(double x);
+double FastAcos(double x);
+Point RotateDomain(Point EvalPoint, double angle, double ax, double ay, double az);
+double Select_Blend(double low, double high, double control, double threshold, double falloff);
+)abc";
+
+static const std::string InternalHeaderOutput = R"abc(
+#pragma once
+<THIS_IS_WHERE_THE_RUNTIME_TYPES_GO>
+<THIS_IS_WHERE_THE_RUNTIME_DECLARATIONS_GO>
+<THIS_IS_WHERE_ADDITIONAL_FUNCTIONS_GO>
+)abc";
+
+static const std::string PartOutput = R"abc(
+#include "<INTERNAL_HEADER_FILE_NAME>"
+
+<THIS_IS_WHERE_ADDITIONAL_FUNCTIONS_GO>
+)abc";
+
+static const std::string HeaderOutput = R"abc(
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+<THIS_IS_WHERE_THE_SETTINGS_GO>
+
+struct ANL_CPP_NamedInput
+{
+<THIS_IS_WHERE_THE_NAMED_INPUT_GOES>
+};
+
+struct alignas(16) ANL_CPP_RGBA
+{
+	float r, g, b, a;
+};
+
+// Statistics of mapped samples. The histogram splits [HistogramLow, HistogramHigh) into Histogram.size()
+// even bins, samples outside the range count toward the end bins and an empty histogram isn't kept.
+struct ANL_CPP_Reduction
+{
+	double Min = std::numeric_limits<double>::infinity();
+	double Max = -std::numeric_limits<double>::infinity();
+	double Sum = 0.0;
+	double SumOfSquares = 0.0;
+	std::uint64_t Count = 0;
+	double HistogramLow = 0.0, HistogramHigh = 1.0;
+	std::vector<std::uint64_t> Histogram;
+
+	ANL_CPP_Reduction() = default;
+	ANL_CPP_Reduction(std::size_t HistogramBins, double Low, double High)
+		: HistogramLow(Low), HistogramHigh(High), Histogram(HistogramBins, 0) {}
+
+	void Add(const double* Samples, std::size_t SampleCount);
+	// Other must have the same histogram bins
+	void Merge(const ANL_CPP_Reduction& Other);
+	// drops the statistics, keeping the histogram bins
+	void Clear();
+};
+
+// Footprint is the distance between neighbouring samples. Octaves of gradient, value and simplex noise
+// finer than it fade out instead of aliasing, 0.0 evaluates every octave in full.
+double ANL_CPP_EvalScalar(double x, double y, const ANL_CPP_NamedInput& NamedInput, double Footprint = 0.0);
+double ANL_CPP_EvalScalar(double x, double y, double z, const ANL_CPP_NamedInput& NamedInput, double Footprint = 0.0);
+
+// Sample (i, j, k) is taken at (StartX + StepX * i, StartY + StepY * j, StartZ + StepZ * k)
+// and written to Output[(k * Height + j) * Width + i]. Each row is added to Reduction, when given,
+// right after it is written.
+void ANL_CPP_Map2D(double* Output, int Width, int Height, double StartX, double StartY, double StepX, double StepY, const ANL_CPP_NamedInput& NamedInput, double Footprint = 0.0, ANL_CPP_Reduction* Reduction = nullptr);
+void ANL_CPP_Map3D(double* Output, int Width, int Height, int Depth, double StartX, double StartY, double StartZ, double StepX, double StepY, double StepZ, const ANL_CPP_NamedInput& NamedInput, double Footprint = 0.0, ANL_CPP_Reduction* Reduction = nullptr);
+<THIS_IS_WHERE_THE_RGBA_FUNCTIONS_GO>
+<THIS_IS_WHERE_THE_EXTENSIONS_GO>
+)abc";
+
+static const std::string RGBAHeaderOutput = R"abc(
+ANL_CPP_RGBA ANL_CPP_EvalRGBA(double x, double y, const ANL_CPP_NamedInput& NamedInput, double Footprint = 0.0);
+ANL_CPP_RGBA ANL_CPP_EvalRGBA(double x, double y, double z, const ANL_CPP_NamedInput& NamedInput, double Footprint = 0.0);
+
+// same layout as ANL_CPP_Map2D
+void ANL_CPP_MapRGBA2D(ANL_CPP_RGBA* Output, int Width, int Height, double StartX, double StartY, double StepX, double StepY, const ANL_CPP_NamedInput& NamedInput, double Footprint = 0.0);
+)abc";
+
+// ANL_CPP_Reduction, fed a row at a time by the map functions
+static const std::string ReductionOutput = R"abc(
+void ANL_CPP_Reduction::Add(const double* Samples, std::size_t SampleCount)
+{
+	// separate accumulators so the loop isn't one long dependency chain
+	double Low[2] = { Min, Min }, High[2] = { Max, Max };
+	double Total[2] = { 0.0, 0.0 }, Squares[2] = { 0.0, 0.0 };
+	std::size_t n = 0;
+	for (; n + 1 < SampleCount; n += 2)
+	{
+		for (int Lane = 0; Lane < 2; ++Lane)
+		{
+			const double Value = Samples[n + Lane];
+			Low[Lane] = Value < Low[Lane] ? Value : Low[Lane];
+			High[Lane] = Value > High[Lane] ? Value : High[Lane];
+			Total[Lane] += Value;
+			Squares[Lane] += Value * Value;
+		}
+	}
+	for (; n < SampleCount; ++n)
+	{
+		const double Value = Samples[n];
+		Low[0] = Value < Low[0] ? Value : Low[0];
+		High[0] = Value > High[0] ? Value : High[0];
+		Total[0] += Value;
+		Squares[0] += Value * Value;
+	}
+	Min = Low[1] < Low[0] ? Low[1] : Low[0];
+	Max = High[1] > High[0] ? High[1] : High[0];
+	Sum += Total[0] + Total[1];
+	SumOfSquares += Squares[0] + Squares[1];
+	Count += SampleCount;
+
+	if (Histogram.empty())
+		return;
+	const double Last = (double)(Histogram.size() - 1);
+	const double Scale = (double)Histogram.size() / (HistogramHigh - HistogramLow);
+	for (n = 0; n < SampleCount; ++n)
+	{
+		// written so NaN lands in the first bin
+		double Bin = (Samples[n] - HistogramLow) * Scale;
+		Bin = Bin > 0.0 ? Bin : 0.0;
+		Bin = Bin < Last ? Bin : Last;
+		Histogram[(std::size_t)Bin]++;
+	}
+}
+
+void ANL_CPP_Reduction::Merge(const ANL_CPP_Reduction& Other)
+{
+	Min = Other.Min < Min ? Other.Min : Min;
+	Max = Other.Max > Max ? Other.Max : Max;
+	Sum += Other.Sum;
+	SumOfSquares += Other.SumOfSquares;
+	Count += Other.Count;
+	for (std::size_t n = 0; n < Histogram.size() && n < Other.Histogram.size(); ++n)
+		Histogram[n] += Other.Histogram[n];
+}
+
+void ANL_CPP_Reduction::Clear()
+{
+	Min = std::numeric_limits<double>::infinity();
+	Max = -std::numeric_limits<double>::infinity();
+	Sum = SumOfSquares = 0.0;
+	Count = 0;
+	std::fill(Histogram.begin(), Histogram.end(), 0);
+}
+)abc";
+
+// fused entry points of the outputs transpiled alongside the root
+static const std::string OutputsOutput = R"abc(
+ANL_CPP_Outputs ANL_CPP_EvaluateOutputs(const Point EvalPoint, const ANL_CPP_NamedInput& NamedInput, double Footprint)
+{
+<THIS_IS_WHERE_THE_CODE_GOES>
+	return FinalResult;
+}
+
+ANL_CPP_Outputs ANL_CPP_EvalOutputs(double x, double y, const ANL_CPP_NamedInput& NamedInput, double Footprint)
+{
+	Point p;
+	p.x = p.y = p.z = p.w = p.u = p.v = 0.0;
+	p.dimensions = 2;
+	p.x = x;
+	p.y = y;
+	return ANL_CPP_EvaluateOutputs(p, NamedInput, Footprint);
+}
+
+ANL_CPP_Outputs ANL_CPP_EvalOutputs(double x, double y, double z, const ANL_CPP_NamedInput& NamedInput, double Footprint)
+{
+	Point p;
+	p.x = p.y = p.z = p.w = p.u = p.v = 0.0;
+	p.dimensions = 3;
+	p.x = x;
+	p.y = y;
+	p.z = z;
+	return ANL_CPP_EvaluateOutputs(p, NamedInput, Footprint);
+}
+
+void ANL_CPP_MapOutputs2D(ANL_CPP_Outputs* Output, int Width, int Height, double StartX, double StartY, double StepX, double StepY, const ANL_CPP_NamedInput& NamedInput, double Footprint)
+{
+	const CoherentMapScope CoherentScope(std::max(std::abs(StepX), std::abs(StepY)));
+<THIS_IS_WHERE_THE_MAP2D_CODE_GOES>
+}
+
+void ANL_CPP_MapOutputs3D(ANL_CPP_Outputs* Output, int Width, int Height, int Depth, double StartX, double StartY, double StartZ, double StepX, double StepY, double StepZ, const ANL_CPP_NamedInput& NamedInput, double Footprint)
+{
+	const CoherentMapScope CoherentScope(std::max(std::max(std::abs(StepX), std::abs(StepY)), std::abs(StepZ)));
+<THIS_IS_WHERE_THE_MAP3D_CODE_GOES>
+}
+)abc";
+
+static const std::string OutputsHeaderOutput = R"abc(
+// every output at one point, the nodes they have in common are evaluated once
+struct ANL_CPP_Outputs
+{
+<THIS_IS_WHERE_THE_OUTPUTS_GO>};
+
+ANL_CPP_Outputs ANL_CPP_EvalOutputs(double x, double y, const ANL_CPP_NamedInput& NamedInput, double Footprint = 0.0);
+ANL_CPP_Outputs ANL_CPP_EvalOutputs(double x, double y, double z, const ANL_CPP_NamedInput& NamedInput, double Footprint = 0.0);
+
+// same layout as ANL_CPP_Map2D and ANL_CPP_Map3D
+void ANL_CPP_MapOutputs2D(ANL_CPP_Outputs* Output, int Width, int Height, double StartX, double StartY, double StepX, double StepY, const ANL_CPP_NamedInput& NamedInput, double Footprint = 0.0);
+void ANL_CPP_MapOutputs3D(ANL_CPP_Outputs* Output, int Width, int Height, int Depth, double StartX, double StartY, double StartZ, double StepX, double StepY, double StepZ, const ANL_CPP_NamedInput& NamedInput, double Footprint = 0.0);
+)abc";
+
+// optional parts of the output, selected by TranspileOptions
+static const std::string ChunkServiceHeaderOutput = R"abc(
+#include <cstdint>
+#include <functional>
+#include <future>
+#include <memory>
+#include <stdexcept>
+#include <vector>
+
+// a region sampled the same way as ANL_CPP_Map2D, or ANL_CPP_Map3D when Depth > 0
+struct ANL_CPP_ChunkRequest
+{
+	int Width = 0, Height = 0, Depth = 0;
+	double StartX = 0.0, StartY = 0.0, StartZ = 0.0;
+	double StepX = 1.0, StepY = 1.0, StepZ = 1.0;
+	ANL_CPP_NamedInput NamedInput;
+	// rows (slices when Depth > 0) evaluated between cancellation checks and partial results, 0 evaluates
+	// the chunk in one call
+	int RowsPerBand = 0;
+	// distance between neighbouring samples, as taken by ANL_CPP_Map2D
+	double Footprint = 0.0;
+	// the samples of a completed chunk are merged into Reduction, which must outlive the chunk. The
+	// service merges under a lock, so chunks running on different workers may share one.
+	ANL_CPP_Reduction* Reduction = nullptr;
+};
+
+// the future of a chunk cancelled before it completed holds this exception
+class ANL_CPP_ChunkCancelled : public std::runtime_error
+{
+public:
+	ANL_CPP_ChunkCancelled() : std::runtime_error("ANL_CPP_ChunkService: chunk cancelled") {}
+};
+
+// Evaluates chunks on a pool of worker threads, highest priority first. Each worker owns a queue and
+// idle workers steal from the others, always taking the highest priority chunk they can see.
+class ANL_CPP_ChunkService
+{
+public:
+	typedef std::uint64_t Ticket;
+	// called on a worker thread once the chunk is complete, Samples may be moved from
+	typedef std::function<void(Ticket Id, std::vector<double>& Samples)> CompletionCallback;
+	// called on a worker thread after each band, Samples points at the first sample of FirstRow
+	typedef std::function<void(Ticket Id, const double* Samples, int FirstRow, int RowCount)> PartialCallback;
+
+	// 0 threads uses std::thread::hardware_concurrency()
+	explicit ANL_CPP_ChunkService(unsigned int ThreadCount = 0);
+	// chunks that haven't completed are cancelled
+	~ANL_CPP_ChunkService();
+
+	ANL_CPP_ChunkService(const ANL_CPP_ChunkService&) = delete;
+	ANL_CPP_ChunkService& operator=(const ANL_CPP_ChunkService&) = delete;
+
+	Ticket Submit(const ANL_CPP_ChunkRequest& Request, double Priority, CompletionCallback OnComplete, PartialCallback OnPartial = PartialCallback());
+	std::future<std::vector<double>> Submit(const ANL_CPP_ChunkRequest& Request, double Priority, Ticket* Id = nullptr, PartialCallback OnPartial = PartialCallback());
+
+	// a running chunk stops at the end of its current band, returns false if the chunk already completed
+	bool Cancel(Ticket Id);
+	// returns false unless the chunk is still waiting to run
+	bool Reprioritize(Ticket Id, double Priority);
+
+private:
+	struct Impl;
+	std::unique_ptr<Impl> Pool;
+};
+)abc";
+
+static const std::string ChunkServiceOutput = R"abc(
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <unordered_map>
+
+struct ANL_CPP_ChunkService::Impl
+{
+	enum JobState { Pending, Running, Cancelled, Done };
+
+	struct Job
+	{
+		Ticket Id;
+		ANL_CPP_ChunkRequest Request;
+		std::atomic<int> State;
+		// bumped by Reprioritize, queue entries with an older version are skipped
+		std::atomic<std::uint64_t> Version;
+		unsigned int Home;
+		CompletionCallback OnComplete;
+		PartialCallback OnPartial;
+		std::promise<std::vector<double>> Promise;
+		bool UsesPromise;
+	};
+
+	struct Entry
+	{
+		double Priority;
+		std::uint64_t Sequence;
+		std::uint64_t Version;
+		std::shared_ptr<Job> Work;
+
+		// the highest priority first, equal priorities in submission order
+		bool operator<(const Entry& Other) const
+		{
+			if (Priority != Other.Priority)
+				return Priority < Other.Priority;
+			return Sequence > Other.Sequence;
+		}
+	};
+
+	struct Worker
+	{
+		std::mutex Lock;
+		std::priority_queue<Entry> Queue;
+	};
+
+	std::vector<std::unique_ptr<Worker>> Workers;
+	std::vector<std::thread> Threads;
+	// chunks that haven't completed, for Cancel and Reprioritize
+	std::mutex JobsLock;
+	std::unordered_map<Ticket, std::shared_ptr<Job>> Jobs;
+	// queue entries across all workers, including stale ones
+	std::mutex WakeLock;
+	std::condition_variable Wake;
+	std::size_t Entries = 0;
+	bool Stopping = false;
+	// guards the reductions of every request
+	std::mutex ReductionLock;
+	std::atomic<Ticket> NextTicket;
+	std::atomic<std::uint64_t> NextSequence;
+	std::atomic<unsigned int> NextHome;
+
+	Impl(unsigned int ThreadCount)
+		: NextTicket(1), NextSequence(0), NextHome(0)
+	{
+		if (ThreadCount == 0)
+			ThreadCount = std::max(1u, std::thread::hardware_concurrency());
+		for (unsigned int w = 0; w < ThreadCount; ++w)
+			Workers.emplace_back(new Worker());
+		for (unsigned int w = 0; w < ThreadCount; ++w)
+			Threads.emplace_back([this, w]() { Run(w); });
+	}
+
+	void Push(const std::shared_ptr<Job>& Work, double Priority)
+	{
+		Worker& Home = *Workers[Work->Home];
+		// counted first so a worker popping the entry never sees Entries underflow
+		{
+			std::lock_guard<std::mutex> Guard(WakeLock);
+			++Entries;
+		}
+		{
+			std::lock_guard<std::mutex> Guard(Home.Lock);
+			Home.Queue.push({ Priority, NextSequence++, Work->Version.load(), Work });
+		}
+		Wake.notify_one();
+	}
+
+	Ticket Submit(const std::shared_ptr<Job>& Work, double Priority)
+	{
+		Work->Id = NextTicket++;
+		Work->State = Pending;
+		Work->Version = 0;
+		Work->Home = NextHome++ % (unsigned int)Workers.size();
+		{
+			std::lock_guard<std::mutex> Guard(JobsLock);
+			Jobs[Work->Id] = Work;
+		}
+		Push(Work, Priority);
+		return Work->Id;
+	}
+
+	std::shared_ptr<Job> Find(Ticket Id)
+	{
+		std::lock_guard<std::mutex> Guard(JobsLock);
+		auto JobItr = Jobs.find(Id);
+		return JobItr == Jobs.end() ? nullptr : JobItr->second;
+	}
+
+	void Forget(Ticket Id)
+	{
+		std::lock_guard<std::mutex> Guard(JobsLock);
+		Jobs.erase(Id);
+	}
+
+	// whoever moves a job out of Pending or Running owns its promise
+	void FinishCancelled(Job& Work)
+	{
+		Forget(Work.Id);
+		if (Work.UsesPromise)
+			Work.Promise.set_exception(std::make_exception_ptr(ANL_CPP_ChunkCancelled()));
+	}
+
+	bool IsCurrent(const Entry& e)
+	{
+		return e.Work->State.load() == Pending && e.Work->Version.load() == e.Version;
+	}
+
+	// pops the highest priority current entry of the own queue or the queue of another worker
+	bool Take(unsigned int Self, std::shared_ptr<Job>& Work)
+	{
+		for (;;)
+		{
+			unsigned int Best = Self;
+			bool Found = false;
+			double BestPriority = 0.0;
+			for (std::size_t n = 0; n < Workers.size(); ++n)
+			{
+				unsigned int w = (unsigned int)((Self + n) % Workers.size());
+				Worker& Victim = *Workers[w];
+				std::lock_guard<std::mutex> Guard(Victim.Lock);
+				// drop stale entries on the way
+				while (!Victim.Queue.empty() && !IsCurrent(Victim.Queue.top()))
+				{
+					Victim.Queue.pop();
+					std::lock_guard<std::mutex> WakeGuard(WakeLock);
+					--Entries;
+				}
+				if (!Victim.Queue.empty() && (!Found || Victim.Queue.top().Priority > BestPriority))
+				{
+					Found = true;
+					Best = w;
+					BestPriority = Victim.Queue.top().Priority;
+				}
+			}
+			if (!Found)
+				return false;
+
+			Worker& Victim = *Workers[Best];
+			std::lock_guard<std::mutex> Guard(Victim.Lock);
+			if (Victim.Queue.empty())
+				continue;
+			Entry e = Victim.Queue.top();
+			Victim.Queue.pop();
+			{
+				std::lock_guard<std::mutex> WakeGuard(WakeLock);
+				--Entries;
+			}
+			int Expected = Pending;
+			if (e.Work->Version.load() == e.Version && e.Work->State.compare_exchange_strong(Expected, Running))
+			{
+				Work = e.Work;
+				return true;
+			}
+		}
+	}
+
+	void Evaluate(Job& Work)
+	{
+		const ANL_CPP_ChunkRequest& r = Work.Request;
+		const bool Is3D = r.Depth > 0;
+		const int Rows = Is3D ? r.Depth : r.Height;
+		const std::size_t RowSize = (std::size_t)r.Width * (Is3D ? r.Height : 1);
+		const int Band = r.RowsPerBand > 0 ? r.RowsPerBand : std::max(1, Rows);
+		std::vector<double> Samples(RowSize * Rows);
+		// reduced on this worker and merged once, a cancelled chunk leaves Reduction untouched
+		ANL_CPP_Reduction Local;
+		if (r.Reduction)
+		{
+			std::lock_guard<std::mutex> Guard(ReductionLock);
+			Local = *r.Reduction;
+		}
+		Local.Clear();
+		ANL_CPP_Reduction* BandReduction = r.Reduction ? &Local : nullptr;
+		for (int First = 0; First < Rows; First += Band)
+		{
+			if (Work.State.load() == Cancelled)
+				return FinishCancelled(Work);
+
+			int Count = std::min(Band, Rows - First);
+			double* Output = Samples.data() + RowSize * First;
+			if (Is3D)
+				Map3DSlices(Output, r.Width, r.Height, Count, First, r.StartX, r.StartY, r.StartZ, r.StepX, r.StepY, r.StepZ, r.NamedInput, r.Footprint, BandReduction);
+			else
+				Map2DRows(Output, r.Width, Count, First, r.StartX, r.StartY, r.StepX, r.StepY, r.NamedInput, r.Footprint, BandReduction);
+			if (Work.OnPartial)
+				Work.OnPartial(Work.Id, Output, First, Count);
+		}
+
+		int Expected = Running;
+		if (!Work.State.compare_exchange_strong(Expected, Done))
+			return FinishCancelled(Work);
+		if (r.Reduction)
+		{
+			std::lock_guard<std::mutex> Guard(ReductionLock);
+			r.Reduction->Merge(Local);
+		}
+		Forget(Work.Id);
+		if (Work.UsesPromise)
+			Work.Promise.set_value(std::move(Samples));
+		else if (Work.OnComplete)
+			Work.OnComplete(Work.Id, Samples);
+	}
+
+	void Run(unsigned int Self)
+	{
+		for (;;)
+		{
+			{
+				std::unique_lock<std::mutex> Guard(WakeLock);
+				Wake.wait(Guard, [this]() { return Entries > 0 || Stopping; });
+				if (Stopping)
+					return;
+			}
+			std::shared_ptr<Job> Work;
+			if (Take(Self, Work))
+				Evaluate(*Work);
+		}
+	}
+
+	~Impl()
+	{
+		std::vector<std::shared_ptr<Job>> Remaining;
+		{
+			std::lock_guard<std::mutex> Guard(JobsLock);
+			for (auto& JobPair : Jobs)
+				Remaining.push_back(JobPair.second);
+		}
+		for (auto& Work : Remaining)
+		{
+			int Expected = Pending;
+			if (Work->State.compare_exchange_strong(Expected, Cancelled))
+				FinishCancelled(*Work);
+			else if (Expected == Running)
+				Work->State.compare_exchange_strong(Expected, Cancelled);
+		}
+		{
+			std::lock_guard<std::mutex> Guard(WakeLock);
+			Stopping = true;
+		}
+		Wake.notify_all();
+		for (std::thread& t : Threads)
+			t.join();
+	}
+};
+
+ANL_CPP_ChunkService::ANL_CPP_ChunkService(unsigned int ThreadCount)
+	: Pool(new Impl(ThreadCount))
+{
+}
+
+ANL_CPP_ChunkService::~ANL_CPP_ChunkService()
+{
+}
+
+ANL_CPP_ChunkService::Ticket ANL_CPP_ChunkService::Submit(const ANL_CPP_ChunkRequest& Request, double Priority, CompletionCallback OnComplete, PartialCallback OnPartial)
+{
+	std::shared_ptr<Impl::Job> Work = std::make_shared<Impl::Job>();
+	Work->Request = Request;
+	Work->OnComplete = std::move(OnComplete);
+	Work->OnPartial = std::move(OnPartial);
+	Work->UsesPromise = false;
+	return Pool->Submit(Work, Priority);
+}
+
+std::future<std::vector<double>> ANL_CPP_ChunkService::Submit(const ANL_CPP_ChunkRequest& Request, double Priority, Ticket* Id, PartialCallback OnPartial)
+{
+	std::shared_ptr<Impl::Job> Work = std::make_shared<Impl::Job>();
+	Work->Request = Request;
+	Work->OnPartial = std::move(OnPartial);
+	Work->UsesPromise = true;
+	std::future<std::vector<double>> Result = Work->Promise.get_future();
+	Ticket Submitted = Pool->Submit(Work, Priority);
+	if (Id != nullptr)
+		*Id = Submitted;
+	return Result;
+}
+
+bool ANL_CPP_ChunkService::Cancel(Ticket Id)
+{
+	std::shared_ptr<Impl::Job> Work = Pool->Find(Id);
+	if (!Work)
+		return false;
+	int Expected = Impl::Pending;
+	if (Work->State.compare_exchange_strong(Expected, Impl::Cancelled))
+	{
+		Pool->FinishCancelled(*Work);
+		return true;
+	}
+	// the worker running it finishes the cancellation
+	return Expected == Impl::Running && Work->State.compare_exchange_strong(Expected, Impl::Cancelled);
+}
+
+bool ANL_CPP_ChunkService::Reprioritize(Ticket Id, double Priority)
+{
+	std::shared_ptr<Impl::Job> Work = Pool->Find(Id);
+	if (!Work || Work->State.load() != Impl::Pending)
+		return false;
+	++Work->Version;
+	Pool->Push(Work, Priority);
+	return true;
+}
+)abc";
+
+static const std::string TileCacheHeaderOutput = R"abc(
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <cstdio>
+#include <string>
+
+// the samples of one map call, owned or a view of a memory mapped cache file
+class ANL_CPP_Tile
+{
+public:
+	virtual ~ANL_CPP_Tile() {}
+	const double* Samples() const { return Data; }
+	std::size_t Count() const { return SampleCount; }
+
+protected:
+	const double* Data = nullptr;
+	std::size_t SampleCount = 0;
+};
+
+// Caches ANL_CPP_Map2D and ANL_CPP_Map3D results keyed by ANL_CPP_KERNEL_HASH, the named inputs, the region
+// and the resolution. Recently used tiles are kept in memory up to MemoryBudget bytes. With a Directory every
+// tile is also stored on disk and memory mapped when it is requested again, so hits don't copy samples.
+// Tiles stay valid while a caller holds them, even after eviction.
+class ANL_CPP_TileCache
+{
+public:
+	struct Statistics
+	{
+		std::uint64_t MemoryHits = 0;
+		std::uint64_t DiskHits = 0;
+		std::uint64_t Misses = 0;
+	};
+
+	// an empty Directory keeps tiles in memory only, the directory must exist
+	ANL_CPP_TileCache(const std::string& Directory, std::size_t MemoryBudget);
+	~ANL_CPP_TileCache();
+
+	ANL_CPP_TileCache(const ANL_CPP_TileCache&) = delete;
+	ANL_CPP_TileCache& operator=(const ANL_CPP_TileCache&) = delete;
+
+	// concurrent misses of the same tile may both evaluate it
+	std::shared_ptr<const ANL_CPP_Tile> Map2D(int Width, int Height, double StartX, double StartY, double StepX, double StepY, const ANL_CPP_NamedInput& NamedInput, double Footprint = 0.0);
+	std::shared_ptr<const ANL_CPP_Tile> Map3D(int Width, int Height, int Depth, double StartX, double StartY, double StartZ, double StepX, double StepY, double StepZ, const ANL_CPP_NamedInput& NamedInput, double Footprint = 0.0);
+
+	Statistics GetStatistics() const;
+
+private:
+	struct Impl;
+	std::unique_ptr<Impl> Cache;
+};
+)abc";
+
+static const std::string TileCacheOutput = R"abc(
+#include <cstdio>
+#include <list>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <unordered_map>
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace {
+	struct HeapTile : ANL_CPP_Tile
+	{
+		std::vector<double> Values;
+
+		HeapTile(std::vector<double>&& Samples)
+			: Values(std::move(Samples))
+		{
+			Data = Values.data();
+			SampleCount = Values.size();
+		}
+	};
+
+	// cache files start with this header, then the key padded to 8 bytes, then the samples
+	struct TileFileHeader
+	{
+		char Magic[8];
+		std::uint64_t KernelHash;
+		std::uint64_t KeySize;
+		std::uint64_t SampleCount;
+	};
+
+	const char TileFileMagic[8] = { 'A', 'N', 'L', 'T', 'I', 'L', 'E', '1' };
+
+	std::size_t PaddedKeySize(std::size_t KeySize)
+	{
+		return (KeySize + 7) & ~(std::size_t)7;
+	}
+
+	struct MappedTile : ANL_CPP_Tile
+	{
+		void* View = nullptr;
+		std::size_t Size = 0;
+
+		~MappedTile()
+		{
+#ifdef _WIN32
+			if (View != nullptr)
+				UnmapViewOfFile(View);
+#else
+			if (View != nullptr)
+				munmap(View, Size);
+#endif
+		}
+
+		// maps FileName and checks it holds Key, returns null for missing or mismatching files
+		static std::shared_ptr<const ANL_CPP_Tile> Open(const std::string& FileName, const std::string& Key, std::size_t SampleCount)
+		{
+			std::shared_ptr<MappedTile> Tile = std::make_shared<MappedTile>();
+			Tile->Size = sizeof(TileFileHeader) + PaddedKeySize(Key.size()) + SampleCount * sizeof(double);
+#ifdef _WIN32
+			HANDLE File = CreateFileA(FileName.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+			if (File == INVALID_HANDLE_VALUE)
+				return nullptr;
+			LARGE_INTEGER FileSize;
+			HANDLE Mapping = nullptr;
+			if (GetFileSizeEx(File, &FileSize) && (std::uint64_t)FileSize.QuadPart == Tile->Size)
+				Mapping = CreateFileMappingA(File, nullptr, PAGE_READONLY, 0, 0, nullptr);
+			CloseHandle(File);
+			if (Mapping == nullptr)
+				return nullptr;
+			Tile->View = MapViewOfFile(Mapping, FILE_MAP_READ, 0, 0, 0);
+			CloseHandle(Mapping);
+			if (Tile->View == nullptr)
+				return nullptr;
+#else
+			int File = open(FileName.c_str(), O_RDONLY);
+			if (File < 0)
+				return nullptr;
+			struct stat FileStatus;
+			if (fstat(File, &FileStatus) != 0 || (std::uint64_t)FileStatus.st_size != Tile->Size)
+			{
+				close(File);
+				return nullptr;
+			}
+			void* View = mmap(nullptr, Tile->Size, PROT_READ, MAP_SHARED, File, 0);
+			close(File);
+			if (View == MAP_FAILED)
+				return nullptr;
+			Tile->View = View;
+#endif
+			const char* Bytes = static_cast<const char*>(Tile->View);
+			TileFileHeader Header;
+			std::memcpy(&Header, Bytes, sizeof(Header));
+			if (std::memcmp(Header.Magic, TileFileMagic, sizeof(TileFileMagic)) != 0 || Header.KernelHash != ANL_CPP_KERNEL_HASH ||
+				Header.KeySize != Key.size() || Header.SampleCount != SampleCount ||
+				std::memcmp(Bytes + sizeof(Header), Key.data(), Key.size()) != 0)
+				return nullptr;
+
+			Tile->Data = reinterpret_cast<const double*>(Bytes + sizeof(Header) + PaddedKeySize(Key.size()));
+			Tile->SampleCount = SampleCount;
+			return Tile;
+		}
+	};
+
+	// written to a temporary file first so readers never map a partial tile
+	void StoreTileFile(const std::string& FileName, const std::string& Key, const ANL_CPP_Tile& Tile)
+	{
+		std::string TemporaryName = FileName + "." + std::to_string(std::hash<std::thread::id>()(std::this_thread::get_id())) + ".tmp";
+		FILE* f = fopen(TemporaryName.c_str(), "wb");
+		if (f == nullptr)
+			return;
+
+		TileFileHeader Header;
+		std::memcpy(Header.Magic, TileFileMagic, sizeof(TileFileMagic));
+		Header.KernelHash = ANL_CPP_KERNEL_HASH;
+		Header.KeySize = Key.size();
+		Header.SampleCount = Tile.Count();
+		std::string PaddedKey = Key;
+		PaddedKey.resize(PaddedKeySize(Key.size()), '\0');
+		bool Written = fwrite(&Header, sizeof(Header), 1, f) == 1 &&
+			fwrite(PaddedKey.data(), 1, PaddedKey.size(), f) == PaddedKey.size() &&
+			fwrite(Tile.Samples(), sizeof(double), Tile.Count(), f) == Tile.Count();
+		Written = fclose(f) == 0 && Written;
+#ifdef _WIN32
+		if (!Written || !MoveFileExA(TemporaryName.c_str(), FileName.c_str(), MOVEFILE_REPLACE_EXISTING))
+			std::remove(TemporaryName.c_str());
+#else
+		if (!Written || std::rename(TemporaryName.c_str(), FileName.c_str()) != 0)
+			std::remove(TemporaryName.c_str());
+#endif
+	}
+
+	template <typename T>
+	void AppendKey(std::string& Key, const T& Value)
+	{
+		Key.append(reinterpret_cast<const char*>(&Value), sizeof(Value));
+	}
+}
+
+struct ANL_CPP_TileCache::Impl
+{
+	struct Entry
+	{
+		std::shared_ptr<const ANL_CPP_Tile> Tile;
+		std::list<std::string>::iterator Use;
+	};
+
+	std::string Directory;
+	std::size_t MemoryBudget;
+	std::size_t MemoryUsed = 0;
+	mutable std::mutex Lock;
+	// most recently used first
+	std::list<std::string> Uses;
+	std::unordered_map<std::string, Entry> Tiles;
+	Statistics Counts;
+
+	std::string Key(int Width, int Height, int Depth, const double (&Region)[6], const ANL_CPP_NamedInput& NamedInput, double Footprint)
+	{
+		std::string Result;
+		AppendKey(Result, (std::uint64_t)ANL_CPP_KERNEL_HASH);
+		AppendKey(Result, Width);
+		AppendKey(Result, Height);
+		AppendKey(Result, Depth);
+		for (double d : Region)
+			AppendKey(Result, d);
+		AppendKey(Result, Footprint);
+		// an empty struct still has a byte, which is never initialized
+		if (!std::is_empty<ANL_CPP_NamedInput>::value)
+			AppendKey(Result, NamedInput);
+		return Result;
+	}
+
+	std::string FileName(const std::string& Key)
+	{
+		std::uint64_t Hash = 14695981039346656037ull;
+		for (char c : Key)
+		{
+			Hash ^= (unsigned char)c;
+			Hash *= 1099511628211ull;
+		}
+		char Name[32];
+		snprintf(Name, sizeof(Name), "%016llx.tile", (unsigned long long)Hash);
+		return Directory + "/" + Name;
+	}
+
+	std::shared_ptr<const ANL_CPP_Tile> Find(const std::string& Key)
+	{
+		std::lock_guard<std::mutex> Guard(Lock);
+		auto TileItr = Tiles.find(Key);
+		if (TileItr == Tiles.end())
+			return nullptr;
+		Uses.splice(Uses.begin(), Uses, TileItr->second.Use);
+		Counts.MemoryHits++;
+		return TileItr->second.Tile;
+	}
+
+	void Insert(const std::string& Key, const std::shared_ptr<const ANL_CPP_Tile>& Tile)
+	{
+		std::lock_guard<std::mutex> Guard(Lock);
+		if (Tiles.count(Key) != 0)
+			return;
+		Uses.push_front(Key);
+		Tiles[Key] = { Tile, Uses.begin() };
+		MemoryUsed += Tile->Count() * sizeof(double);
+		while (MemoryUsed > MemoryBudget && !Uses.empty())
+		{
+			auto Evicted = Tiles.find(Uses.back());
+			MemoryUsed -= Evicted->second.Tile->Count() * sizeof(double);
+			Tiles.erase(Evicted);
+			Uses.pop_back();
+		}
+	}
+
+	template <typename Evaluate>
+	std::shared_ptr<const ANL_CPP_Tile> Get(const std::string& Key, std::size_t SampleCount, Evaluate Map)
+	{
+		std::shared_ptr<const ANL_CPP_Tile> Tile = Find(Key);
+		if (Tile)
+			return Tile;
+
+		std::string Name = Directory.empty() ? std::string() : FileName(Key);
+		if (!Name.empty())
+			Tile = MappedTile::Open(Name, Key, SampleCount);
+		if (Tile)
+		{
+			std::lock_guard<std::mutex> Guard(Lock);
+			Counts.DiskHits++;
+		}
+		else
+		{
+			std::vector<double> Samples(SampleCount);
+			Map(Samples.data());
+			Tile = std::make_shared<HeapTile>(std::move(Samples));
+			if (!Name.empty())
+				StoreTileFile(Name, Key, *Tile);
+			std::lock_guard<std::mutex> Guard(Lock);
+			Counts.Misses++;
+		}
+		Insert(Key, Tile);
+		return Tile;
+	}
+};
+
+ANL_CPP_TileCache::ANL_CPP_TileCache(const std::string& Directory, std::size_t MemoryBudget)
+	: Cache(new Impl())
+{
+	Cache->Directory = Directory;
+	Cache->MemoryBudget = MemoryBudget;
+}
+
+ANL_CPP_TileCache::~ANL_CPP_TileCache()
+{
+}
+
+std::shared_ptr<const ANL_CPP_Tile> ANL_CPP_TileCache::Map2D(int Width, int Height, double StartX, double StartY, double StepX, double StepY, const ANL_CPP_NamedInput& NamedInput, double Footprint)
+{
+	const double Region[6] = { StartX, StartY, 0.0, StepX, StepY, 0.0 };
+	return Cache->Get(Cache->Key(Width, Height, 0, Region, NamedInput, Footprint), (std::size_t)Width * Height, [&](double* Output)
+	{
+		ANL_CPP_Map2D(Output, Width, Height, StartX, StartY, StepX, StepY, NamedInput, Footprint);
+	});
+}
+
+std::shared_ptr<const ANL_CPP_Tile> ANL_CPP_TileCache::Map3D(int Width, int Height, int Depth, double StartX, double StartY, double StartZ, double StepX, double StepY, double StepZ, const ANL_CPP_NamedInput& NamedInput, double Footprint)
+{
+	const double Region[6] = { StartX, StartY, StartZ, StepX, StepY, StepZ };
+	return Cache->Get(Cache->Key(Width, Height, Depth, Region, NamedInput, Footprint), (std::size_t)Width * Height * Depth, [&](double* Output)
+	{
+		ANL_CPP_Map3D(Output, Width, Height, Depth, StartX, StartY, StartZ, StepX, StepY, StepZ, NamedInput, Footprint);
+	});
+}
+
+ANL_CPP_TileCache::Statistics ANL_CPP_TileCache::GetStatistics() const
+{
+	std::lock_guard<std::mutex> Guard(Cache->Lock);
+	return Cache->Counts;
+}
+)abc";
+
+static const std::string RetainedMapHeaderOutput = R"abc(
+#include <cstdint>
+#include <vector>
+
+// ANL_CPP_Map2D over a fixed region that keeps, between calls, the intermediate results depending on fewer
+// named inputs than the values using them. Update only recomputes the results depending on a named input
+// that changed since the previous call, everything on the first call. Each kept result is a Width * Height buffer.
+class ANL_CPP_RetainedMap2D
+{
+public:
+	ANL_CPP_RetainedMap2D(int Width, int Height, double StartX, double StartY, double StepX, double StepY);
+
+	// returns Width * Height samples laid out as by ANL_CPP_Map2D, valid until the next Update
+	const double* Update(const ANL_CPP_NamedInput& NamedInput, double Footprint = 0.0);
+
+private:
+	int Width, Height;
+	double StartX, StartY, StepX, StepY;
+	bool Valid = false;
+	ANL_CPP_NamedInput Previous;
+	double PreviousFootprint = 0.0;
+	std::vector<std::vector<double>> Retained;
+};
+)abc";
+
+static const std::string RetainedMapOutput = R"abc(
+ANL_CPP_RetainedMap2D::ANL_CPP_RetainedMap2D(int Width, int Height, double StartX, double StartY, double StepX, double StepY)
+	: Width(Width), Height(Height), StartX(StartX), StartY(StartY), StepX(StepX), StepY(StepY),
+	Retained(<RETAINED_BUFFER_COUNT>, std::vector<double>((std::size_t)Width * Height))
+{
+}
+
+const double* ANL_CPP_RetainedMap2D::Update(const ANL_CPP_NamedInput& NamedInput, double Footprint)
+{
+	const CoherentMapScope CoherentScope(std::max(std::abs(StepX), std::abs(StepY)));
+<THIS_IS_WHERE_THE_CODE_GOES>
+}
+)abc";
+
+static const std::string AdaptiveMapHeaderOutput = R"abc(
+#include <cstddef>
+
+// ANL_CPP_Map2D that evaluates a coarse grid of samples CoarseStep apart, then splits each cell into four while
+// the evaluated midpoints of its edges and center differ from the bilinear interpolation of its corners by more
+// than Tolerance. The samples of the cells that stop splitting are interpolated. A feature smaller than a
+// coarse cell can be missed. Returns the number of evaluated samples.
+std::size_t ANL_CPP_MapAdaptive(double* Output, int Width, int Height, double StartX, double StartY, double StepX, double StepY, double Tolerance, int CoarseStep, const ANL_CPP_NamedInput& NamedInput, double Footprint = 0.0);
+)abc";
+
+static const std::string AdaptiveMapOutput = R"abc(
+namespace {
+	struct AdaptiveSampler
+	{
+		double* Output;
+		int Width;
+		double StartX, StartY, StepX, StepY, Tolerance;
+		const ANL_CPP_NamedInput& NamedInput;
+		double Footprint;
+		std::vector<unsigned char> Evaluated;
+		std::size_t Evaluations;
+
+		double Sample(int i, int j)
+		{
+			const std::size_t Index = (std::size_t)j * Width + i;
+			if (!Evaluated[Index])
+			{
+				Output[Index] = ANL_CPP_EvalScalar(StartX + StepX * i, StartY + StepY * j, NamedInput, Footprint);
+				Evaluated[Index] = 1;
+				++Evaluations;
+			}
+			return Output[Index];
+		}
+
+		static double Bilinear(double v00, double v10, double v01, double v11, double fx, double fy)
+		{
+			const double Top = v00 + (v10 - v00) * fx;
+			const double Bottom = v01 + (v11 - v01) * fx;
+			return Top + (Bottom - Top) * fy;
+		}
+
+		// the corners of the cell are evaluated, a cell of a single row or column has x0 == x1 or y0 == y1
+		void Refine(int x0, int y0, int x1, int y1)
+		{
+			if (x1 - x0 <= 1 && y1 - y0 <= 1)
+				return;
+			const double v00 = Output[(std::size_t)y0 * Width + x0];
+			const double v10 = Output[(std::size_t)y0 * Width + x1];
+			const double v01 = Output[(std::size_t)y1 * Width + x0];
+			const double v11 = Output[(std::size_t)y1 * Width + x1];
+			const int mx = (x0 + x1) / 2;
+			const int my = (y0 + y1) / 2;
+			const double fx = x1 > x0 ? (double)(mx - x0) / (x1 - x0) : 0.0;
+			const double fy = y1 > y0 ? (double)(my - y0) / (y1 - y0) : 0.0;
+
+			// second differences along the edges and across the cell
+			double Error = 0.0;
+			Error = std::max(Error, std::abs(Sample(mx, y0) - Bilinear(v00, v10, v01, v11, fx, 0.0)));
+			Error = std::max(Error, std::abs(Sample(mx, y1) - Bilinear(v00, v10, v01, v11, fx, 1.0)));
+			Error = std::max(Error, std::abs(Sample(x0, my) - Bilinear(v00, v10, v01, v11, 0.0, fy)));
+			Error = std::max(Error, std::abs(Sample(x1, my) - Bilinear(v00, v10, v01, v11, 1.0, fy)));
+			Error = std::max(Error, std::abs(Sample(mx, my) - Bilinear(v00, v10, v01, v11, fx, fy)));
+			if (Error > Tolerance)
+			{
+				// a cell without width or height only splits along its length
+				Refine(x0, y0, mx, my);
+				if (x1 > x0)
+					Refine(mx, y0, x1, my);
+				if (y1 > y0)
+					Refine(x0, my, mx, y1);
+				if (x1 > x0 && y1 > y0)
+					Refine(mx, my, x1, y1);
+				return;
+			}
+
+			// samples evaluated by a refined neighbour keep their value
+			for (int j = y0; j <= y1; ++j)
+			{
+				const double ty = y1 > y0 ? (double)(j - y0) / (y1 - y0) : 0.0;
+				for (int i = x0; i <= x1; ++i)
+				{
+					const std::size_t Index = (std::size_t)j * Width + i;
+					if (!Evaluated[Index])
+						Output[Index] = Bilinear(v00, v10, v01, v11, x1 > x0 ? (double)(i - x0) / (x1 - x0) : 0.0, ty);
+				}
+			}
+		}
+	};
+}
+
+std::size_t ANL_CPP_MapAdaptive(double* Output, int Width, int Height, double StartX, double StartY, double StepX, double StepY, double Tolerance, int CoarseStep, const ANL_CPP_NamedInput& NamedInput, double Footprint)
+{
+	if (Width <= 0 || Height <= 0)
+		return 0;
+	const CoherentMapScope CoherentScope(std::max(std::abs(StepX), std::abs(StepY)));
+	CoarseStep = std::max(CoarseStep, 1);
+	AdaptiveSampler Sampler{ Output, Width, StartX, StartY, StepX, StepY, Tolerance, NamedInput, Footprint,
+		std::vector<unsigned char>((std::size_t)Width * Height, 0), 0 };
+
+	// the last row and column close the coarse grid even when the size isn't a multiple of CoarseStep,
+	// a single row or column closes it on itself so its cells are refined as a line
+	std::vector<int> Columns(1, 0), Rows(1, 0);
+	for (int i = CoarseStep; i < Width - 1; i += CoarseStep)
+		Columns.push_back(i);
+	Columns.push_back(Width - 1);
+	for (int j = CoarseStep; j < Height - 1; j += CoarseStep)
+		Rows.push_back(j);
+	Rows.push_back(Height - 1);
+	for (int j : Rows)
+		for (int i : Columns)
+			Sampler.Sample(i, j);
+
+	for (std::size_t r = 0; r + 1 < Rows.size(); ++r)
+		for (std::size_t c = 0; c + 1 < Columns.size(); ++c)
+			Sampler.Refine(Columns[c], Rows[r], Columns[c + 1], Rows[r + 1]);
+	return Sampler.Evaluations;
+}
+)abc";
+
+static const std::string QuantizedMapHeaderOutput = R"abc(
+// How ANL_CPP_MapQuantized2D and ANL_CPP_MapQuantized3D store a sample: Value * Scale + Bias clamped to
+// [ClampLow, ClampHigh]. UNorm8 and UNorm16 then map [0, 1] to the whole unsigned range, rounding to nearest
+// or, with Dither, adding a 4x4 ordered threshold so smooth gradients don't band. Half stores an IEEE binary16.
+struct ANL_CPP_QuantizedFormat
+{
+	enum Kind { UNorm8, UNorm16, Half };
+	Kind Type = UNorm16;
+	double Scale = 1.0;
+	double Bias = 0.0;
+	double ClampLow = 0.0, ClampHigh = 1.0;
+	bool Dither = false;
+};
+
+// same layout as ANL_CPP_Map2D and ANL_CPP_Map3D, Output holds one std::uint8_t or std::uint16_t per sample
+void ANL_CPP_MapQuantized2D(void* Output, const ANL_CPP_QuantizedFormat& Format, int Width, int Height, double StartX, double StartY, double StepX, double StepY, const ANL_CPP_NamedInput& NamedInput, double Footprint = 0.0);
+void ANL_CPP_MapQuantized3D(void* Output, const ANL_CPP_QuantizedFormat& Format, int Width, int Height, int Depth, double StartX, double StartY, double StartZ, double StepX, double StepY, double StepZ, const ANL_CPP_NamedInput& NamedInput, double Footprint = 0.0);
+)abc";
+
+static const std::string QuantizedMapOutput = R"abc(
+namespace {
+	template <typename Integer>
+	struct QuantizeUNorm
+	{
+		Integer* Output;
+		double Scale, Bias, Low, High;
+		bool Dither;
+
+		QuantizeUNorm(void* Destination, const ANL_CPP_QuantizedFormat& Format)
+			: Output((Integer*)Destination), Dither(Format.Dither)
+		{
+			// folds the mapping of [0, 1] to the integer range into the format
+			const double Range = (double)std::numeric_limits<Integer>::max();
+			Scale = Format.Scale * Range;
+			Bias = Format.Bias * Range;
+			Low = std::max(Format.ClampLow, 0.0) * Range;
+			High = std::min(Format.ClampHigh, 1.0) * Range;
+		}
+
+		void operator()(std::size_t Index, int i, int j, double Value) const
+		{
+			static const double Threshold[16] = {
+				0.5 / 16, 8.5 / 16, 2.5 / 16, 10.5 / 16,
+				12.5 / 16, 4.5 / 16, 14.5 / 16, 6.5 / 16,
+				3.5 / 16, 11.5 / 16, 1.5 / 16, 9.5 / 16,
+				15.5 / 16, 7.5 / 16, 13.5 / 16, 5.5 / 16 };
+			// written so NaN stores Low
+			double v = Value * Scale + Bias;
+			v = v > Low ? v : Low;
+			v = v < High ? v : High;
+			Output[Index] = (Integer)(v + (Dither ? Threshold[(j & 3) * 4 + (i & 3)] : 0.5));
+		}
+	};
+
+	struct QuantizeHalf
+	{
+		std::uint16_t* Output;
+		double Scale, Bias, Low, High;
+
+		QuantizeHalf(void* Destination, const ANL_CPP_QuantizedFormat& Format)
+			: Output((std::uint16_t*)Destination), Scale(Format.Scale), Bias(Format.Bias), Low(Format.ClampLow), High(Format.ClampHigh) {}
+
+		// rounds to nearest even straight from the double, without the double rounding of going through float
+		static std::uint16_t ToHalf(double Value)
+		{
+			std::uint64_t Bits;
+			std::memcpy(&Bits, &Value, sizeof(Bits));
+			const std::uint16_t Sign = (std::uint16_t)((Bits >> 48) & 0x8000u);
+			Bits &= 0x7fffffffffffffffull;
+			if (Bits >= 0x7ff0000000000000ull)
+				return (std::uint16_t)(Sign | (Bits > 0x7ff0000000000000ull ? 0x7e00u : 0x7c00u));
+			// 65520 and above round to infinity
+			if (Bits >= 0x40effe0000000000ull)
+				return (std::uint16_t)(Sign | 0x7c00u);
+			// below 2^-14 the result is subnormal, below 2^-25 it is zero
+			if (Bits < 0x3f10000000000000ull)
+			{
+				if (Bits < 0x3e60000000000000ull)
+					return Sign;
+				const unsigned int Shift = 1051 - (unsigned int)(Bits >> 52);
+				const std::uint64_t Mantissa = (Bits & 0x000fffffffffffffull) | 0x0010000000000000ull;
+				const std::uint64_t Truncated = Mantissa >> Shift;
+				const std::uint64_t Rest = Mantissa & ((1ull << Shift) - 1);
+				const std::uint64_t Midpoint = 1ull << (Shift - 1);
+				return (std::uint16_t)(Sign | (Truncated + (Rest > Midpoint || (Rest == Midpoint && (Truncated & 1)) ? 1 : 0)));
+			}
+			const std::uint64_t Rounded = Bits + 0x1ffffffffffull + ((Bits >> 42) & 1);
+			return (std::uint16_t)(Sign | ((Rounded - 0x3f00000000000000ull) >> 42));
+		}
+
+		void operator()(std::size_t Index, int, int, double Value) const
+		{
+			double v = Value * Scale + Bias;
+			v = v > Low ? v : Low;
+			v = v < High ? v : High;
+			Output[Index] = ToHalf(v);
+		}
+	};
+
+	template <typename Sink>
+	void MapQuantized2D(const Sink& Write, int Width, int Height, double StartX, double StartY, double StepX, double StepY, const ANL_CPP_NamedInput& NamedInput, double Footprint)
+	{
+		const CoherentMapScope CoherentScope(std::max(std::abs(StepX), std::abs(StepY)));
+<THIS_IS_WHERE_THE_MAP2D_CODE_GOES>
+	}
+
+	template <typename Sink>
+	void MapQuantized3D(const Sink& Write, int Width, int Height, int Depth, double StartX, double StartY, double StartZ, double StepX, double StepY, double StepZ, const ANL_CPP_NamedInput& NamedInput, double Footprint)
+	{
+		const CoherentMapScope CoherentScope(std::max(std::max(std::abs(StepX), std::abs(StepY)), std::abs(StepZ)));
+<THIS_IS_WHERE_THE_MAP3D_CODE_GOES>
+	}
+}
+
+void ANL_CPP_MapQuantized2D(void* Output, const ANL_CPP_QuantizedFormat& Format, int Width, int Height, double StartX, double StartY, double StepX, double StepY, const ANL_CPP_NamedInput& NamedInput, double Footprint)
+{
+	switch (Format.Type)
+	{
+	case ANL_CPP_QuantizedFormat::UNorm8:
+		return MapQuantized2D(QuantizeUNorm<std::uint8_t>(Output, Format), Width, Height, StartX, StartY, StepX, StepY, NamedInput, Footprint);
+	case ANL_CPP_QuantizedFormat::UNorm16:
+		return MapQuantized2D(QuantizeUNorm<std::uint16_t>(Output, Format), Width, Height, StartX, StartY, StepX, StepY, NamedInput, Footprint);
+	case ANL_CPP_QuantizedFormat::Half:
+		return MapQuantized2D(QuantizeHalf(Output, Format), Width, Height, StartX, StartY, StepX, StepY, NamedInput, Footprint);
+	}
+}
+
+void ANL_CPP_MapQuantized3D(void* Output, const ANL_CPP_QuantizedFormat& Format, int Width, int Height, int Depth, double StartX, double StartY, double StartZ, double StepX, double StepY, double StepZ, const ANL_CPP_NamedInput& NamedInput, double Footprint)
+{
+	switch (Format.Type)
+	{
+	case ANL_CPP_QuantizedFormat::UNorm8:
+		return MapQuantized3D(QuantizeUNorm<std::uint8_t>(Output, Format), Width, Height, Depth, StartX, StartY, StartZ, StepX, StepY, StepZ, NamedInput, Footprint);
+	case ANL_CPP_QuantizedFormat::UNorm16:
+		return MapQuantized3D(QuantizeUNorm<std::uint16_t>(Output, Format), Width, Height, Depth, StartX, StartY, StartZ, StepX, StepY, StepZ, NamedInput, Footprint);
+	case ANL_CPP_QuantizedFormat::Half:
+		return MapQuantized3D(QuantizeHalf(Output, Format), Width, Height, Depth, StartX, StartY, StartZ, StepX, StepY, StepZ, NamedInput, Footprint);
+	}
+}
+)abc";
+
+static const std::string SeamlessMapHeaderOutput = R"abc(
+// Seamless tiles, sample i of an axis of Count samples is placed on a circle of circumference Size at angle
+// 2 pi i / Count, so the last sample wraps back onto the first. The 2D kernel is evaluated in 4D at
+// (x cos, x sin, y cos, y sin) and the 3D kernel in 6D with z on the fifth and sixth coordinate, each circle
+// offset by its Start. Output has the layout of ANL_CPP_Map2D and ANL_CPP_Map3D. Bands of rows, or of slices
+// for a volume, run on ThreadCount threads, 0 uses std::thread::hardware_concurrency().
+// Footprint is about Size / Count.
+void ANL_CPP_MapSeamless2D(double* Output, int Width, int Height, double StartX, double StartY, double SizeX, double SizeY, const ANL_CPP_NamedInput& NamedInput, double Footprint = 0.0, unsigned int ThreadCount = 0);
+void ANL_CPP_MapSeamless3D(double* Output, int Width, int Height, int Depth, double StartX, double StartY, double StartZ, double SizeX, double SizeY, double SizeZ, const ANL_CPP_NamedInput& NamedInput, double Footprint = 0.0, unsigned int ThreadCount = 0);
+)abc";
+
+static const std::string SeamlessMapOutput = R"abc(
+#include <atomic>
+#include <functional>
+#include <thread>
+
+namespace {
+	// the coordinates of every sample of an axis on its circle, computed once per map
+	struct SeamlessCircle
+	{
+		std::vector<double> Cos, Sin;
+
+		SeamlessCircle(int Count, double Start, double Size)
+			: Cos(std::max(Count, 0)), Sin(std::max(Count, 0))
+		{
+			const double TwoPi = 6.283185307179586476925;
+			const double Radius = Size / TwoPi;
+			for (int n = 0; n < Count; ++n)
+			{
+				const double Angle = TwoPi * n / Count;
+				Cos[n] = Start + std::cos(Angle) * Radius;
+				Sin[n] = Start + std::sin(Angle) * Radius;
+			}
+		}
+	};
+
+	void MapSeamless2DTile(double* Output, int Width, int Height, const double* CosX, const double* SinX, const double* CosY, const double* SinY, const ANL_CPP_NamedInput& NamedInput, double Footprint)
+	{
+<THIS_IS_WHERE_THE_MAP2D_CODE_GOES>
+	}
+
+	void MapSeamless3DTile(double* Output, int Width, int Height, int Depth, const double* CosX, const double* SinX, const double* CosY, const double* SinY, const double* CosZ, const double* SinZ, const ANL_CPP_NamedInput& NamedInput, double Footprint)
+	{
+<THIS_IS_WHERE_THE_MAP3D_CODE_GOES>
+	}
+
+	// calls Tile(First, Count) for bands covering Count items, taken in turn by the threads
+	void RunSeamlessBands(int Count, unsigned int ThreadCount, const std::function<void(int, int)>& Tile)
+	{
+		if (ThreadCount == 0)
+			ThreadCount = std::max(1u, std::thread::hardware_concurrency());
+		// a few bands per thread even out the cost of the regions
+		const int Band = std::max(1, Count / (int)(ThreadCount * 4));
+		const int BandCount = (Count + Band - 1) / Band;
+		ThreadCount = std::min(ThreadCount, (unsigned int)std::max(BandCount, 1));
+
+		std::atomic<int> NextBand(0);
+		auto Work = [&]()
+		{
+			for (int b = NextBand++; b < BandCount; b = NextBand++)
+				Tile(b * Band, std::min(Band, Count - b * Band));
+		};
+		std::vector<std::thread> Threads;
+		for (unsigned int t = 1; t < ThreadCount; ++t)
+			Threads.emplace_back(Work);
+		Work();
+		for (std::thread& Thread : Threads)
+			Thread.join();
+	}
+}
+
+void ANL_CPP_MapSeamless2D(double* Output, int Width, int Height, double StartX, double StartY, double SizeX, double SizeY, const ANL_CPP_NamedInput& NamedInput, double Footprint, unsigned int ThreadCount)
+{
+	if (Width <= 0 || Height <= 0)
+		return;
+	const SeamlessCircle X(Width, StartX, SizeX), Y(Height, StartY, SizeY);
+	RunSeamlessBands(Height, ThreadCount, [&](int First, int Count) {
+		MapSeamless2DTile(Output + (std::size_t)Width * First, Width, Count, X.Cos.data(), X.Sin.data(), Y.Cos.data() + First, Y.Sin.data() + First, NamedInput, Footprint);
+	});
+}
+
+void ANL_CPP_MapSeamless3D(double* Output, int Width, int Height, int Depth, double StartX, double StartY, double StartZ, double SizeX, double SizeY, double SizeZ, const ANL_CPP_NamedInput& NamedInput, double Footprint, unsigned int ThreadCount)
+{
+	if (Width <= 0 || Height <= 0 || Depth <= 0)
+		return;
+	const SeamlessCircle X(Width, StartX, SizeX), Y(Height, StartY, SizeY), Z(Depth, StartZ, SizeZ);
+	RunSeamlessBands(Depth, ThreadCount, [&](int First, int Count) {
+		MapSeamless3DTile(Output + (std::size_t)Width * Height * First, Width, Height, Count, X.Cos.data(), X.Sin.data(), Y.Cos.data(), Y.Sin.data(), Z.Cos.data() + First, Z.Sin.data() + First, NamedInput, Footprint);
+	});
+}
+)abc";
+
+static const std::string BakedMapHeaderOutput = R"abc(
+// The kernel evaluated when this file was generated over Width x Height samples, sample (i, j) taken at
+// (StartX + StepX * i, StartY + StepY * j). Each is stored to within half of ANL_CPP_BAKED_QUANTUM.
+<THIS_IS_WHERE_THE_SETTINGS_GO>
+// Interpolates the baked samples bilinearly or, with Bicubic, with Catmull-Rom splines. Positions outside the
+// region take the value at its nearest edge.
+double ANL_CPP_SampleBaked(double x, double y, bool Bicubic = false);
+)abc";
+
+static const std::string BakedMapOutput = R"abc(
+namespace {
+	const std::uint16_t BakedSamples[] = {
+<THIS_IS_WHERE_THE_CODE_GOES>
+	};
+
+	double BakedSample(int i, int j)
+	{
+		i = i > 0 ? (i < ANL_CPP_BAKED_WIDTH - 1 ? i : ANL_CPP_BAKED_WIDTH - 1) : 0;
+		j = j > 0 ? (j < ANL_CPP_BAKED_HEIGHT - 1 ? j : ANL_CPP_BAKED_HEIGHT - 1) : 0;
+		return ANL_CPP_BAKED_LOW + ANL_CPP_BAKED_QUANTUM * BakedSamples[(std::size_t)j * ANL_CPP_BAKED_WIDTH + i];
+	}
+
+	// Catmull-Rom through b and c at t in [0, 1]
+	double BakedCubic(double a, double b, double c, double d, double t)
+	{
+		return b + 0.5 * t * (c - a + t * (2.0 * a - 5.0 * b + 4.0 * c - d + t * (3.0 * (b - c) + d - a)));
+	}
+
+	// the position in samples along an axis, NaN taken as the first sample
+	double BakedPosition(double Coordinate, double Start, double Step, int Count)
+	{
+		const double Position = (Coordinate - Start) / Step;
+		return Position > 0.0 ? (Position < Count - 1 ? Position : Count - 1) : 0.0;
+	}
+}
+
+double ANL_CPP_SampleBaked(double x, double y, bool Bicubic)
+{
+	const double u = BakedPosition(x, ANL_CPP_BAKED_START_X, ANL_CPP_BAKED_STEP_X, ANL_CPP_BAKED_WIDTH);
+	const double v = BakedPosition(y, ANL_CPP_BAKED_START_Y, ANL_CPP_BAKED_STEP_Y, ANL_CPP_BAKED_HEIGHT);
+	const int i = (int)u, j = (int)v;
+	const double tx = u - i, ty = v - j;
+	if (!Bicubic)
+	{
+		const double Top = BakedSample(i, j) + (BakedSample(i + 1, j) - BakedSample(i, j)) * tx;
+		const double Bottom = BakedSample(i, j + 1) + (BakedSample(i + 1, j + 1) - BakedSample(i, j + 1)) * tx;
+		return Top + (Bottom - Top) * ty;
+	}
+	double Rows[4];
+	for (int r = 0; r < 4; ++r)
+		Rows[r] = BakedCubic(BakedSample(i - 1, j + r - 1), BakedSample(i, j + r - 1), BakedSample(i + 1, j + r - 1), BakedSample(i + 2, j + r - 1), tx);
+	return BakedCubic(Rows[0], Rows[1], Rows[2], Rows[3], ty);
+}
+)abc";
+
+static const std::string ProfileRuntimeOutput = R"abc(
+#include <atomic>
+
+const unsigned int ANL_CPP_ProfileNodeCount = <PROFILE_NODE_COUNT>;
+
+// counters of the instrumented build, one set shared by every source of it
+struct ANL_CPP_ProfileCounters
+{
+	std::atomic<std::uint64_t> Samples;
+	std::atomic<std::uint64_t> Reached[ANL_CPP_ProfileNodeCount];
+	std::atomic<std::uint64_t> Taken[ANL_CPP_ProfileNodeCount][3];
+};
+
+inline ANL_CPP_ProfileCounters& ProfileCounters()
+{
+	// zero initialized before any thread can use it
+	static ANL_CPP_ProfileCounters Counters;
+	return Counters;
+}
+
+inline void ProfileSample()
+{
+	ProfileCounters().Samples.fetch_add(1, std::memory_order_relaxed);
+}
+
+inline void ProfileReach(unsigned int Node)
+{
+	ProfileCounters().Reached[Node].fetch_add(1, std::memory_order_relaxed);
+}
+
+// Outcome is 0 for the low input of a select, 1 for the high input and 2 for the blend
+inline void ProfileTake(unsigned int Node, int Outcome)
+{
+	ProfileCounters().Taken[Node][Outcome].fetch_add(1, std::memory_order_relaxed);
+}
+)abc";
+
+static const std::string ProfileHeaderOutput = R"abc(
+// Writes what the instrumented build counted since it started or was last reset, in the format read by
+// the transpiler's --profile option. Returns false if the file can't be written.
+bool ANL_CPP_WriteProfile(const char* FileName);
+void ANL_CPP_ResetProfile();
+)abc";
+
+static const std::string ProfileOutput = R"abc(
+bool ANL_CPP_WriteProfile(const char* FileName)
+{
+	FILE* File = fopen(FileName, "w");
+	if (File == nullptr)
+		return false;
+	ANL_CPP_ProfileCounters& Counters = ProfileCounters();
+	fprintf(File, "ANLProfile 1\nKernelHash <PROFILE_HASH>\nSamples %llu\n", (unsigned long long)Counters.Samples.load());
+	for (unsigned int Node = 0; Node < ANL_CPP_ProfileNodeCount; ++Node)
+	{
+		const unsigned long long Reached = Counters.Reached[Node].load();
+		if (Reached != 0)
+			fprintf(File, "Node %u %llu\n", Node, Reached);
+		const unsigned long long Low = Counters.Taken[Node][0].load(), High = Counters.Taken[Node][1].load(), Blend = Counters.Taken[Node][2].load();
+		if (Low != 0 || High != 0 || Blend != 0)
+			fprintf(File, "Select %u %llu %llu %llu\n", Node, Low, High, Blend);
+	}
+	return fclose(File) == 0;
+}
+
+void ANL_CPP_ResetProfile()
+{
+	ANL_CPP_ProfileCounters& Counters = ProfileCounters();
+	Counters.Samples = 0;
+	for (unsigned int Node = 0; Node < ANL_CPP_ProfileNodeCount; ++Node)
+	{
+		Counters.Reached[Node] = 0;
+		for (int Outcome = 0; Outcome < 3; ++Outcome)
+			Counters.Taken[Node][Outcome] = 0;
+	}
+}
+)abc";
+
+static const std::string AdditionalFunctionsReplaceToken = "<THIS_IS_WHERE_ADDITIONAL_FUNCTIONS_GO>";
+static const std::string NamedInputReplaceToken = "<THIS_IS_WHERE_THE_NAMED_INPUT_GOES>";
+static const std::string CodeReplaceToken = "<THIS_IS_WHERE_THE_CODE_GOES>";
+static const std::string HeaderFileNameReplaceToken = "<HEADER_FILE_NAME>";
+static const std::string Map2DReplaceToken = "<THIS_IS_WHERE_THE_MAP2D_CODE_GOES>";
+static const std::string Map3DReplaceToken = "<THIS_IS_WHERE_THE_MAP3D_CODE_GOES>";
+static const std::string SettingsReplaceToken = "<THIS_IS_WHERE_THE_SETTINGS_GO>";
+static const std::string RuntimeTypesReplaceToken = "<THIS_IS_WHERE_THE_RUNTIME_TYPES_GO>";
+static const std::string RuntimeDeclarationsReplaceToken = "<THIS_IS_WHERE_THE_RUNTIME_DECLARATIONS_GO>";
+static const std::string InternalHeaderFileNameReplaceToken = "<INTERNAL_HEADER_FILE_NAME>";
+static const std::string RGBAFunctionsReplaceToken = "<THIS_IS_WHERE_THE_RGBA_FUNCTIONS_GO>";
+static const std::string ExtensionsReplaceToken = "<THIS_IS_WHERE_THE_EXTENSIONS_GO>";
+static const std::string RetainedBufferCountReplaceToken = "<RETAINED_BUFFER_COUNT>";
+static const std::string CoherentBasesReplaceToken = "<THIS_IS_WHERE_THE_COHERENT_BASES_GO>";
+static const std::string OutputsReplaceToken = "<THIS_IS_WHERE_THE_OUTPUTS_GO>";
+static const std::string ProfileNodeCountReplaceToken = "<PROFILE_NODE_COUNT>";
+static const std::string ProfileHashReplaceToken = "<PROFILE_HASH>";
+
+// maximum errors measured against the standard library
+static const std::string FastMathDescriptions[] = {
+	"// exp, sin, cos, tan, atan, asin and acos call the standard library\n",
+	"// exp, sin, cos, tan, atan, asin and acos use polynomial approximations:\n"
+	"//   exp relative error 5e-16, sin and cos absolute error 2e-15 for |x| < 1e6,\n"
+	"//   atan, asin and acos absolute error 1e-15, exp saturates outside [-708, 709]\n"
+	"// pow with a constant integer or half integer exponent uses multiplies and sqrt\n",
+	"// exp, sin, cos, tan, atan, asin and acos use short polynomial approximations:\n"
+	"//   exp relative error 2e-7, sin, cos and tan error 5e-7,\n"
+	"//   atan, asin and acos absolute error 1e-8, exp saturates outside [-708, 709]\n"
+	"// pow with a constant integer or half integer exponent uses multiplies and sqrt\n",
+};
+
+static void ReplaceToken(std::string& Text, const std::string& Token, const std::string& Value)
+{
+	std::size_t Offset = Text.find(Token);
+	Text.replace(Offset, Token.size(), Value);
+}
+
+// the samples of Map quantized to 16 bits between their finite extremes, the defines describing them go to Defines
+static std::string BakedSamplesToC(const ANLtoC::BakedMap& Map, std::string& Defines)
+{
+	double Low = std::numeric_limits<double>::infinity();
+	double High = -std::numeric_limits<double>::infinity();
+	for (double Value : Map.Samples)
+	{
+		if (std::isfinite(Value))
+		{
+			Low = std::min(Low, Value);
+			High = std::max(High, Value);
+		}
+	}
+	if (Low > High)
+		Low = High = 0.0;
+	const double Quantum = (High - Low) / 65535.0;
+
+	auto Define = [&Defines](const std::string& Name, double Value)
+	{
+		char Number[32];
+		snprintf(Number, sizeof(Number), "%.17g", Value);
+		// keeps whole numbers double
+		const std::string Literal = std::string(Number) + (strpbrk(Number, ".e") == nullptr ? ".0" : "");
+		Defines += "#define " + Name + " (" + Literal + ")\n";
+	};
+	Defines = "#define ANL_CPP_BAKED_WIDTH " + std::to_string(Map.Width) + "\n";
+	Defines += "#define ANL_CPP_BAKED_HEIGHT " + std::to_string(Map.Height) + "\n";
+	Define("ANL_CPP_BAKED_START_X", Map.StartX);
+	Define("ANL_CPP_BAKED_START_Y", Map.StartY);
+	Define("ANL_CPP_BAKED_STEP_X", Map.StepX);
+	Define("ANL_CPP_BAKED_STEP_Y", Map.StepY);
+	Define("ANL_CPP_BAKED_LOW", Low);
+	Define("ANL_CPP_BAKED_QUANTUM", Quantum);
+
+	std::string Samples;
+	for (std::size_t n = 0; n < Map.Samples.size(); ++n)
+	{
+		// NaN is stored as Low and the infinities as the nearest extreme
+		double Level = Quantum > 0.0 ? (Map.Samples[n] - Low) / Quantum : 0.0;
+		Level = Level > 0.0 ? (Level < 65535.0 ? Level : 65535.0) : 0.0;
+		Samples += (n % 16 == 0 ? "\t\t" : " ") + std::to_string((unsigned int)(Level + 0.5)) + ",";
+		if (n % 16 == 15 || n + 1 == Map.Samples.size())
+			Samples += "\n";
+	}
+	return Samples;
+}
+
+void OutputFullCppFile(const ANLtoC::KernelCode& Code, std::string HeaderFileName, std::string InternalHeaderFileName, std::string& SourceFile, std::string& HeaderFile, std::string& InternalHeaderFile, std::vector<std::string>& PartFiles, const ANLtoC::TranspileOptions& Options)
+{
+	SourceFile = OutputString;
+	HeaderFile = HeaderOutput;
+	InternalHeaderFile.clear();
+	PartFiles.clear();
+
+	// the instrumented build's counters are runtime types, its functions use them
+	std::string RuntimeTypes = RuntimeTypesOutput;
+	if (Options.ProfileInstrumentation)
+	{
+		std::string ProfileRuntime = ProfileRuntimeOutput;
+		ReplaceToken(ProfileRuntime, ProfileNodeCountReplaceToken, std::to_string(Code.ProfileNodeCount));
+		RuntimeTypes += ProfileRuntime;
+	}
+
+	const std::vector<ANLtoC::FunctionData>& FunctionList = Code.Functions;
+	std::string AdditionalFunctionString;
+	if (Options.SplitSourceCount > 0)
+	{
+		// every function is declared in the internal header, so each part gets an even share of the code in any order
+		std::size_t TotalSize = 1;
+		for (const ANLtoC::FunctionData& d : FunctionList)
+			TotalSize += d.FunctionImplementation.size();
+
+		std::string Declarations;
+		std::vector<std::string> PartFunctions(Options.SplitSourceCount);
+		std::size_t Written = 0;
+		for (const ANLtoC::FunctionData& d : FunctionList)
+		{
+			std::size_t Part = Written * PartFunctions.size() / TotalSize;
+			PartFunctions[Part] += d.FunctionImplementation + "\n";
+			Written += d.FunctionImplementation.size();
+			Declarations += d.FunctionImplementation.substr(0, d.FunctionImplementation.find("\n{")) + ";\n";
+		}
+
+		InternalHeaderFile = InternalHeaderOutput;
+		ReplaceToken(InternalHeaderFile, RuntimeTypesReplaceToken, RuntimeTypes);
+		ReplaceToken(InternalHeaderFile, HeaderFileNameReplaceToken, HeaderFileName);
+		ReplaceToken(InternalHeaderFile, RuntimeDeclarationsReplaceToken, RuntimeDeclarationsOutput);
+		ReplaceToken(InternalHeaderFile, AdditionalFunctionsReplaceToken, Declarations);
+
+		for (const std::string& Functions : PartFunctions)
+		{
+			std::string Part = PartOutput;
+			ReplaceToken(Part, InternalHeaderFileNameReplaceToken, InternalHeaderFileName);
+			ReplaceToken(Part, AdditionalFunctionsReplaceToken, Functions);
+			PartFiles.push_back(Part);
+		}
+
+		ReplaceToken(SourceFile, RuntimeTypesReplaceToken, "#include \"" + InternalHeaderFileName + "\"\n");
+	}
+	else
+	{
+		for (ANLtoC::FunctionData d : FunctionList)
+		{
+			AdditionalFunctionString += d.FunctionImplementation;
+			AdditionalFunctionString += "\n";
+		}
+
+		ReplaceToken(SourceFile, RuntimeTypesReplaceToken, RuntimeTypes);
+		ReplaceToken(SourceFile, HeaderFileNameReplaceToken, HeaderFileName);
+	}
+
+	ReplaceToken(SourceFile, CoherentBasesReplaceToken, CoherentCellularOutput + CoherentLatticeOutput);
+	ReplaceToken(SourceFile, CodeReplaceToken, Code.Evaluate);
+	ReplaceToken(SourceFile, Map2DReplaceToken, Code.Map2D);
+	ReplaceToken(SourceFile, Map3DReplaceToken, Code.Map3D);
+	ReplaceToken(SourceFile, AdditionalFunctionsReplaceToken, AdditionalFunctionString);
+	// ANL_CPP_RGBA is always declared since the runtime uses it, the entry points only exist for color kernels
+	std::string RGBAFunctions;
+	if (!Code.EvaluateRGBA.empty())
+	{
+		RGBAFunctions = RGBAOutput;
+		ReplaceToken(RGBAFunctions, CodeReplaceToken, Code.EvaluateRGBA);
+		ReplaceToken(RGBAFunctions, Map2DReplaceToken, Code.MapRGBA2D);
+	}
+	ReplaceToken(SourceFile, RGBAFunctionsReplaceToken, RGBAFunctions);
+	ReplaceToken(HeaderFile, RGBAFunctionsReplaceToken, Code.EvaluateRGBA.empty() ? std::string() : RGBAHeaderOutput);
+	std::string Extensions = ReductionOutput;
+	std::string HeaderExtensions;
+	if (!Code.EvaluateOutputs.empty())
+	{
+		std::string Outputs = OutputsOutput;
+		ReplaceToken(Outputs, CodeReplaceToken, Code.EvaluateOutputs);
+		ReplaceToken(Outputs, Map2DReplaceToken, Code.MapOutputs2D);
+		ReplaceToken(Outputs, Map3DReplaceToken, Code.MapOutputs3D);
+		Extensions += Outputs;
+		std::string OutputsHeader = OutputsHeaderOutput;
+		ReplaceToken(OutputsHeader, OutputsReplaceToken, Code.OutputsStructGuts);
+		HeaderExtensions += OutputsHeader;
+	}
+	if (Options.ChunkService)
+	{
+		Extensions += ChunkServiceOutput;
+		HeaderExtensions += ChunkServiceHeaderOutput;
+	}
+	if (Options.TileCache)
+	{
+		Extensions += TileCacheOutput;
+		HeaderExtensions += TileCacheHeaderOutput;
+	}
+	if (Options.RetainedMap)
+	{
+		std::string Retained = RetainedMapOutput;
+		ReplaceToken(Retained, RetainedBufferCountReplaceToken, std::to_string(Code.RetainedBufferCount));
+		ReplaceToken(Retained, CodeReplaceToken, Code.RetainedUpdate);
+		Extensions += Retained;
+		HeaderExtensions += RetainedMapHeaderOutput;
+	}
+	if (Options.AdaptiveMap)
+	{
+		Extensions += AdaptiveMapOutput;
+		HeaderExtensions += AdaptiveMapHeaderOutput;
+	}
+	if (Options.QuantizedMap)
+	{
+		std::string Quantized = QuantizedMapOutput;
+		ReplaceToken(Quantized, Map2DReplaceToken, Code.MapQuantized2D);
+		ReplaceToken(Quantized, Map3DReplaceToken, Code.MapQuantized3D);
+		Extensions += Quantized;
+		HeaderExtensions += QuantizedMapHeaderOutput;
+	}
+	if (Options.SeamlessMap)
+	{
+		std::string Seamless = SeamlessMapOutput;
+		ReplaceToken(Seamless, Map2DReplaceToken, Code.MapSeamless2D);
+		ReplaceToken(Seamless, Map3DReplaceToken, Code.MapSeamless3D);
+		Extensions += Seamless;
+		HeaderExtensions += SeamlessMapHeaderOutput;
+	}
+	if (Options.Baked)
+	{
+		std::string Baked = BakedMapOutput;
+		std::string BakedDefines;
+		ReplaceToken(Baked, CodeReplaceToken, BakedSamplesToC(*Options.Baked, BakedDefines));
+		Extensions += Baked;
+		std::string BakedHeader = BakedMapHeaderOutput;
+		ReplaceToken(BakedHeader, SettingsReplaceToken, BakedDefines);
+		HeaderExtensions += BakedHeader;
+	}
+	if (Options.ProfileInstrumentation)
+	{
+		std::string Profile = ProfileOutput;
+		char ProfileHash[32];
+		snprintf(ProfileHash, sizeof(ProfileHash), "0x%016llx", (unsigned long long)Code.ProfileHash);
+		ReplaceToken(Profile, ProfileHashReplaceToken, ProfileHash);
+		Extensions += Profile;
+		HeaderExtensions += ProfileHeaderOutput;
+	}
+	ReplaceToken(SourceFile, ExtensionsReplaceToken, Extensions);
+	ReplaceToken(HeaderFile, ExtensionsReplaceToken, HeaderExtensions);
+	std::string Settings = FastMathDescriptions[Options.FastMathLevel];
+	Settings += "#define ANL_CPP_FAST_MATH_LEVEL " + std::to_string(Options.FastMathLevel) + "\n";
+	char KernelHash[32];
+	snprintf(KernelHash, sizeof(KernelHash), "0x%016llxull", (unsigned long long)Code.KernelHash);
+	Settings += "// changes with the kernel and every option that changes its values\n";
+	Settings += "#define ANL_CPP_KERNEL_HASH " + std::string(KernelHash) + "\n";
+	ReplaceToken(HeaderFile, SettingsReplaceToken, Settings);
+	ReplaceToken(HeaderFile, NamedInputReplaceToken, Code.NamedInputStructGuts);
+}
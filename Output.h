@@ -5,5 +5,8 @@
 /////////////////////////////////////////
 
 #include <string>
+#include <vector>
 
-void OutputFullCppFile(std::string CppExpressionToExecute, std::string NamedInputStructGuts, std::string HeaderFileName, std::string& SourceFile, std::string& HeaderFile, const std::vector<ANLtoC::FunctionData>& FunctionList);
+// InternalHeaderFile and PartFiles are only filled when Options.SplitSourceCount > 0, every
+// part includes the internal header by InternalHeaderFileName
+void OutputFullCppFile(const ANLtoC::KernelCode& Code, std::string HeaderFileName, std::string InternalHeaderFileName, std::string& SourceFile, std::string& HeaderFile, std::string& InternalHeaderFile, std::vector<std::string>& PartFiles, const ANLtoC::TranspileOptions& Options);
@@ -0,0 +1,264 @@
+/////////////////////////////////////////
+//
+// File Header Place Holder
+//
+/////////////////////////////////////////
+
+#include "Render.h"
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include <accidental-noise-library/VM/kernel.h>
+#include <accidental-noise-library/VM/vm.h>
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+namespace {
+	// an output file of fixed size, written through windows mapped one band at a time
+	class MappedFile
+	{
+	public:
+		~MappedFile()
+		{
+#ifdef _WIN32
+			if (Mapping != nullptr)
+				CloseHandle(Mapping);
+			if (File != INVALID_HANDLE_VALUE)
+				CloseHandle(File);
+#else
+			if (File >= 0)
+				close(File);
+#endif
+		}
+
+		bool Create(const std::string& FileName, std::uint64_t Size)
+		{
+#ifdef _WIN32
+			SYSTEM_INFO System;
+			GetSystemInfo(&System);
+			Granularity = System.dwAllocationGranularity;
+			File = CreateFileA(FileName.c_str(), GENERIC_READ | GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+			if (File == INVALID_HANDLE_VALUE)
+				return false;
+			Mapping = CreateFileMappingA(File, nullptr, PAGE_READWRITE, (DWORD)(Size >> 32), (DWORD)Size, nullptr);
+			return Mapping != nullptr;
+#else
+			Granularity = (std::uint64_t)sysconf(_SC_PAGESIZE);
+			File = open(FileName.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+			return File >= 0 && ftruncate(File, (off_t)Size) == 0;
+#endif
+		}
+
+		// a view of Size bytes at Offset, unmapped when it goes out of scope
+		class View
+		{
+		public:
+			View(MappedFile& Owner, std::uint64_t Offset, std::size_t Size)
+			{
+				// views must start on the allocation granularity, so the bytes before Offset are mapped too
+				const std::uint64_t Start = Offset - Offset % Owner.Granularity;
+				Length = (std::size_t)(Offset - Start) + Size;
+#ifdef _WIN32
+				Base = MapViewOfFile(Owner.Mapping, FILE_MAP_WRITE, (DWORD)(Start >> 32), (DWORD)Start, Length);
+#else
+				Base = mmap(nullptr, Length, PROT_READ | PROT_WRITE, MAP_SHARED, Owner.File, (off_t)Start);
+				if (Base == MAP_FAILED)
+					Base = nullptr;
+#endif
+				if (Base != nullptr)
+					Bytes = static_cast<unsigned char*>(Base) + (Offset - Start);
+			}
+
+			~View()
+			{
+#ifdef _WIN32
+				if (Base != nullptr)
+					UnmapViewOfFile(Base);
+#else
+				if (Base != nullptr)
+					munmap(Base, Length);
+#endif
+			}
+
+			View(const View&) = delete;
+			View& operator=(const View&) = delete;
+
+			// null if the mapping failed
+			unsigned char* Bytes = nullptr;
+
+		private:
+			void* Base = nullptr;
+			std::size_t Length = 0;
+		};
+
+	private:
+		std::uint64_t Granularity = 1;
+#ifdef _WIN32
+		HANDLE File = INVALID_HANDLE_VALUE;
+		HANDLE Mapping = nullptr;
+#else
+		int File = -1;
+#endif
+	};
+
+	bool IsLittleEndian()
+	{
+		const std::uint16_t Probe = 1;
+		unsigned char First;
+		std::memcpy(&First, &Probe, 1);
+		return First == 1;
+	}
+
+	std::size_t BytesPerSample(RenderSettings::FileFormat Format)
+	{
+		return Format == RenderSettings::PGM ? 2 : 4;
+	}
+
+	std::string FileHeader(const RenderSettings& Settings, int Rows)
+	{
+		const std::string Size = std::to_string(Settings.Width) + " " + std::to_string(Rows) + "\n";
+		switch (Settings.Format)
+		{
+		case RenderSettings::PFM:
+			// the sign of the scale gives the byte order of the samples
+			return "Pf\n" + Size + (IsLittleEndian() ? "-1.0\n" : "1.0\n");
+		case RenderSettings::PGM:
+			return "P5\n" + Size + "65535\n";
+		default:
+			return std::string();
+		}
+	}
+
+	void StoreSample(const RenderSettings& Settings, double Value, unsigned char* Destination)
+	{
+		if (Settings.Format == RenderSettings::PGM)
+		{
+			// written so NaN stores 0
+			double Level = (Value - Settings.Low) / (Settings.High - Settings.Low) * 65535.0;
+			Level = Level > 0.0 ? Level : 0.0;
+			Level = Level < 65535.0 ? Level : 65535.0;
+			const unsigned int Quantized = (unsigned int)(Level + 0.5);
+			Destination[0] = (unsigned char)(Quantized >> 8);
+			Destination[1] = (unsigned char)Quantized;
+			return;
+		}
+		const float Sample = (float)Value;
+		std::memcpy(Destination, &Sample, sizeof(Sample));
+	}
+}
+
+int RenderKernel(anl::CKernel& Kernel, const anl::CInstructionIndex& Root, const RenderSettings& Settings)
+{
+	anl::InstructionListType& k = *Kernel.getKernel();
+	for (auto& Input : Settings.NamedInputs)
+	{
+		bool Found = false;
+		for (anl::SInstruction& Instruction : k)
+		{
+			if (Instruction.opcode_ == anl::OP_NamedInput && Instruction.namedInput == Input.first)
+			{
+				Instruction.outfloat_ = Input.second;
+				Found = true;
+			}
+		}
+		if (!Found)
+		{
+			std::cerr << "The kernel has no named input " << Input.first << std::endl;
+			return -1;
+		}
+	}
+
+	// every slice of a volume is Height rows of the image
+	const bool Is3D = Settings.Depth > 0;
+	const int Rows = Settings.Height * (Is3D ? Settings.Depth : 1);
+	const std::size_t RowBytes = (std::size_t)Settings.Width * BytesPerSample(Settings.Format);
+	const std::string Header = FileHeader(Settings, Rows);
+
+	MappedFile Output;
+	if (!Output.Create(Settings.FileName, Header.size() + (std::uint64_t)RowBytes * Rows))
+	{
+		std::cerr << "Unable to create file: " << Settings.FileName << std::endl;
+		return -9;
+	}
+	if (!Header.empty())
+	{
+		MappedFile::View HeaderView(Output, 0, Header.size());
+		if (HeaderView.Bytes == nullptr)
+		{
+			std::cerr << "Unable to map file: " << Settings.FileName << std::endl;
+			return -9;
+		}
+		std::memcpy(HeaderView.Bytes, Header.data(), Header.size());
+	}
+
+	const int Band = Settings.RowsPerBand > 0 ? Settings.RowsPerBand : std::max(1, (1 << 20) / std::max(Settings.Width, 1));
+	const int BandCount = (Rows + Band - 1) / Band;
+	// PFM stores the bottom row first, so a band lands in the file in reverse order
+	const bool BottomUp = Settings.Format == RenderSettings::PFM;
+	std::atomic<int> NextBand(0);
+	std::atomic<bool> Failed(false);
+
+	auto Work = [&]()
+	{
+		// the executor keeps per evaluation state, so every thread gets its own
+		anl::CNoiseExecutor VM(Kernel);
+		for (int b = NextBand++; b < BandCount && !Failed; b = NextBand++)
+		{
+			const int First = b * Band;
+			const int Count = std::min(Band, Rows - First);
+			const int FirstFileRow = BottomUp ? Rows - First - Count : First;
+			MappedFile::View Window(Output, Header.size() + (std::uint64_t)RowBytes * FirstFileRow, RowBytes * Count);
+			if (Window.Bytes == nullptr)
+			{
+				Failed = true;
+				return;
+			}
+
+			for (int Row = First; Row < First + Count; ++Row)
+			{
+				const int j = Row % Settings.Height;
+				const int Slice = Row / Settings.Height;
+				const int FileRow = BottomUp ? Rows - 1 - Row : Row;
+				unsigned char* Destination = Window.Bytes + RowBytes * (FileRow - FirstFileRow);
+				const double y = Settings.StartY + Settings.StepY * j;
+				const double z = Settings.StartZ + Settings.StepZ * Slice;
+				for (int i = 0; i < Settings.Width; ++i)
+				{
+					const double x = Settings.StartX + Settings.StepX * i;
+					const double Value = Is3D ? VM.evaluateScalar(x, y, z, Root) : VM.evaluateScalar(x, y, Root);
+					StoreSample(Settings, Value, Destination + BytesPerSample(Settings.Format) * i);
+				}
+			}
+		}
+	};
+
+	unsigned int ThreadCount = Settings.ThreadCount > 0 ? Settings.ThreadCount : std::max(1u, std::thread::hardware_concurrency());
+	ThreadCount = std::min(ThreadCount, (unsigned int)std::max(BandCount, 1));
+	std::vector<std::thread> Threads;
+	for (unsigned int t = 1; t < ThreadCount; ++t)
+		Threads.emplace_back(Work);
+	Work();
+	for (std::thread& Thread : Threads)
+		Thread.join();
+
+	if (Failed)
+	{
+		std::cerr << "Unable to map file: " << Settings.FileName << std::endl;
+		return -9;
+	}
+	return 0;
+}
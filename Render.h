@@ -0,0 +1,47 @@
+/////////////////////////////////////////
+//
+// File Header Place Holder
+//
+/////////////////////////////////////////
+
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace anl {
+	class CKernel;
+	class CInstructionIndex;
+}
+
+struct RenderSettings
+{
+	enum FileFormat
+	{
+		// 32 bit floats in native byte order, no header
+		Raw,
+		// grayscale PFM in native byte order, given by the sign of the scale, stored bottom row first as the format requires
+		PFM,
+		// binary 16 bit PGM, Low to High mapped to 0 to 65535
+		PGM
+	};
+
+	std::string FileName;
+	FileFormat Format = Raw;
+	// Depth 0 renders a 2D region, otherwise the slices of the volume are stacked below one another into
+	// Height * Depth rows, which must fit in an int
+	int Width = 0, Height = 0, Depth = 0;
+	double StartX = 0.0, StartY = 0.0, StartZ = 0.0;
+	double StepX = 1.0, StepY = 1.0, StepZ = 1.0;
+	double Low = 0.0, High = 1.0;
+	// 0 uses std::thread::hardware_concurrency()
+	unsigned int ThreadCount = 0;
+	// rows mapped and written at a time by each thread, 0 picks bands of about a million samples
+	int RowsPerBand = 0;
+	// values replacing the defaults of the kernel's named inputs
+	std::vector<std::pair<std::string, double>> NamedInputs;
+};
+
+// Evaluates Root over the region with the noise VM, a thread per band of rows, writing each band straight
+// into a memory mapped window of the output file so memory use doesn't grow with the image.
+// Returns 0 or the exit code of the failure, which has been reported.
+int RenderKernel(anl::CKernel& Kernel, const anl::CInstructionIndex& Root, const RenderSettings& Settings);
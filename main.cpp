@@ -9,8 +9,15 @@
 #include <string>
 #include <stdio.h>
 #include <memory>
+#include <vector>
+#include <cstdlib>
+#include <climits>
+#include <cmath>
 #include <ctime>
+#include <cctype>
+#include <utility>
 #include "Output.h"
+#include "Render.h"
 
 #define ANL_IMPLEMENTATION
 // ANL is currently in a transition to a single file format, thus
@@ -48,25 +55,475 @@ std::string GetDirectory(std::string file)
 	return file.substr(0, Seperator);
 }
 
+bool ParseIntegerOption(const char* Text, long Min, long Max, long& Value)
+{
+	char* End = nullptr;
+	Value = strtol(Text, &End, 10);
+	return End != Text && *End == 0 && Value >= Min && Value <= Max;
+}
+
+bool ParseNumberOption(const char* Text, double Min, double Max, double& Value)
+{
+	char* End = nullptr;
+	Value = strtod(Text, &End);
+	return End != Text && *End == 0 && Value >= Min && Value <= Max;
+}
+
+// returns 0 or the exit code of the failure, which has been reported
+int ReadInputFile(const std::string& FileName, std::string& Text)
+{
+	FILE* f = fopen(FileName.c_str(), "r");
+	if (f == nullptr) {
+		std::cerr << "Unable to open file: " << FileName << std::endl;
+		return -9;
+	}
+	if (fseek(f, 0, SEEK_END) != 0) {
+		std::cerr << "Seek Error for file: " << FileName << std::endl;
+		return -10;
+	}
+
+	long FileLength = ftell(f);
+
+	if (fseek(f, 0, SEEK_SET) != 0) {
+		std::cerr << "Seek Error for file: " << FileName << std::endl;
+		return -10;
+	}
+
+	auto Buffer = std::make_unique<uint8_t[]>(FileLength+1);
+	size_t AmountRead = fread(Buffer.get(), 1, FileLength, f);
+	if (AmountRead != FileLength && feof(f) == 0) {
+		std::cerr << "Read Error for file: " << FileName << std::endl;
+		return -10;
+	}
+	fclose(f);
+	Buffer[AmountRead] = 0;
+	Text = (char*)Buffer.get();
+	return 0;
+}
+
+// returns 0 or the exit code of the failure, which has been reported
+int ParseInputFile(const std::string& FileName, std::unique_ptr<anl::lang::NoiseParser>& NoiseParser)
+{
+	std::string FullText;
+	int Result = ReadInputFile(FileName, FullText);
+	if (Result != 0)
+		return Result;
+
+	NoiseParser = std::make_unique<anl::lang::NoiseParser>(FullText);
+
+	bool success = NoiseParser->Parse();
+	if (!success)
+	{
+		auto ErrorMessages = NoiseParser->FormErrorMsgs();
+		std::cerr << "Error parsing TerrainV noise file: " << FileName
+			<< "\nErrors:\n" << ErrorMessages
+			<< "\n\n Contents of \"" << FileName
+			<< "\"\n" << FullText << std::endl;
+		return -30;
+	}
+	return 0;
+}
+
+bool IsIdentifier(const std::string& Name)
+{
+	if (Name.empty() || isdigit((unsigned char)Name[0]))
+		return false;
+	for (char c : Name)
+	{
+		if (!isalnum((unsigned char)c) && c != '_')
+			return false;
+	}
+	return true;
+}
+
+bool WriteOutputFile(const std::string& FileName, const std::string& Contents)
+{
+	FILE* f = fopen(FileName.c_str(), "w");
+	if (f == nullptr) {
+		std::cerr << "Unable to open file: " << FileName << std::endl;
+		return false;
+	}
+
+	size_t AmountWritten = fwrite(Contents.c_str(), 1, Contents.size(), f);
+	if (AmountWritten != Contents.size())
+	{
+		std::cerr << "Write failed to file: " << FileName << std::endl;
+	}
+
+	fclose(f);
+	return true;
+}
+
+// a comma separated list of 1 to MaxCount numbers
+bool ParseNumberList(const char* Text, std::size_t MaxCount, std::vector<double>& Values)
+{
+	Values.clear();
+	for (;;)
+	{
+		char* End = nullptr;
+		double Value = strtod(Text, &End);
+		if (End == Text || Values.size() == MaxCount)
+			return false;
+		Values.push_back(Value);
+		if (*End == 0)
+			return true;
+		if (*End != ',')
+			return false;
+		Text = End + 1;
+	}
+}
+
+// ANLTranspiler render [options] input.anl output Width Height [Depth]
+int RenderCommand(int argc, char* argv[])
+{
+	RenderSettings Settings;
+	std::vector<std::string> Positional;
+	std::string Format;
+	std::vector<double> Values;
+	for (int a = 2; a < argc; ++a)
+	{
+		std::string Arg = argv[a];
+		if (Arg == "--origin" && a + 1 < argc)
+		{
+			if (!ParseNumberList(argv[++a], 3, Values) || Values.size() < 2)
+			{
+				std::cerr << "Invalid origin, expected X,Y or X,Y,Z: " << argv[a] << std::endl;
+				return -1;
+			}
+			Settings.StartX = Values[0];
+			Settings.StartY = Values[1];
+			Settings.StartZ = Values.size() > 2 ? Values[2] : 0.0;
+		}
+		else if (Arg == "--step" && a + 1 < argc)
+		{
+			if (!ParseNumberList(argv[++a], 3, Values) || Values.size() == 2)
+			{
+				std::cerr << "Invalid step, expected S or SX,SY,SZ: " << argv[a] << std::endl;
+				return -1;
+			}
+			Settings.StepX = Values[0];
+			Settings.StepY = Values.size() > 1 ? Values[1] : Values[0];
+			Settings.StepZ = Values.size() > 2 ? Values[2] : Values[0];
+		}
+		else if (Arg == "--range" && a + 1 < argc)
+		{
+			if (!ParseNumberList(argv[++a], 2, Values) || Values.size() != 2 || Values[0] == Values[1])
+			{
+				std::cerr << "Invalid range, expected Low,High: " << argv[a] << std::endl;
+				return -1;
+			}
+			Settings.Low = Values[0];
+			Settings.High = Values[1];
+		}
+		else if (Arg == "--format" && a + 1 < argc)
+		{
+			Format = argv[++a];
+		}
+		else if (Arg == "--threads" && a + 1 < argc)
+		{
+			long Value;
+			if (!ParseIntegerOption(argv[++a], 0, 1024, Value))
+			{
+				std::cerr << "Invalid thread count: " << argv[a] << std::endl;
+				return -1;
+			}
+			Settings.ThreadCount = (unsigned int)Value;
+		}
+		else if (Arg == "--band-rows" && a + 1 < argc)
+		{
+			long Value;
+			if (!ParseIntegerOption(argv[++a], 0, INT_MAX, Value))
+			{
+				std::cerr << "Invalid band rows: " << argv[a] << std::endl;
+				return -1;
+			}
+			Settings.RowsPerBand = (int)Value;
+		}
+		else if (Arg == "--input" && a + 1 < argc)
+		{
+			std::string Input = argv[++a];
+			std::string::size_type Equals = Input.find('=');
+			double Value;
+			if (Equals == std::string::npos || !IsIdentifier(Input.substr(0, Equals)) ||
+				!ParseNumberOption(Input.c_str() + Equals + 1, -HUGE_VAL, HUGE_VAL, Value))
+			{
+				std::cerr << "Invalid named input, expected Name=Value: " << Input << std::endl;
+				return -1;
+			}
+			Settings.NamedInputs.emplace_back(Input.substr(0, Equals), Value);
+		}
+		else if (Arg.compare(0, 2, "--") == 0)
+		{
+			std::cerr << "Unknown option: " << Arg << std::endl;
+			return -1;
+		}
+		else
+			Positional.push_back(Arg);
+	}
+
+	long Size[3] = { 0, 0, 0 };
+	bool ValidSize = Positional.size() == 4 || Positional.size() == 5;
+	for (std::size_t n = 2; ValidSize && n < Positional.size(); ++n)
+		ValidSize = ParseIntegerOption(Positional[n].c_str(), 1, INT_MAX, Size[n - 2]);
+	if (!ValidSize)
+	{
+		std::cerr << "USAGE: ANLTranspiler.exe render [options] anlLangSourceFile.anl output Width Height [Depth]" << std::endl;
+		std::cerr << "  Evaluates the kernel with the noise VM over Width x Height samples, or a volume of" << std::endl;
+		std::cerr << "  Depth such slices stacked top to bottom, streaming bands of rows into the output" << std::endl;
+		std::cerr << "  --origin X,Y[,Z]  position of the first sample (default 0,0,0)" << std::endl;
+		std::cerr << "  --step S|SX,SY,SZ  distance between neighbouring samples (default 1)" << std::endl;
+		std::cerr << "  --format raw|pfm|pgm  32 bit floats, a PFM image or a 16 bit PGM image, by default" << std::endl;
+		std::cerr << "    taken from the output's extension with raw for any other" << std::endl;
+		std::cerr << "  --range Low,High  values mapped to black and white in a PGM image (default 0,1)" << std::endl;
+		std::cerr << "  --threads N  0 (default) uses every hardware thread" << std::endl;
+		std::cerr << "  --band-rows N  rows each thread maps and writes at a time, 0 (default) picks" << std::endl;
+		std::cerr << "    bands of about a million samples" << std::endl;
+		std::cerr << "  --input Name=Value  replaces the default value of a named input" << std::endl;
+		return Positional.empty() ? 0 : -1;
+	}
+	Settings.FileName = Positional[1];
+	// the slices of a volume are stacked into one image of Height * Depth rows
+	if (Size[2] > 0 && Size[1] > INT_MAX / Size[2])
+	{
+		std::cerr << "Height * Depth can't exceed " << INT_MAX << " rows" << std::endl;
+		return -1;
+	}
+	Settings.Width = (int)Size[0];
+	Settings.Height = (int)Size[1];
+	Settings.Depth = (int)Size[2];
+
+	if (Format.empty())
+	{
+		std::string Name = GetFileName(Settings.FileName);
+		std::string::size_type Dot = Name.find_last_of('.');
+		if (Dot != std::string::npos)
+			Format = Name.substr(Dot + 1);
+		for (char& c : Format)
+			c = (char)tolower((unsigned char)c);
+		if (Format != "pfm" && Format != "pgm")
+			Format = "raw";
+	}
+	if (Format == "raw")
+		Settings.Format = RenderSettings::Raw;
+	else if (Format == "pfm")
+		Settings.Format = RenderSettings::PFM;
+	else if (Format == "pgm")
+		Settings.Format = RenderSettings::PGM;
+	else
+	{
+		std::cerr << "Unknown format: " << Format << std::endl;
+		return -1;
+	}
+
+	std::unique_ptr<anl::lang::NoiseParser> NoiseParser;
+	int ParseResult = ParseInputFile(Positional[0], NoiseParser);
+	if (ParseResult != 0)
+		return ParseResult;
+	return RenderKernel(NoiseParser->GetKernel(), NoiseParser->GetParseResult(), Settings);
+}
+
 int main(int argc, char* argv[])
 {
-	if (argc < 2)
+	if (argc > 1 && std::string(argv[1]) == "render")
+		return RenderCommand(argc, argv);
+
+	ANLtoC::TranspileOptions Options;
+	std::vector<std::string> Positional;
+	// name and source file of each --output
+	std::vector<std::pair<std::string, std::string>> OutputFiles;
+	std::string ProfileFileName;
+	// region evaluated for ANL_CPP_SampleBaked, no samples unless --bake is given
+	ANLtoC::BakedMap Baked;
+	std::vector<double> Values;
+	for (int a = 1; a < argc; ++a)
+	{
+		std::string Arg = argv[a];
+		if (Arg == "--fast-math-level" && a + 1 < argc)
+		{
+			long Level;
+			if (!ParseIntegerOption(argv[++a], 0, ANLtoC::TranspileOptions::MaxFastMathLevel, Level))
+			{
+				std::cerr << "Invalid fast math level: " << argv[a] << std::endl;
+				return -1;
+			}
+			Options.FastMathLevel = (int)Level;
+		}
+		else if (Arg == "--outline-budget" && a + 1 < argc)
+		{
+			long Budget;
+			if (!ParseIntegerOption(argv[++a], 0, LONG_MAX, Budget))
+			{
+				std::cerr << "Invalid outline budget: " << argv[a] << std::endl;
+				return -1;
+			}
+			Options.OutlineBudget = (std::size_t)Budget;
+		}
+		else if (Arg == "--split-sources" && a + 1 < argc)
+		{
+			long Count;
+			if (!ParseIntegerOption(argv[++a], 0, 1024, Count))
+			{
+				std::cerr << "Invalid split source count: " << argv[a] << std::endl;
+				return -1;
+			}
+			Options.SplitSourceCount = (int)Count;
+		}
+		else if (Arg == "--tabulate" && a + 1 < argc)
+		{
+			if (!ParseNumberOption(argv[++a], 0.0, 1.0, Options.TabulationTolerance))
+			{
+				std::cerr << "Invalid tabulation tolerance: " << argv[a] << std::endl;
+				return -1;
+			}
+		}
+		else if (Arg == "--chunk-service")
+		{
+			Options.ChunkService = true;
+		}
+		else if (Arg == "--tile-cache")
+		{
+			Options.TileCache = true;
+		}
+		else if (Arg == "--retained-map")
+		{
+			Options.RetainedMap = true;
+		}
+		else if (Arg == "--adaptive-map")
+		{
+			Options.AdaptiveMap = true;
+		}
+		else if (Arg == "--quantized-map")
+		{
+			Options.QuantizedMap = true;
+		}
+		else if (Arg == "--seamless-map")
+		{
+			Options.SeamlessMap = true;
+		}
+		else if (Arg == "--bake" && a + 1 < argc)
+		{
+			if (!ParseNumberList(argv[++a], 2, Values) || Values.size() != 2 || Values[0] < 1 || Values[1] < 1 ||
+				Values[0] * Values[1] > INT_MAX || Values[0] != (int)Values[0] || Values[1] != (int)Values[1])
+			{
+				std::cerr << "Invalid baked size, expected Width,Height: " << argv[a] << std::endl;
+				return -1;
+			}
+			Baked.Width = (int)Values[0];
+			Baked.Height = (int)Values[1];
+		}
+		else if (Arg == "--bake-origin" && a + 1 < argc)
+		{
+			if (!ParseNumberList(argv[++a], 2, Values) || Values.size() != 2)
+			{
+				std::cerr << "Invalid baked origin, expected X,Y: " << argv[a] << std::endl;
+				return -1;
+			}
+			Baked.StartX = Values[0];
+			Baked.StartY = Values[1];
+		}
+		else if (Arg == "--bake-step" && a + 1 < argc)
+		{
+			if (!ParseNumberList(argv[++a], 2, Values) || Values[0] == 0.0 || Values.back() == 0.0)
+			{
+				std::cerr << "Invalid baked step, expected S or SX,SY: " << argv[a] << std::endl;
+				return -1;
+			}
+			Baked.StepX = Values[0];
+			Baked.StepY = Values.back();
+		}
+		else if (Arg == "--instrument")
+		{
+			Options.ProfileInstrumentation = true;
+		}
+		else if (Arg == "--profile" && a + 1 < argc)
+		{
+			ProfileFileName = argv[++a];
+		}
+		else if (Arg == "--output" && a + 1 < argc)
+		{
+			std::string Output = argv[++a];
+			std::string::size_type Equals = Output.find('=');
+			std::string Name = Output.substr(0, Equals);
+			if (Equals == std::string::npos || !IsIdentifier(Name))
+			{
+				std::cerr << "Invalid output, expected Name=file.anl: " << Output << std::endl;
+				return -1;
+			}
+			for (auto& Existing : OutputFiles)
+			{
+				if (Existing.first == Name)
+				{
+					std::cerr << "Duplicate output name: " << Name << std::endl;
+					return -1;
+				}
+			}
+			OutputFiles.emplace_back(Name, Output.substr(Equals + 1));
+		}
+		else if (Arg.compare(0, 2, "--") == 0)
+		{
+			std::cerr << "Unknown option: " << Arg << std::endl;
+			return -1;
+		}
+		else
+			Positional.push_back(Arg);
+	}
+
+	if (Positional.size() < 1)
 	{
 		std::cerr << "Missing arguments." << std::endl;
-		std::cerr << "USAGE: ANLTranspiler.exe anlLangSourceFile.anl output.cpp output.h" << std::endl;
+		std::cerr << "USAGE: ANLTranspiler.exe [options] anlLangSourceFile.anl output.cpp output.h" << std::endl;
+		std::cerr << "       ANLTranspiler.exe render [options] anlLangSourceFile.anl output Width Height [Depth]" << std::endl;
 		std::cerr << "  The anlLangSourceFile.anl will be parsed and converted to an internal" << std::endl;
 		std::cerr << "  anl::CKernel which will then be converted to cplusplus and output as" << std::endl;
 		std::cerr << "  the provided source and header files" << std::endl;
+		std::cerr << "  --fast-math-level N  0 (default) calls the standard library for exp, pow and" << std::endl;
+		std::cerr << "    the trigonometric functions, 1 uses approximations accurate to a few ulp," << std::endl;
+		std::cerr << "    2 uses faster approximations accurate to about 5e-7" << std::endl;
+		std::cerr << "  --outline-budget N  subgraphs whose expression exceeds N characters are moved" << std::endl;
+		std::cerr << "    to their own function, 0 disables outlining (default 16384)" << std::endl;
+		std::cerr << "  --split-sources N  spreads the generated functions across N extra files" << std::endl;
+		std::cerr << "    output_part0.cpp ... sharing output_internal.h, so they compile in parallel" << std::endl;
+		std::cerr << "  --tabulate E  replaces costly chains of scalar operators applied to one noise basis" << std::endl;
+		std::cerr << "    with a table interpolated within the absolute error E, 0 disables (default)" << std::endl;
+		std::cerr << "  --chunk-service  also emits ANL_CPP_ChunkService, which evaluates map requests" << std::endl;
+		std::cerr << "    on a thread pool by priority with futures, callbacks and cancellation" << std::endl;
+		std::cerr << "  --tile-cache  also emits ANL_CPP_TileCache, which keeps map results in memory" << std::endl;
+		std::cerr << "    and memory mapped files keyed by the kernel hash, named inputs and region" << std::endl;
+		std::cerr << "  --retained-map  also emits ANL_CPP_RetainedMap2D, which keeps intermediate results" << std::endl;
+		std::cerr << "    of a region and only recomputes those depending on named inputs that changed" << std::endl;
+		std::cerr << "  --adaptive-map  also emits ANL_CPP_MapAdaptive, which evaluates a coarse grid and" << std::endl;
+		std::cerr << "    only refines the cells that interpolation doesn't approximate within a tolerance" << std::endl;
+		std::cerr << "  --quantized-map  also emits ANL_CPP_MapQuantized2D/3D, which write 8 or 16 bit" << std::endl;
+		std::cerr << "    integers or half floats with scale, bias, clamp and dithering from the grid loop" << std::endl;
+		std::cerr << "  --seamless-map  also emits ANL_CPP_MapSeamless2D/3D, which evaluate the kernel in 4D" << std::endl;
+		std::cerr << "    or 6D on precomputed circles on several threads, producing tiles that wrap" << std::endl;
+		std::cerr << "  --bake Width,Height  evaluates the kernel with the noise VM over Width x Height samples" << std::endl;
+		std::cerr << "    and embeds them as 16 bit integers, interpolated by ANL_CPP_SampleBaked" << std::endl;
+		std::cerr << "  --bake-origin X,Y  position of the first baked sample (default 0,0)" << std::endl;
+		std::cerr << "  --bake-step S|SX,SY  distance between neighbouring baked samples (default 1)" << std::endl;
+		std::cerr << "  --instrument  counts node evaluations and select outcomes in the generated code," << std::endl;
+		std::cerr << "    written by ANL_CPP_WriteProfile after a representative run" << std::endl;
+		std::cerr << "  --profile file  uses the counts written by an instrumented build of the same kernel" << std::endl;
+		std::cerr << "    to choose what is cached, outlined and tabulated and the order of select tests" << std::endl;
+		std::cerr << "  --output Name=file.anl  adds the root of file.anl as member Name of ANL_CPP_Outputs," << std::endl;
+		std::cerr << "    evaluated with every other output by ANL_CPP_EvalOutputs and ANL_CPP_MapOutputs2D/3D" << std::endl;
 		return 0;
 	}
 
-	std::string InputFileName = argv[1];
+	std::string InputFileName = Positional[0];
 	std::string OutputSourceFileName;
 	std::string OutputHeaderFileName;
-	if (argc > 2)
-		OutputSourceFileName = argv[2];
-	if (argc > 3)
-		OutputHeaderFileName = argv[3];
+	if (Positional.size() > 1)
+		OutputSourceFileName = Positional[1];
+	if (Positional.size() > 2)
+		OutputHeaderFileName = Positional[2];
+
+	// split sources sit next to the main source, named after it
+	std::string SourceStem = OutputSourceFileName;
+	std::string::size_type Extension = GetFileName(SourceStem).find_last_of('.');
+	if (Extension != std::string::npos)
+		SourceStem.erase(SourceStem.size() - GetFileName(SourceStem).size() + Extension);
+	std::string InternalHeaderFileName = GetFileName(SourceStem) + "_internal.h";
 
 	std::string HeaderFileRelativeToSource; // ie with any common directory information stripped
 	{
@@ -92,100 +549,90 @@ int main(int argc, char* argv[])
 			HeaderFileRelativeToSource = HeaderFile;
 	}
 
-	FILE* f = fopen(InputFileName.c_str(), "r");
-	if (f == nullptr) {
-		std::cerr << "Unable to open file: " << InputFileName << std::endl;
-		return -9;
-	}
-	if (fseek(f, 0, SEEK_END) != 0) {
-		std::cerr << "Seek Error for file: " << InputFileName << std::endl;
-		return -10;
-	}
-
-	long FileLength = ftell(f);
-
-	if (fseek(f, 0, SEEK_SET) != 0) {
-		std::cerr << "Seek Error for file: " << InputFileName << std::endl;
-		return -10;
-	}
-
-	std::string FullText;
+	if (!ProfileFileName.empty())
 	{
-		auto Buffer = std::make_unique<uint8_t[]>(FileLength+1);
-		size_t AmountRead = fread(Buffer.get(), 1, FileLength, f);
-		if (AmountRead != FileLength && feof(f) == 0) {
-			std::cerr << "Read Error for file: " << InputFileName << std::endl;
-			return -10;
+		std::string ProfileText;
+		int ReadResult = ReadInputFile(ProfileFileName, ProfileText);
+		if (ReadResult != 0)
+			return ReadResult;
+		std::shared_ptr<ANLtoC::KernelProfile> Profile = std::make_shared<ANLtoC::KernelProfile>();
+		if (!ANLtoC::ReadProfile(ProfileText, *Profile))
+		{
+			std::cerr << "Invalid profile file: " << ProfileFileName << std::endl;
+			return -1;
 		}
-		fclose(f);
-		Buffer[AmountRead] = 0;
-		FullText = (char*)Buffer.get();
+		Options.Profile = Profile;
 	}
 
 	std::unique_ptr<anl::lang::NoiseParser> NoiseParser;
-	NoiseParser = std::make_unique<anl::lang::NoiseParser>(FullText);
+	int ParseResult = ParseInputFile(InputFileName, NoiseParser);
+	if (ParseResult != 0)
+		return ParseResult;
 
-	bool success = NoiseParser->Parse();
-	if (!success)
+	// the outputs are copied into the input's kernel so they can share its cache
+	std::vector<ANLtoC::KernelOutput> Outputs;
+	for (auto& Output : OutputFiles)
 	{
-		auto ErrorMessages = NoiseParser->FormErrorMsgs();
-		std::cerr << "Error parsing TerrainV noise file: " << InputFileName
-			<< "\nErrors:\n" << ErrorMessages
-			<< "\n\n Contents of \"" << InputFileName
-			<< "\"\n" << FullText << std::endl;
-		return -30;
+		std::unique_ptr<anl::lang::NoiseParser> OutputParser;
+		ParseResult = ParseInputFile(Output.second, OutputParser);
+		if (ParseResult != 0)
+			return ParseResult;
+		unsigned int Root = ANLtoC::AppendKernel(NoiseParser->GetKernel(), OutputParser->GetKernel(), OutputParser->GetParseResult());
+		Outputs.push_back({ Output.first, Root });
 	}
-	else
-	{
-		std::string Code;
-		std::string HeaderFile;
-		std::string Struct;
-		std::vector<ANLtoC::FunctionData> FunctionList;
-		ANLtoC::KernelToC(NoiseParser->GetKernel(), NoiseParser->GetParseResult(), Code, Struct, FunctionList);
-		OutputFullCppFile(Code, Struct, HeaderFileRelativeToSource, Code, HeaderFile, FunctionList);
-		std::string header = "// Generated file - Do not edit. Generated by ANLTranspiler at ";
-		time_t CurrentTime = time(0);
-		header.append(ctime(&CurrentTime));
-		header.append("\n");
-		Code.insert(0, header);
-		HeaderFile.insert(0, header);
-		
-		if(OutputSourceFileName != "")
-		{
-			FILE* f = fopen(OutputSourceFileName.c_str(), "w");
-			if (f == nullptr) {
-				std::cerr << "Unable to open file: " << OutputSourceFileName << std::endl;
-				return -9;
-			}
 
-			size_t AmountWritten = fwrite(Code.c_str(), 1, Code.size(), f);
-			if (AmountWritten != Code.size())
+	if (Baked.Width > 0)
+	{
+		// the named inputs keep their defaults
+		anl::CNoiseExecutor VM(NoiseParser->GetKernel());
+		Baked.Samples.resize((std::size_t)Baked.Width * Baked.Height);
+		for (int j = 0; j < Baked.Height; ++j)
+		{
+			for (int i = 0; i < Baked.Width; ++i)
 			{
-				std::cerr << "Write failed to file: " << OutputSourceFileName << std::endl;
+				const double x = Baked.StartX + Baked.StepX * i;
+				const double y = Baked.StartY + Baked.StepY * j;
+				Baked.Samples[(std::size_t)j * Baked.Width + i] = VM.evaluateScalar(x, y, NoiseParser->GetParseResult());
 			}
-
-			fclose(f);
 		}
+		Options.Baked = std::make_shared<ANLtoC::BakedMap>(std::move(Baked));
+	}
 
-		if (OutputHeaderFileName != "")
-		{
-			FILE* f = fopen(OutputHeaderFileName.c_str(), "w");
-			if (f == nullptr) {
-				std::cerr << "Unable to open file: " << OutputHeaderFileName << std::endl;
-				return -9;
-			}
+	std::string Code;
+	std::string HeaderFile;
+	std::string InternalHeaderFile;
+	std::vector<std::string> PartFiles;
+	ANLtoC::KernelCode Generated;
+	ANLtoC::KernelToC(NoiseParser->GetKernel(), NoiseParser->GetParseResult(), Outputs, Generated, Options);
+	if (Options.Profile && !Generated.ProfileUsed)
+		std::cerr << "Note: the profile " << ProfileFileName << " was recorded for another kernel and is ignored" << std::endl;
+	if (Generated.VMFallbackCount > 0)
+		std::cerr << "Note: " << Generated.VMFallbackCount << " instruction(s) have no native translation and are evaluated by the noise VM" << std::endl;
+	OutputFullCppFile(Generated, HeaderFileRelativeToSource, InternalHeaderFileName, Code, HeaderFile, InternalHeaderFile, PartFiles, Options);
+	std::string header = "// Generated file - Do not edit. Generated by ANLTranspiler at ";
+	time_t CurrentTime = time(0);
+	header.append(ctime(&CurrentTime));
+	header.append("\n");
+	Code.insert(0, header);
+	HeaderFile.insert(0, header);
+	
+	if (OutputSourceFileName != "" && !WriteOutputFile(OutputSourceFileName, Code))
+		return -9;
 
-			size_t AmountWritten = fwrite(HeaderFile.c_str(), 1, HeaderFile.size(), f);
-			if (AmountWritten != HeaderFile.size())
-			{
-				std::cerr << "Write failed to file: " << OutputHeaderFileName << std::endl;
-			}
+	if (OutputHeaderFileName != "" && !WriteOutputFile(OutputHeaderFileName, HeaderFile))
+		return -9;
 
-			fclose(f);
-		}
+	if (OutputSourceFileName != "" && !InternalHeaderFile.empty())
+	{
+		if (!WriteOutputFile(SourceStem + "_internal.h", header + InternalHeaderFile))
+			return -9;
 
-		anl::CNoiseExecutor vm(NoiseParser->GetKernel());
-		double VMResult = vm.evaluateScalar(0.5, 0.5, NoiseParser->GetParseResult());
+		for (std::size_t Part = 0; Part < PartFiles.size(); ++Part)
+		{
+			std::string PartFileName = SourceStem + "_part" + std::to_string(Part) + ".cpp";
+			if (!WriteOutputFile(PartFileName, header + PartFiles[Part]))
+				return -9;
+		}
 	}
 
 	return 0;